@@ -0,0 +1,169 @@
+// Standalone benchmark for the stages used by the module: its own pixel
+// kernels from pixels.hpp, and the sanjuuni stages it calls, linked against
+// the same sanjuuni sources as binding.gyp. Build and run it with
+// `npm run bench:native`; results are printed as JSON.
+//
+// Usage: bench [--iterations N] [--sizes WxH,WxH,...] [--colors N,N,...]
+#include <sanjuuni.hpp>
+#include "pixels.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+WorkQueue work;
+ThreadPool pool(InitialThreadCount() - 1);
+thread_local unsigned threadLimit = 0;
+
+struct Size {unsigned width, height;};
+
+struct Result {
+    std::string stage;
+    Size size;
+    int colors;
+    std::vector<double> times;
+};
+
+// Deterministic test image: smooth gradients with some noise, so palette
+// reduction and dithering have realistic work to do.
+static Mat makeImage(Size size) {
+    Mat img(size.width, size.height);
+    uint32_t state = 0x9E3779B9;
+    for (unsigned y = 0; y < size.height; y++) {
+        for (unsigned x = 0; x < size.width; x++) {
+            state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+            const int noise = (int)(state & 31) - 16;
+            img[y][x] = {
+                (uchar)std::min(std::max((int)(x * 255 / size.width) + noise, 0), 255),
+                (uchar)std::min(std::max((int)(y * 255 / size.height) + noise, 0), 255),
+                (uchar)std::min(std::max((int)((x + y) * 127 / (size.width + size.height)) + 64 + noise, 0), 255)
+            };
+        }
+    }
+    return img;
+}
+
+static double percentile(std::vector<double> times, double p) {
+    std::sort(times.begin(), times.end());
+    size_t i = std::min((size_t)(p * times.size()), times.size() - 1);
+    return times[i];
+}
+
+static void run(std::vector<Result>& results, const std::string& stage, Size size, int colors, int iterations, const std::function<void()>& fn) {
+    Result res = {stage, size, colors, {}};
+    fn(); // warm up
+    for (int i = 0; i < iterations; i++) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        res.times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    fprintf(stderr, "%-28s %5ux%-5u %3d colors  p50 %9.3f ms\n", stage.c_str(), size.width, size.height, colors, percentile(res.times, 0.5));
+    results.push_back(res);
+}
+
+// Calls fn with the nearest-color search the module would use for a palette.
+template<typename Fn>
+static void withSearch(const std::vector<Vec3b>& palette, Fn fn) {
+    if (palette.empty() || palette.size() > 16) fn(PaletteLUT(palette));
+    else if (palette.size() <= 8) fn(SmallPalette<8>(palette));
+    else fn(SmallPalette<16>(palette));
+}
+
+static std::vector<std::string> split(const char * str) {
+    std::vector<std::string> retval;
+    std::string s = str;
+    size_t start = 0, end;
+    while ((end = s.find(',', start)) != std::string::npos) {
+        retval.push_back(s.substr(start, end - start));
+        start = end + 1;
+    }
+    retval.push_back(s.substr(start));
+    return retval;
+}
+
+int main(int argc, const char * argv[]) {
+    int iterations = 10;
+    std::vector<Size> sizes = {{320, 180}, {1280, 720}, {3840, 2160}};
+    std::vector<int> colorCounts = {4, 16};
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) iterations = std::max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            sizes.clear();
+            for (const std::string& s : split(argv[++i])) {
+                Size size;
+                if (sscanf(s.c_str(), "%ux%u", &size.width, &size.height) == 2) sizes.push_back(size);
+            }
+        } else if (strcmp(argv[i], "--colors") == 0 && i + 1 < argc) {
+            colorCounts.clear();
+            for (const std::string& s : split(argv[++i])) colorCounts.push_back(atoi(s.c_str()));
+        } else {
+            fprintf(stderr, "Usage: %s [--iterations N] [--sizes WxH,...] [--colors N,...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<Result> results;
+    for (Size size : sizes) {
+        // keep the size a whole number of characters
+        size.width -= size.width % 2;
+        size.height -= size.height % 3;
+        std::vector<uint8_t> rgba((size_t)size.width * size.height * 4);
+        for (size_t i = 0; i < rgba.size(); i++) rgba[i] = (uint8_t)(i * 2654435761U >> 24);
+        Mat img = makeImage(size), out(size.width, size.height);
+        // the module takes its images from a pool, so output buffers are reused here too
+        run(results, "ingest", size, 0, iterations, [&]() {ReadRows(rgba.data(), (size_t)size.width * 4, PIXEL_RGBA, out, false);});
+        run(results, "ingest (lab)", size, 0, iterations, [&]() {ReadRows(rgba.data(), (size_t)size.width * 4, PIXEL_RGBA, out, true);});
+        run(results, "makeLabImage", size, 0, iterations, [&]() {LabRows(img, out);});
+        Mat1b indexed(size.width, size.height);
+        for (int colors : colorCounts) {
+            std::vector<Vec3b> palette;
+            run(results, "reducePalette_medianCut", size, colors, iterations, [&]() {palette = reducePalette_medianCut(img, colors);});
+            run(results, "reducePalette_kMeans", size, colors, iterations, [&]() {reducePalette_kMeans(img, colors);});
+            run(results, "reducePalette_octree", size, colors, iterations, [&]() {reducePalette_octree(img, colors);});
+            withSearch(palette, [&](const auto& search) {
+                run(results, "thresholdImage", size, colors, iterations, [&]() {MapToPalette(img, search, indexed);});
+                run(results, "ditherImage_ordered", size, colors, iterations, [&]() {
+                    Mat dithered = ditherImage_ordered(img, palette);
+                    MapToPalette(dithered, search, indexed);
+                });
+                run(results, "ditherImage_floydSteinberg", size, colors, iterations, [&]() {
+                    Mat dithered = ditherImage(img, palette);
+                    MapToPalette(dithered, search, indexed);
+                });
+                run(results, "ditherImage_floydSteinberg (wavefront)", size, colors, iterations, [&]() {DitherFloydSteinberg(img, search, false, indexed);});
+                run(results, "ditherImage_floydSteinberg (serpentine)", size, colors, iterations, [&]() {DitherFloydSteinberg(img, search, true, indexed);});
+            });
+            uchar * chars = NULL, * cols = NULL;
+            run(results, "makeCCImage", size, colors, iterations, [&]() {
+                delete[] chars;
+                delete[] cols;
+                makeCCImage(indexed, palette, &chars, &cols);
+            });
+            const int w = size.width / 2, h = size.height / 3;
+            run(results, "makeTable", size, colors, iterations, [&]() {makeTable(chars, cols, palette, w, h);});
+            run(results, "makeNFP", size, colors, iterations, [&]() {makeNFP(chars, cols, palette, w, h);});
+            run(results, "makeLuaFile", size, colors, iterations, [&]() {makeLuaFile(chars, cols, palette, w, h);});
+            run(results, "makeRawImage", size, colors, iterations, [&]() {makeRawImage(chars, cols, palette, w, h);});
+            run(results, "make32vid", size, colors, iterations, [&]() {make32vid(chars, cols, palette, w, h);});
+            run(results, "make32vid_cmp", size, colors, iterations, [&]() {make32vid_cmp(chars, cols, palette, w, h);});
+            run(results, "make32vid_ans", size, colors, iterations, [&]() {make32vid_ans(chars, cols, palette, w, h);});
+            delete[] chars;
+            delete[] cols;
+        }
+    }
+
+    printf("{\"harness\": \"native\", \"iterations\": %d, \"results\": [", iterations);
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        const double p50 = percentile(r.times, 0.5), p99 = percentile(r.times, 0.99);
+        printf("%s\n  {\"stage\": \"%s\", \"width\": %u, \"height\": %u, \"colors\": %d, \"p50_ms\": %.4f, \"p99_ms\": %.4f, \"mpps\": %.3f}",
+            i ? "," : "", r.stage.c_str(), r.size.width, r.size.height, r.colors, p50, p99,
+            (double)r.size.width * r.size.height / 1e6 / (p50 / 1000));
+    }
+    printf("\n]}\n");
+    return 0;
+}
@@ -0,0 +1,158 @@
+// Times each function exported by the module across image and palette sizes.
+// Run with `npm run bench`; results are printed as JSON (or written to the
+// file given with --out), with the median and 99th percentile latency and the
+// throughput in megapixels per second at the median.
+//
+// Usage: node bench/bench.js [--iterations N] [--sizes WxH,...] [--colors N,...] [--out FILE]
+const fs = require("fs");
+const sanjuuni = require("..");
+
+const options = {iterations: 10, sizes: ["320x180", "1280x720", "3840x2160"], colors: [4, 16], out: null};
+for (let i = 2; i < process.argv.length; i++) {
+    const arg = process.argv[i], value = process.argv[++i];
+    if (arg === "--iterations") options.iterations = Math.max(parseInt(value), 1);
+    else if (arg === "--sizes") options.sizes = value.split(",");
+    else if (arg === "--colors") options.colors = value.split(",").map(n => parseInt(n));
+    else if (arg === "--out") options.out = value;
+    else {
+        console.error("Usage: node bench/bench.js [--iterations N] [--sizes WxH,...] [--colors N,...] [--out FILE]");
+        process.exit(1);
+    }
+}
+
+// Deterministic RGBA test image: smooth gradients with some noise.
+function makePixels(width, height) {
+    const data = Buffer.alloc(width * height * 4);
+    let state = 0x9E3779B9;
+    for (let y = 0, i = 0; y < height; y++) {
+        for (let x = 0; x < width; x++, i += 4) {
+            state ^= state << 13; state ^= state >>> 17; state ^= state << 5;
+            const noise = (state & 31) - 16;
+            data[i] = Math.min(Math.max(Math.floor((x + y) * 127 / (width + height)) + 64 + noise, 0), 255);
+            data[i+1] = Math.min(Math.max(Math.floor(y * 255 / height) + noise, 0), 255);
+            data[i+2] = Math.min(Math.max(Math.floor(x * 255 / width) + noise, 0), 255);
+            data[i+3] = 255;
+        }
+    }
+    return data;
+}
+
+function percentile(times, p) {
+    const sorted = times.slice().sort((a, b) => a - b);
+    return sorted[Math.min(Math.floor(p * sorted.length), sorted.length - 1)];
+}
+
+const results = [];
+
+async function run(stage, width, height, colors, fn) {
+    await fn(); // warm up
+    const times = [];
+    for (let i = 0; i < options.iterations; i++) {
+        const start = process.hrtime.bigint();
+        await fn();
+        times.push(Number(process.hrtime.bigint() - start) / 1e6);
+    }
+    const p50 = percentile(times, 0.5), p99 = percentile(times, 0.99);
+    console.error(`${stage.padEnd(32)} ${(width + "x" + height).padStart(11)} ${String(colors).padStart(3)} colors  p50 ${p50.toFixed(3).padStart(9)} ms`);
+    results.push({stage, width, height, colors, p50_ms: p50, p99_ms: p99, mpps: width * height / 1e6 / (p50 / 1000)});
+}
+
+async function main() {
+    for (const size of options.sizes) {
+        let [width, height] = size.split("x").map(n => parseInt(n));
+        // keep the size a whole number of characters
+        width -= width % 2;
+        height -= height % 3;
+        const pixels = makePixels(width, height);
+        const frames = [pixels, pixels, pixels, pixels];
+        const image = sanjuuni.makeRGBImage(pixels, width, height, "rgba");
+
+        await run("makeRGBImage", width, height, 0, () => sanjuuni.makeRGBImage(pixels, width, height, "rgba"));
+        if (width * height <= 320 * 180) {
+            const array = [];
+            for (let y = 0; y < height; y++) {
+                const row = [];
+                for (let x = 0; x < width; x++) row.push(image.at(x, y));
+                array.push(row);
+            }
+            await run("makeRGBImage (array)", width, height, 0, () => sanjuuni.makeRGBImage(array));
+        }
+        await run("RGBImage.toBuffer", width, height, 0, () => image.toBuffer());
+        await run("RGBImage.getRegion", width, height, 0, () => image.getRegion(0, 0, width >> 1, height >> 1, "rgba"));
+        await run("makeLabImage", width, height, 0, () => sanjuuni.makeLabImage(image));
+        await run("makeLabImageAsync", width, height, 0, () => sanjuuni.makeLabImageAsync(image));
+        await run("resizeImage (box)", width, height, 0, () => sanjuuni.resizeImage(image, 102, 57, "box"));
+        await run("resizeImage (bilinear)", width, height, 0, () => sanjuuni.resizeImage(image, 102, 57, "bilinear"));
+        await run("resizeImageAsync", width, height, 0, () => sanjuuni.resizeImageAsync(image, 102, 57));
+        await run("fitTerminal", width, height, 0, () => sanjuuni.fitTerminal(image, 51, 19));
+        await run("fitTerminalAsync", width, height, 0, () => sanjuuni.fitTerminalAsync(image, 51, 19));
+        await run("makeColorHistogram", width, height, 0, () => sanjuuni.makeColorHistogram(image));
+
+        for (const colors of options.colors) {
+            const palette = sanjuuni.reducePalette_medianCut(image, colors);
+            const histogram = sanjuuni.makeColorHistogram(image);
+            for (const name of ["medianCut", "kMeans", "octree"]) {
+                await run(`reducePalette_${name}`, width, height, colors, () => sanjuuni[`reducePalette_${name}`](image, colors));
+                await run(`reducePalette_${name}Async`, width, height, colors, () => sanjuuni[`reducePalette_${name}Async`](image, colors));
+                await run(`reducePalette_${name} (histogram)`, width, height, colors, () => sanjuuni[`reducePalette_${name}`](histogram, colors));
+            }
+            await run("convertLabPalette", width, height, colors, () => sanjuuni.convertLabPalette(palette));
+            for (const name of ["thresholdImage", "ditherImage_ordered", "ditherImage_floydSteinberg"]) {
+                await run(name, width, height, colors, () => sanjuuni[name](image, palette));
+                await run(name + "Async", width, height, colors, () => sanjuuni[name + "Async"](image, palette));
+            }
+            await run("ditherImage_floydSteinberg (wavefront)", width, height, colors, () => sanjuuni.ditherImage_floydSteinberg(image, palette, {wavefront: true}));
+            await run("ditherImage_floydSteinberg (serpentine)", width, height, colors, () => sanjuuni.ditherImage_floydSteinberg(image, palette, {serpentine: true}));
+            const indexed = sanjuuni.ditherImage_floydSteinberg(image, palette);
+            await run("IndexedImage.toBuffer", width, height, colors, () => indexed.toBuffer());
+            await run("IndexedImage.getRegion", width, height, colors, () => indexed.getRegion(0, 0, width >> 1, height >> 1));
+            for (const name of ["makeTable", "makeNFP", "makeLuaFile", "makeRawImage", "make32vid", "make32vid_cmp", "make32vid_ans"]) {
+                // a fresh image each time, so the cached character planes aren't reused
+                await run(name, width, height, colors, () => sanjuuni[name](sanjuuni.thresholdImage(image, palette), palette));
+                await run(name + "Async", width, height, colors, () => sanjuuni[name + "Async"](sanjuuni.thresholdImage(image, palette), palette));
+            }
+            const formats = ["lua", "nfp", "32vid_ans"];
+            await run("makeOutputs", width, height, colors, () => sanjuuni.makeOutputs(sanjuuni.thresholdImage(image, palette), palette, formats));
+            await run("makeOutputsAsync", width, height, colors, () => sanjuuni.makeOutputsAsync(sanjuuni.thresholdImage(image, palette), palette, formats, {parallel: true}));
+            const target = Buffer.alloc(width * height * 16 + 65536);
+            await run("makeOutputInto", width, height, colors, () => sanjuuni.makeOutputInto(sanjuuni.thresholdImage(image, palette), palette, "32vid_ans", target, 16));
+            await run("makeOutputIntoAsync", width, height, colors, () => sanjuuni.makeOutputIntoAsync(sanjuuni.thresholdImage(image, palette), palette, "32vid_ans", target, 16));
+            const convertOptions = {numColors: colors, output: "32vid_ans"};
+            await run("convert", width, height, colors, () => sanjuuni.convert(pixels, width, height, "rgba", convertOptions));
+            await run("convert (lab)", width, height, colors, () => sanjuuni.convert(pixels, width, height, "rgba", {...convertOptions, lab: true}));
+            await run("convertAsync", width, height, colors, () => sanjuuni.convertAsync(pixels, width, height, "rgba", convertOptions));
+            sanjuuni.setCacheLimit(64 * 1024 * 1024);
+            await run("convert (cached)", width, height, colors, () => sanjuuni.convert(pixels, width, height, "rgba", convertOptions));
+            sanjuuni.setCacheLimit(0);
+            await run("convertFrames (4 frames)", width, height, colors, () => sanjuuni.convertFrames(frames, width, height, "rgba", convertOptions));
+            await run("convertFramesAsync (4 frames)", width, height, colors, () => sanjuuni.convertFramesAsync(frames, width, height, "rgba", convertOptions));
+            await run("convertWall (2x2)", width, height, colors, () => sanjuuni.convertWall(image, {...convertOptions, tileCols: 2, tileRows: 2}));
+            await run("convertWallAsync (2x2, tile palettes)", width, height, colors, () => sanjuuni.convertWallAsync(image, {...convertOptions, tileCols: 2, tileRows: 2, palette: "tile"}));
+            const video = new sanjuuni.VideoEncoder({compression: "ans"});
+            await run("VideoEncoder.push", width, height, colors, () => video.push(indexed, palette));
+            await run("VideoEncoder.pushAsync", width, height, colors, () => video.pushAsync(indexed, palette));
+            const generator = new sanjuuni.PaletteGenerator({numColors: colors});
+            await run("PaletteGenerator.generate", width, height, colors, () => generator.generate(image));
+            await run("PaletteGenerator.generateAsync", width, height, colors, () => generator.generateAsync(image));
+            const delta = new sanjuuni.DeltaEncoder();
+            await run("DeltaEncoder.push", width, height, colors, () => delta.push(indexed, palette));
+            await run("DeltaEncoder.pushAsync", width, height, colors, () => delta.pushAsync(indexed, palette));
+            const incremental = new sanjuuni.IncrementalConverter(palette, {ditherer: "ordered"});
+            incremental.push(pixels, width, height, "rgba");
+            await run("IncrementalConverter.push (static)", width, height, colors, () => incremental.push(pixels, width, height, "rgba"));
+            // a 64x48 pixel patch that changes every frame
+            const patched = [Buffer.from(pixels), Buffer.from(pixels)];
+            for (let y = 0; y < Math.min(48, height); y++) patched[1].fill(255, y * width * 4, (y * width + Math.min(64, width)) * 4);
+            let frame = 0;
+            await run("IncrementalConverter.push (64x48 changed)", width, height, colors, () => incremental.push(patched[frame++ & 1], width, height, "rgba"));
+        }
+    }
+    const json = JSON.stringify({harness: "node", iterations: options.iterations, threads: sanjuuni.getThreadCount(), results}, null, 2);
+    if (options.out) fs.writeFileSync(options.out, json + "\n");
+    else console.log(json);
+}
+
+main().catch(err => {
+    console.error(err);
+    process.exit(1);
+});
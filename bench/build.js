@@ -0,0 +1,20 @@
+// Builds the native benchmark from bench.cpp, the module's pixels.hpp and the
+// sanjuuni sources listed in binding.gyp, so it always measures the same code
+// as the addon.
+const fs = require("fs");
+const path = require("path");
+const {execFileSync} = require("child_process");
+
+const root = path.join(__dirname, "..");
+const gyp = eval("(" + fs.readFileSync(path.join(root, "binding.gyp"), "utf8") + ")");
+const target = gyp.targets[0];
+const sources = target.sources.filter(s => s !== "module.cpp").map(s => path.join(root, s));
+const args = [
+    "-O3", "-std=c++17", "-pthread", "-fexceptions",
+    ...target.defines.map(d => "-D" + d),
+    "-I" + root, "-I" + path.join(root, "sanjuuni/src"),
+    path.join(__dirname, "bench.cpp"), ...sources,
+    "-o", path.join(root, "build", process.platform === "win32" ? "bench.exe" : "bench")
+];
+fs.mkdirSync(path.join(root, "build"), {recursive: true});
+execFileSync(process.env.CXX || "c++", args, {stdio: "inherit"});
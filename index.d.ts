@@ -1,4 +1,5 @@
 import {Buffer} from "buffer";
+import {Transform} from "stream";
 
 export module "sanjuuni" {
     /** A color, usually in RGB, but may also be holding Lab coordinates. */
@@ -7,6 +8,89 @@ export module "sanjuuni" {
     type Palette = Color[];
     /** A palette of Lab colors. */
     type LabPalette = Palette;
+    /**
+     * A palette packed as R, G, B bytes, as made by `packPalette`. This can be
+     * passed anywhere a palette is expected, and may be backed by a
+     * SharedArrayBuffer to send it to other threads without copying.
+     */
+    type PackedPalette = Uint8Array;
+
+    /** The byte order of raw pixel data. */
+    type PixelFormat = "rgb" | "rgba" | "bgr" | "bgra" | "argb" | "abgr";
+    /** An output format generated by one of the `make*` functions. */
+    type OutputFormat = "table" | "bimg" | "nfp" | "lua" | "raw" | "32vid" | "32vid_cmp" | "32vid_ans";
+
+    /** The filter to use when resizing: area averaging, or bilinear interpolation. */
+    type ResizeFilter = "box" | "bilinear";
+
+    /**
+     * A size to resize an image to: either a fixed size in pixels, or the
+     * largest size that fits in a terminal of `cols` x `rows` characters
+     * (2x3 pixels each) while keeping the aspect ratio.
+     */
+    type ResizeOptions = ({width: number, height: number} | {cols: number, rows: number}) & {
+        /** The filter to use (defaults to "box") */
+        filter?: ResizeFilter
+    };
+
+    type MakeImageOptions = {
+        /** The number of bytes per row, if rows are padded */
+        stride?: number,
+        /** A size to resize the image to as it's read, without making a full-size copy */
+        resize?: ResizeOptions
+    };
+
+    /**
+     * Options for generating a palette from part of an image, which bounds the
+     * time taken regardless of resolution. Without any of these, every pixel
+     * is used.
+     */
+    type SampleOptions = {
+        /** Only use every nth pixel of every nth row */
+        sampleStride?: number,
+        /** The maximum number of pixels to use; raises the stride as needed */
+        maxSamples?: number,
+        /**
+         * Count colors in a histogram with this many bits per channel (1-6),
+         * and generate the palette from the bins' colors weighted by count
+         */
+        histogramBits?: number
+    };
+    /** Options for generating a palette. */
+    type PaletteOptions = SampleOptions & {
+        /** Return the palette packed into a Uint8Array */
+        packed?: boolean
+    };
+
+    /** Options for a full conversion with `convert`. */
+    type ConvertOptions = SampleOptions & {
+        /** The number of bytes per row of the source, if rows are padded */
+        stride?: number,
+        /** Whether to quantize and dither in CIELAB color space (defaults to false) */
+        lab?: boolean,
+        /** The palette reduction algorithm to use (defaults to "medianCut") */
+        quantizer?: "medianCut" | "kMeans" | "octree",
+        /** The color reduction algorithm to use (defaults to "floydSteinberg") */
+        ditherer?: "threshold" | "ordered" | "floydSteinberg",
+        /** For "floydSteinberg": whether to use the integer wavefront engine; see `DitherOptions` (defaults to false) */
+        wavefront?: boolean,
+        /** For "floydSteinberg": whether to scan alternate rows right to left; implies `wavefront` (defaults to false) */
+        serpentine?: boolean,
+        /** The number of colors to get (defaults to 16) */
+        numColors?: number,
+        /** The output format to generate (defaults to "lua") */
+        output?: OutputFormat,
+        /** For "table" and "bimg": whether to make the output as compact as possible */
+        compact?: boolean,
+        /** For "table": whether to embed the palette as a `palette` key ("bimg" always does) */
+        embedPalette?: boolean,
+        /** For "table" and "bimg": whether to output binary strings */
+        binary?: boolean,
+        /** The maximum number of threads to use for this call, including the calling thread (defaults to all) */
+        threads?: number,
+        /** A size to resize the image to before converting */
+        resize?: ResizeOptions
+    };
 
     /**
      * Holds an RGB image.
@@ -16,9 +100,56 @@ export module "sanjuuni" {
         width: number;
         height: number;
         at(x: number, y: number): Color;
+        /**
+         * The pixels of the image, packed in BGR order. This shares memory with
+         * the image where possible, so it should be treated as read-only.
+         */
+        readonly data: Buffer;
+        /** Equivalent to reading `data`. */
+        toBuffer(): Buffer;
+        /**
+         * Copies part of the image into a new buffer.
+         * @param x The X coordinate of the region
+         * @param y The Y coordinate of the region
+         * @param width The width of the region
+         * @param height The height of the region
+         * @param format The byte order to write pixels in; alpha is always 255
+         * @returns The packed pixels of the region
+         */
+        getRegion(x: number, y: number, width: number, height: number, format: "rgb" | "rgba" | "bgr" | "bgra" | "argb" | "abgr" = "bgr"): Buffer;
+        /** Whether `dispose` has been called on this image. */
+        disposed: boolean;
+        /**
+         * Frees the image's pixels without waiting for garbage collection.
+         * If async work or a `data` buffer is still using the image, it's
+         * freed once they're done. Using the image afterwards throws. Also
+         * available as `[Symbol.dispose]` where supported, for `using`.
+         */
+        dispose(): void;
+        /**
+         * Makes a handle that can be sent to another worker thread (e.g. with
+         * `postMessage`) and opened there with `openSharedImage`, without
+         * copying the image. The image stays alive until every object and
+         * unopened handle referring to it is gone; once shared, `dispose` no
+         * longer frees it early.
+         */
+        share(): SharedImageHandle;
     }
     type LabImage = RGBImage;
 
+    /**
+     * Holds a weighted histogram of the colors in an image, which can be
+     * passed to any of the palette reduction functions in place of the image.
+     */
+    declare interface ColorHistogram {
+        /** The number of bits per channel */
+        bits: number;
+        /** The number of distinct bins in use */
+        colors: number;
+        /** The number of pixels counted */
+        total: number;
+    }
+
     /**
      * Holds an 8-bit indexed image.
      * Wrapper around sanjuuni `Mat1b`.
@@ -27,8 +158,73 @@ export module "sanjuuni" {
         width: number;
         height: number;
         at(x: number, y: number): number;
+        /**
+         * The palette indices of the image, one byte per pixel. This shares
+         * memory with the image where possible, so writes to it change the
+         * image. While such a buffer is alive, outputs made from the image
+         * aren't cached.
+         */
+        readonly data: Buffer;
+        /** Equivalent to reading `data`. */
+        toBuffer(): Buffer;
+        /**
+         * Copies part of the image into a new buffer.
+         * @param x The X coordinate of the region
+         * @param y The Y coordinate of the region
+         * @param width The width of the region
+         * @param height The height of the region
+         * @returns The palette indices of the region, one byte per pixel
+         */
+        getRegion(x: number, y: number, width: number, height: number): Buffer;
+        /** Whether `dispose` has been called on this image. */
+        disposed: boolean;
+        /**
+         * Frees the image's pixels without waiting for garbage collection.
+         * If async work or a `data` buffer is still using the image, it's
+         * freed once they're done. Using the image afterwards throws. Also
+         * available as `[Symbol.dispose]` where supported, for `using`.
+         */
+        dispose(): void;
+        /**
+         * Makes a handle that can be sent to another worker thread (e.g. with
+         * `postMessage`) and opened there with `openSharedImage`, without
+         * copying the image. The image stays alive until every object and
+         * unopened handle referring to it is gone; once shared, `dispose` no
+         * longer frees it early.
+         */
+        share(): SharedImageHandle;
     }
 
+    /** A handle to an image shared between threads, made by `share`. */
+    type SharedImageHandle = {
+        type: "rgb" | "indexed",
+        width: number,
+        height: number,
+        id: number
+    };
+
+    /**
+     * Opens an image shared by another thread. The new object uses the same
+     * memory as the original. Each handle can only be opened once.
+     * @param handle The handle returned by `share`
+     * @return The shared image
+     */
+    declare function openSharedImage(handle: SharedImageHandle & {type: "rgb"}): RGBImage;
+    declare function openSharedImage(handle: SharedImageHandle & {type: "indexed"}): IndexedImage;
+    declare function openSharedImage(handle: SharedImageHandle): RGBImage | IndexedImage;
+    /**
+     * Drops a handle that won't be opened, so it no longer keeps its image alive.
+     * @param handle The handle returned by `share`
+     */
+    declare function releaseSharedImage(handle: SharedImageHandle): void;
+    /**
+     * Packs a palette into R, G, B bytes.
+     * @param palette The palette to pack
+     * @param shared Whether to back the array with a SharedArrayBuffer (defaults to false)
+     * @return The packed palette
+     */
+    declare function packPalette(palette: Palette | PackedPalette, shared?: boolean): PackedPalette;
+
     /**
      * Initializes OpenCL support if available.
      * @param device The device to use; specify "best_flops" for device with most computation power, or "best_memory" for device with most memory
@@ -48,39 +244,64 @@ export module "sanjuuni" {
      * @param width The width of the image
      * @param height The height of the image
      * @param format The format the data is in, i.e. the byte order
+     * @param options The number of bytes per row if rows are padded, or an object with the stride and a size to resize to while reading
      * @returns The new RGB image
      */
-    declare function makeRGBImage(image: Buffer, width: number, height: number, format: "rgb" | "rgba" | "bgr" | "bgra" | "argb" | "abgr"): RGBImage;
+    declare function makeRGBImage(image: Buffer, width: number, height: number, format: "rgb" | "rgba" | "bgr" | "bgra" | "argb" | "abgr", options?: number | MakeImageOptions): RGBImage;
     /**
      * Creates an image from a byte buffer.
      * @param image The image source
      * @param width The width of the image
      * @param height The height of the image
      * @param format The format the data is in, i.e. the byte order
+     * @param options The number of bytes per row if rows are padded, or an object with the stride and a size to resize to while reading
      * @returns The new RGB image
      */
-    declare function makeRGBImage(image: ArrayBuffer, width: number, height: number, format: "rgb" | "rgba" | "bgr" | "bgra" | "argb" | "abgr"): RGBImage;
+    declare function makeRGBImage(image: ArrayBuffer, width: number, height: number, format: "rgb" | "rgba" | "bgr" | "bgra" | "argb" | "abgr", options?: number | MakeImageOptions): RGBImage;
     /**
      * Creates an image from a byte buffer.
      * @param image The image source
      * @param width The width of the image
      * @param height The height of the image
      * @param format The format the data is in, i.e. the byte order
+     * @param options The number of bytes per row if rows are padded, or an object with the stride and a size to resize to while reading
      * @returns The new RGB image
      */
-    declare function makeRGBImage(image: Uint8Array, width: number, height: number, format: "rgb" | "rgba" | "bgr" | "bgra" | "argb" | "abgr"): RGBImage;
+    declare function makeRGBImage(image: Uint8Array, width: number, height: number, format: "rgb" | "rgba" | "bgr" | "bgra" | "argb" | "abgr", options?: number | MakeImageOptions): RGBImage;
     /**
      * Creates an image from a 32-bit integer buffer.
      * @param image The image source
      * @param width The width of the image
      * @param height The height of the image
-     * @param format The format the data is in, i.e. the byte order
+     * @param format The format the data is in, from most to least significant byte
+     * @param stride The number of bytes (not elements) per row, if rows are padded
      * @returns The new RGB image
      */
-    declare function makeRGBImage(image: Uint32Array, width: number, height: number, format: "rgba" | "bgra" | "argb" | "abgr"): RGBImage;
+    declare function makeRGBImage(image: Uint32Array, width: number, height: number, format: "rgba" | "bgra" | "argb" | "abgr", options?: number | MakeImageOptions): RGBImage;
+
+    /**
+     * Resizes an image.
+     * @param image The image to resize
+     * @param width The new width
+     * @param height The new height
+     * @param filter The filter to use (defaults to "box")
+     * @returns A new image with the specified size
+     */
+    declare function resizeImage(image: RGBImage, width: number, height: number, filter?: ResizeFilter): RGBImage;
+    /**
+     * Resizes an image to the largest size that fits in a terminal, keeping
+     * the aspect ratio. The size is a whole number of characters.
+     * @param image The image to resize
+     * @param cols The width of the terminal in characters
+     * @param rows The height of the terminal in characters
+     * @param filter The filter to use (defaults to "box")
+     * @returns A new image at most `cols * 2` x `rows * 3` pixels
+     */
+    declare function fitTerminal(image: RGBImage, cols: number, rows: number, filter?: ResizeFilter): RGBImage;
 
     /**
-     * Converts an sRGB image into CIELAB color space.
+     * Converts an sRGB image into CIELAB color space, using the OpenCL device
+     * once `initOpenCL` has succeeded.
      * @param image The image to convert
      * @return A new image with all pixels in Lab color space
      */
@@ -91,96 +312,179 @@ export module "sanjuuni" {
      * @return A new list with all colors converted to RGB
      */
     declare function convertLabPalette(palette: LabPalette): Palette;
+    /**
+     * Converts a packed list of Lab colors into sRGB colors.
+     * @param palette The colors to convert
+     * @return A new packed list with all colors converted to RGB
+     */
+    declare function convertLabPalette(palette: PackedPalette): PackedPalette;
 
+    /**
+     * Counts the colors in an image, so palettes can be generated from the
+     * histogram without going over every pixel again.
+     * @param image The image to count
+     * @param options The histogram resolution (defaults to 5 bits), and how to sample the image
+     * @returns A histogram of the image's colors
+     */
+    declare function makeColorHistogram(image: RGBImage | LabImage, options?: SampleOptions): ColorHistogram;
+
+    /**
+     * Generates an optimized palette for an image using the median cut algorithm, packed
+     * into a Uint8Array.
+     * @param image The image to generate a palette for
+     * @param numColors The number of colors to get (must be a power of 2)
+     * @param options Options for sampling the image, with `packed` set
+     * @returns An optimized palette for the image
+     */
+    declare function reducePalette_medianCut(image: RGBImage | LabImage | ColorHistogram, numColors: number, options: PaletteOptions & {packed: true}): PackedPalette;
     /**
      * Generates an optimized palette for an image using the median cut algorithm.
      * @param image The image to generate a palette for
      * @param numColors The number of colors to get (must be a power of 2)
+     * @param options Options for sampling the image
      * @returns An optimized palette for the image
      */
-    declare function reducePalette_medianCut(image: RGBImage, numColors: number = 16): Palette;
+    declare function reducePalette_medianCut(image: RGBImage | ColorHistogram, numColors: number = 16, options?: PaletteOptions): Palette;
     /**
      * Generates an optimized palette for an image using the median cut algorithm.
      * @param image The image to generate a palette for
      * @param numColors The number of colors to get (must be a power of 2)
+     * @param options Options for sampling the image
+     * @returns An optimized palette for the image
+     */
+    declare function reducePalette_medianCut(image: LabImage | ColorHistogram, numColors: number = 16, options?: PaletteOptions): LabPalette;
+    /**
+     * Generates an optimized palette for an image using the k-means algorithm, packed
+     * into a Uint8Array.
+     * @param image The image to generate a palette for
+     * @param numColors The number of colors to get
+     * @param options Options for sampling the image, with `packed` set
      * @returns An optimized palette for the image
      */
-    declare function reducePalette_medianCut(image: LabImage, numColors: number = 16): LabPalette;
+    declare function reducePalette_kMeans(image: RGBImage | LabImage | ColorHistogram, numColors: number, options: PaletteOptions & {packed: true}): PackedPalette;
     /**
      * Generates an optimized palette for an image using the k-means algorithm.
      * @param image The image to generate a palette for
      * @param numColors The number of colors to get
+     * @param options Options for sampling the image
      * @returns An optimized palette for the image
      */
-    declare function reducePalette_kMeans(image: RGBImage, numColors: number = 16): Palette;
+    declare function reducePalette_kMeans(image: RGBImage | ColorHistogram, numColors: number = 16, options?: PaletteOptions): Palette;
     /**
      * Generates an optimized palette for an image using the k-means algorithm.
      * @param image The image to generate a palette for
      * @param numColors The number of colors to get
+     * @param options Options for sampling the image
      * @returns An optimized palette for the image
      */
-    declare function reducePalette_kMeans(image: LabImage, numColors: number = 16): LabPalette;
+    declare function reducePalette_kMeans(image: LabImage | ColorHistogram, numColors: number = 16, options?: PaletteOptions): LabPalette;
+    /**
+     * Generates an optimized palette for an image using octrees, packed
+     * into a Uint8Array.
+     * @param image The image to generate a palette for
+     * @param numColors The number of colors to get
+     * @param options Options for sampling the image, with `packed` set
+     * @returns An optimized palette for the image
+     */
+    declare function reducePalette_octree(image: RGBImage | LabImage | ColorHistogram, numColors: number, options: PaletteOptions & {packed: true}): PackedPalette;
     /**
      * Generates an optimized palette for an image using octrees.
      * @param image The image to generate a palette for
      * @param numColors The number of colors to get
+     * @param options Options for sampling the image
      * @returns An optimized palette for the image
      */
-    declare function reducePalette_octree(image: RGBImage, numColors: number = 16): Palette;
+    declare function reducePalette_octree(image: RGBImage | ColorHistogram, numColors: number = 16, options?: PaletteOptions): Palette;
     /**
      * Generates an optimized palette for an image using octrees.
      * @param image The image to generate a palette for
      * @param numColors The number of colors to get
+     * @param options Options for sampling the image
      * @returns An optimized palette for the image
      */
-    declare function reducePalette_octree(image: LabImage, numColors: number = 16): LabPalette;
+    declare function reducePalette_octree(image: LabImage | ColorHistogram, numColors: number = 16, options?: PaletteOptions): LabPalette;
+
+    /**
+     * Options for the ditherers. The palette reducers and encoders run inside
+     * sanjuuni on its own work queue, so they don't take a thread limit.
+     */
+    type ThreadOptions = {
+        /** The maximum number of threads to use for this call, including the calling thread (defaults to all) */
+        threads?: number
+    };
 
     /**
      * Reduces the colors in an image using the specified palette through thresholding.
      * @param image The image to reduce
      * @param palette The palette to use
+     * @param options Options for dithering
      * @return A reduced-color version of the image using the palette
      */
-    declare function thresholdImage(image: RGBImage, palette: Palette): IndexedImage;
+    declare function thresholdImage(image: RGBImage, palette: Palette | PackedPalette, options?: ThreadOptions): IndexedImage;
     /**
      * Reduces the colors in an image using the specified palette through thresholding.
      * @param image The image to reduce
      * @param palette The palette to use
+     * @param options Options for dithering
      * @return A reduced-color version of the image using the palette
      */
-    declare function thresholdImage(image: LabImage, palette: LabPalette): IndexedImage;
+    declare function thresholdImage(image: LabImage, palette: LabPalette | PackedPalette, options?: ThreadOptions): IndexedImage;
     /**
      * Reduces the colors in an image using the specified palette through ordered
      * dithering.
      * @param image The image to reduce
      * @param palette The palette to use
+     * @param options Options for dithering
      * @return A reduced-color version of the image using the palette
      */
-    declare function ditherImage_ordered(image: RGBImage, palette: Palette): IndexedImage;
+    declare function ditherImage_ordered(image: RGBImage, palette: Palette | PackedPalette, options?: ThreadOptions): IndexedImage;
     /**
      * Reduces the colors in an image using the specified palette through ordered
      * dithering.
      * @param image The image to reduce
      * @param palette The palette to use
+     * @param options Options for dithering
      * @return A reduced-color version of the image using the palette
      */
-    declare function ditherImage_ordered(image: LabImage, palette: LabPalette): IndexedImage;
+    declare function ditherImage_ordered(image: LabImage, palette: LabPalette | PackedPalette, options?: ThreadOptions): IndexedImage;
+    /** Options for Floyd-Steinberg dithering. */
+    type DitherOptions = ThreadOptions & {
+        /**
+         * Whether to use the module's integer Floyd-Steinberg engine, which
+         * splits large images across threads as a wavefront and gives the same
+         * result on any number of threads. It rounds errors differently from
+         * sanjuuni's ditherImage, so the output isn't identical to the default
+         * (defaults to false)
+         */
+        wavefront?: boolean,
+        /**
+         * Whether to scan alternate rows right to left, which avoids diagonal
+         * artifacts but can't be split across threads. Implies `wavefront`
+         * (defaults to false)
+         */
+        serpentine?: boolean
+    };
+
     /**
      * Reduces the colors in an image using the specified palette through Floyd-
-     * Steinberg dithering.
+     * Steinberg dithering, using sanjuuni's ditherImage unless the
+     * `wavefront` option is set.
      * @param image The image to reduce
      * @param palette The palette to use
+     * @param options Options for dithering
      * @return A reduced-color version of the image using the palette
      */
-    declare function ditherImage_floydSteinberg(image: RGBImage, palette: Palette): IndexedImage;
+    declare function ditherImage_floydSteinberg(image: RGBImage, palette: Palette | PackedPalette, options?: DitherOptions): IndexedImage;
     /**
      * Reduces the colors in an image using the specified palette through Floyd-
-     * Steinberg dithering.
+     * Steinberg dithering, using sanjuuni's ditherImage unless the
+     * `wavefront` option is set.
      * @param image The image to reduce
      * @param palette The palette to use
+     * @param options Options for dithering
      * @return A reduced-color version of the image using the palette
      */
-    declare function ditherImage_floydSteinberg(image: LabImage, palette: LabPalette): IndexedImage;
+    declare function ditherImage_floydSteinberg(image: LabImage, palette: LabPalette | PackedPalette, options?: DitherOptions): IndexedImage;
 
     /**
      * Generates a blit table from the specified CC image.
@@ -190,14 +494,14 @@ export module "sanjuuni" {
      * @param embedPalette Whether to embed the palette as a `palette` key (for BIMG)
      * @return The generated blit image source for the image data
      */
-    declare function makeTable(image: IndexedImage, palette: Palette, compact: boolean = false, embedPalette: boolean = false, binary: boolean = false): string;
+    declare function makeTable(image: IndexedImage, palette: Palette | PackedPalette, compact: boolean = false, embedPalette: boolean = false, binary: boolean = false): string;
     /**
      * Generates an NFP image from the specified CC image. This changes proportions!
      * @param input The image to convert
      * @param palette The palette for the image
      * @return The generated NFP for the image data
      */
-    declare function makeNFP(image: IndexedImage, palette: Palette): string;
+    declare function makeNFP(image: IndexedImage, palette: Palette | PackedPalette): string;
     /**
      * Generates a Lua display script from the specified CC image. This file can be
      * run directly to show the image on-screen.
@@ -205,33 +509,629 @@ export module "sanjuuni" {
      * @param palette The palette for the image
      * @return The generated  for the image data
      */
-    declare function makeLuaFile(image: IndexedImage, palette: Palette): string;
+    declare function makeLuaFile(image: IndexedImage, palette: Palette | PackedPalette): string;
     /**
      * Generates a raw mode frame from the specified CC image.
      * @param input The image to convert
      * @param palette The palette for the image
      * @return The generated  for the image data
      */
-    declare function makeRawImage(image: IndexedImage, palette: Palette): string;
+    declare function makeRawImage(image: IndexedImage, palette: Palette | PackedPalette): string;
     /**
      * Generates an uncompressed 32vid frame from the specified CC image.
      * @param input The image to convert
      * @param palette The palette for the image
      * @return The generated  for the image data
      */
-    declare function make32vid(image: IndexedImage, palette: Palette): Buffer;
+    declare function make32vid(image: IndexedImage, palette: Palette | PackedPalette): Buffer;
     /**
      * Generates a 32vid frame from the specified CC image using the custom compression scheme.
      * @param input The image to convert
      * @param palette The palette for the image
      * @return The generated  for the image data
      */
-    declare function make32vid_cmp(image: IndexedImage, palette: Palette): Buffer;
+    declare function make32vid_cmp(image: IndexedImage, palette: Palette | PackedPalette): Buffer;
     /**
      * Generates a 32vid frame from the specified CC image using the custom ANS compression scheme.
      * @param input The image to convert
      * @param palette The palette for the image
      * @return The generated  for the image data
      */
-    declare function make32vid_ans(image: IndexedImage, palette: Palette): Buffer;
+    declare function make32vid_ans(image: IndexedImage, palette: Palette | PackedPalette): Buffer;
+
+    /**
+     * Converts an sRGB image into CIELAB color space on a background thread.
+     * @param image The image to convert
+     * @return A promise resolving to a new image with all pixels in Lab color space
+     */
+    declare function makeLabImageAsync(image: RGBImage): Promise<LabImage>;
+    /** Asynchronous version of `resizeImage`. */
+    declare function resizeImageAsync(image: RGBImage, width: number, height: number, filter?: ResizeFilter): Promise<RGBImage>;
+    /** Asynchronous version of `fitTerminal`. */
+    declare function fitTerminalAsync(image: RGBImage, cols: number, rows: number, filter?: ResizeFilter): Promise<RGBImage>;
+
+    /**
+     * Generates an optimized palette for an image using the median cut algorithm on a
+     * background thread, packed into a Uint8Array.
+     * @param image The image to generate a palette for
+     * @param numColors The number of colors to get (must be a power of 2)
+     * @param options Options for sampling the image, with `packed` set
+     * @returns A promise resolving to an optimized palette for the image
+     */
+    declare function reducePalette_medianCutAsync(image: RGBImage | LabImage | ColorHistogram, numColors: number, options: PaletteOptions & {packed: true}): Promise<PackedPalette>;
+    /**
+     * Generates an optimized palette for an image using the median cut algorithm
+     * on a background thread.
+     * @param image The image to generate a palette for
+     * @param numColors The number of colors to get (must be a power of 2)
+     * @param options Options for sampling the image
+     * @returns A promise resolving to an optimized palette for the image
+     */
+    declare function reducePalette_medianCutAsync(image: RGBImage | LabImage | ColorHistogram, numColors: number = 16, options?: PaletteOptions): Promise<Palette>;
+    /**
+     * Generates an optimized palette for an image using the k-means algorithm on a
+     * background thread, packed into a Uint8Array.
+     * @param image The image to generate a palette for
+     * @param numColors The number of colors to get
+     * @param options Options for sampling the image, with `packed` set
+     * @returns A promise resolving to an optimized palette for the image
+     */
+    declare function reducePalette_kMeansAsync(image: RGBImage | LabImage | ColorHistogram, numColors: number, options: PaletteOptions & {packed: true}): Promise<PackedPalette>;
+    /**
+     * Generates an optimized palette for an image using the k-means algorithm on
+     * a background thread.
+     * @param image The image to generate a palette for
+     * @param numColors The number of colors to get
+     * @param options Options for sampling the image
+     * @returns A promise resolving to an optimized palette for the image
+     */
+    declare function reducePalette_kMeansAsync(image: RGBImage | LabImage | ColorHistogram, numColors: number = 16, options?: PaletteOptions): Promise<Palette>;
+    /**
+     * Generates an optimized palette for an image using octrees on a
+     * background thread, packed into a Uint8Array.
+     * @param image The image to generate a palette for
+     * @param numColors The number of colors to get
+     * @param options Options for sampling the image, with `packed` set
+     * @returns A promise resolving to an optimized palette for the image
+     */
+    declare function reducePalette_octreeAsync(image: RGBImage | LabImage | ColorHistogram, numColors: number, options: PaletteOptions & {packed: true}): Promise<PackedPalette>;
+    /**
+     * Generates an optimized palette for an image using octrees on a background
+     * thread.
+     * @param image The image to generate a palette for
+     * @param numColors The number of colors to get
+     * @param options Options for sampling the image
+     * @returns A promise resolving to an optimized palette for the image
+     */
+    declare function reducePalette_octreeAsync(image: RGBImage | LabImage | ColorHistogram, numColors: number = 16, options?: PaletteOptions): Promise<Palette>;
+
+    /**
+     * Reduces the colors in an image using the specified palette through
+     * thresholding on a background thread.
+     * @param image The image to reduce
+     * @param palette The palette to use
+     * @param options Options for dithering
+     * @return A promise resolving to a reduced-color version of the image
+     */
+    declare function thresholdImageAsync(image: RGBImage | LabImage, palette: Palette | PackedPalette, options?: ThreadOptions): Promise<IndexedImage>;
+    /**
+     * Reduces the colors in an image using the specified palette through ordered
+     * dithering on a background thread.
+     * @param image The image to reduce
+     * @param palette The palette to use
+     * @param options Options for dithering
+     * @return A promise resolving to a reduced-color version of the image
+     */
+    declare function ditherImage_orderedAsync(image: RGBImage | LabImage, palette: Palette | PackedPalette, options?: ThreadOptions): Promise<IndexedImage>;
+    /**
+     * Reduces the colors in an image using the specified palette through Floyd-
+     * Steinberg dithering on a background thread.
+     * @param image The image to reduce
+     * @param palette The palette to use
+     * @param options Options for dithering
+     * @return A promise resolving to a reduced-color version of the image
+     */
+    declare function ditherImage_floydSteinbergAsync(image: RGBImage | LabImage, palette: Palette | PackedPalette, options?: DitherOptions): Promise<IndexedImage>;
+
+    /** Asynchronous version of `makeTable`. */
+    declare function makeTableAsync(image: IndexedImage, palette: Palette | PackedPalette, compact: boolean = false, embedPalette: boolean = false, binary: boolean = false): Promise<string>;
+    /** Asynchronous version of `makeNFP`. */
+    declare function makeNFPAsync(image: IndexedImage, palette: Palette | PackedPalette): Promise<string>;
+    /** Asynchronous version of `makeLuaFile`. */
+    declare function makeLuaFileAsync(image: IndexedImage, palette: Palette | PackedPalette): Promise<string>;
+    /** Asynchronous version of `makeRawImage`. */
+    declare function makeRawImageAsync(image: IndexedImage, palette: Palette | PackedPalette): Promise<string>;
+    /** Asynchronous version of `make32vid`. */
+    declare function make32vidAsync(image: IndexedImage, palette: Palette | PackedPalette): Promise<Buffer>;
+    /** Asynchronous version of `make32vid_cmp`. */
+    declare function make32vid_cmpAsync(image: IndexedImage, palette: Palette | PackedPalette): Promise<Buffer>;
+    /** Asynchronous version of `make32vid_ans`. */
+    declare function make32vid_ansAsync(image: IndexedImage, palette: Palette | PackedPalette): Promise<Buffer>;
+
+    /**
+     * Converts raw pixel data into an output format in a single call, without
+     * creating any intermediate images or palettes.
+     * @param image The image source
+     * @param width The width of the image
+     * @param height The height of the image
+     * @param format The format the data is in, i.e. the byte order
+     * @param options Options for the conversion
+     * @return The generated output; 32vid formats return a Buffer, others a string
+     */
+    declare function convert(image: Buffer | ArrayBuffer | Uint8Array | Uint32Array, width: number, height: number, format: PixelFormat, options?: ConvertOptions): string | Buffer;
+    /** Asynchronous version of `convert`. */
+    declare function convertAsync(image: Buffer | ArrayBuffer | Uint8Array | Uint32Array, width: number, height: number, format: PixelFormat, options?: ConvertOptions): Promise<string | Buffer>;
+    /**
+     * Converts a batch of frames with the same size and format, running
+     * several frames in parallel. Only `window` frames are converted at once,
+     * which limits the memory used for intermediate images.
+     * @param frames The pixel data of each frame
+     * @param width The width of the frames
+     * @param height The height of the frames
+     * @param format The pixel format of the frames
+     * @param options Options for the conversion, plus the number of frames to convert at once (defaults to the thread count)
+     * @return The converted frames, in the same order as the input
+     */
+    declare function convertFrames(frames: (Buffer | ArrayBuffer | Uint8Array | Uint32Array)[], width: number, height: number, format: PixelFormat, options?: ConvertOptions & {window?: number}): (string | Buffer)[];
+    /** Asynchronous version of `convertFrames`. */
+    declare function convertFramesAsync(frames: (Buffer | ArrayBuffer | Uint8Array | Uint32Array)[], width: number, height: number, format: PixelFormat, options?: ConvertOptions & {window?: number}): Promise<(string | Buffer)[]>;
+
+    /** Options for `convertWall`. The `stride` and `resize` options are ignored. */
+    type WallOptions = ConvertOptions & {
+        /** The number of monitors across the wall */
+        tileCols: number,
+        /** The number of monitors down the wall */
+        tileRows: number,
+        /** The size of each monitor in characters (defaults to splitting the image evenly) */
+        cellsPerTile?: {cols: number, rows: number},
+        /**
+         * Whether all monitors share one palette, reduced from the whole image
+         * and dithered across tile borders ("shared", the default), or each
+         * monitor gets its own palette ("tile")
+         */
+        palette?: "shared" | "tile",
+        /** The filter used to scale the image to the wall, if needed (defaults to "box") */
+        filter?: ResizeFilter
+    };
+
+    /**
+     * Converts an image for a wall of monitors in one call, scaling it to
+     * fill the wall and generating an output for each monitor in parallel.
+     * @param image The image to convert
+     * @param options The wall layout and conversion options
+     * @return One output per monitor, row by row from the top left
+     */
+    declare function convertWall(image: RGBImage, options: WallOptions): (string | Buffer)[];
+    /** Asynchronous version of `convertWall`. */
+    declare function convertWallAsync(image: RGBImage, options: WallOptions): Promise<(string | Buffer)[]>;
+
+    /**
+     * Generates several outputs from the same CC image. The character and color
+     * planes are only computed once (and are cached on the image for later
+     * `make*` calls with the same palette).
+     * @param input The image to convert
+     * @param palette The palette for the image
+     * @param formats The output formats to generate
+     * @param options Options for "table"/"bimg" outputs, and whether to run the encoders in parallel
+     * @return The generated outputs, in the same order as `formats`
+     */
+    declare function makeOutputs(image: IndexedImage, palette: Palette | PackedPalette, formats: OutputFormat[], options?: {compact?: boolean, embedPalette?: boolean, binary?: boolean, parallel?: boolean, threads?: number}): (string | Buffer)[];
+    /** Asynchronous version of `makeOutputs`. */
+    declare function makeOutputsAsync(image: IndexedImage, palette: Palette | PackedPalette, formats: OutputFormat[], options?: {compact?: boolean, embedPalette?: boolean, binary?: boolean, parallel?: boolean, threads?: number}): Promise<(string | Buffer)[]>;
+    /**
+     * Generates an output into an existing buffer, e.g. to pack it into a
+     * network frame without creating a JS string or Buffer for it. sanjuuni's
+     * encoders build each output in native memory first, so it's copied into
+     * the buffer once. Text formats are written as their raw bytes. If the
+     * output doesn't fit, a RangeError is thrown and nothing is written.
+     * @param input The image to convert
+     * @param palette The palette for the image
+     * @param format The output format to generate
+     * @param target The buffer to write into
+     * @param offset The byte offset in the buffer to start writing at (defaults to 0)
+     * @param options Options for "table"/"bimg" outputs
+     * @return The number of bytes written
+     */
+    declare function makeOutputInto(image: IndexedImage, palette: Palette | PackedPalette, format: OutputFormat, target: Buffer | Uint8Array | ArrayBuffer, offset?: number, options?: {compact?: boolean, embedPalette?: boolean, binary?: boolean}): number;
+    /** Asynchronous version of `makeOutputInto`. The buffer must not be modified until the Promise settles. */
+    declare function makeOutputIntoAsync(image: IndexedImage, palette: Palette | PackedPalette, format: OutputFormat, target: Buffer | Uint8Array | ArrayBuffer, offset?: number, options?: {compact?: boolean, embedPalette?: boolean, binary?: boolean}): Promise<number>;
+
+    /** Options for a 32vid video encoder. */
+    type VideoEncoderOptions = {
+        /** The frame rate of the video, from 1 to 255 (defaults to 20) */
+        fps?: number,
+        /** The compression scheme for frames, matching `make32vid`, `make32vid_cmp` and `make32vid_ans` (defaults to "ans") */
+        compression?: "none" | "custom" | "ans"
+    };
+
+    /**
+     * Encodes a sequence of frames into a 32vid video incrementally. The output
+     * is the current `header`, followed by the data returned from each `push`
+     * call; once finished, the header returned from `end` must be written over
+     * the start of the output. 32vid stores the video's size and frame count in
+     * the header, so output written to a sink that can't seek has to be held
+     * back until `end` is called instead.
+     */
+    declare class VideoEncoder {
+        constructor(options?: VideoEncoderOptions);
+        /** The header for the frames pushed so far. */
+        readonly header: Buffer;
+        /** The number of frames pushed so far. */
+        readonly frames: number;
+        /**
+         * Encodes the next frame of the video. All frames must be the same size.
+         * @param image The frame to encode
+         * @param palette The palette for the frame
+         * @return The encoded frame data to append to the output; the frame is
+         * only counted in the header once this returns
+         */
+        push(image: IndexedImage, palette: Palette | PackedPalette): Buffer;
+        /** Asynchronous version of `push`. Frames are ordered by call, not completion. */
+        pushAsync(image: IndexedImage, palette: Palette | PackedPalette): Promise<Buffer>;
+        /**
+         * Finishes the video. No more frames may be pushed afterwards.
+         * @return The final header, which must replace the start of the output
+         */
+        end(): Buffer;
+    }
+
+    /** Options for a 32vid video stream. */
+    type VideoStreamOptions = VideoEncoderOptions & {
+        /** Whether to hold all frames until the stream ends and output them after the final header, for sinks that can't seek (defaults to false) */
+        buffered?: boolean
+    };
+
+    /**
+     * A Transform stream which takes `{image, palette}` frames and outputs a
+     * 32vid video. The final header is emitted as a `header` event when the
+     * stream ends, and must be written over the start of the output (e.g. with
+     * a positional `fs.write`). Pipes, sockets and other sinks that can't seek
+     * need the `buffered` option, which outputs the final header and every
+     * frame once the stream ends, at the cost of keeping the video in memory.
+     */
+    declare class VideoStream extends Transform {
+        constructor(options?: VideoStreamOptions);
+        readonly encoder: VideoEncoder;
+        on(event: "header", listener: (header: Buffer) => void): this;
+        on(event: string | symbol, listener: (...args: any[]) => void): this;
+    }
+
+    /** Creates a new `VideoStream`. */
+    declare function createVideoStream(options?: VideoStreamOptions): VideoStream;
+
+    /** Options for a video palette generator. */
+    type PaletteGeneratorOptions = {
+        /** The number of colors to get, from 1 to 256 (defaults to 16) */
+        numColors?: number,
+        /** Histogram distance below which the previous palette is reused as-is (defaults to 0.02) */
+        reuseThreshold?: number,
+        /** Histogram distance at or above which the palette is regenerated from scratch (defaults to 0.5) */
+        sceneThreshold?: number,
+        /** The maximum number of k-means iterations when refining the previous palette (defaults to 8) */
+        maxIterations?: number,
+        /** Refinement stops once no color moves further than this in any channel (defaults to 0.5) */
+        tolerance?: number,
+        /** The number of bits per channel in the frame histograms, from 1 to 6 (defaults to 5) */
+        histogramBits?: number
+    };
+
+    /** The result of generating a palette for a video frame. */
+    type PaletteGeneratorResult = {
+        /** The palette for the frame */
+        palette: Palette,
+        /**
+         * How the palette was made: "reused" if the frame was close enough to
+         * reuse the previous palette, "warm" if the previous palette was refined
+         * with k-means, or "cold" if a new palette was generated from scratch
+         */
+        mode: "reused" | "warm" | "cold",
+        /** The number of k-means iterations run when refining */
+        iterations: number,
+        /** The histogram distance from the frame the palette was last made for, from 0 to 1 */
+        distance: number
+    };
+
+    /**
+     * Generates k-means palettes for consecutive video frames, reusing or
+     * refining the previous frame's palette when the frame hasn't changed much.
+     * Works on both RGB and Lab images, but all frames should be the same kind.
+     */
+    declare class PaletteGenerator {
+        constructor(options?: PaletteGeneratorOptions);
+        /**
+         * Generates a palette for the next frame.
+         * @param image The frame to generate a palette for
+         * @return The palette, and how it was generated
+         */
+        generate(image: RGBImage | LabImage): PaletteGeneratorResult;
+        /** Asynchronous version of `generate`. */
+        generateAsync(image: RGBImage | LabImage): Promise<PaletteGeneratorResult>;
+        /** Forgets the previous palette, so the next frame starts from scratch. */
+        reset(): void;
+    }
+
+    /** Options for a delta encoder. */
+    type DeltaEncoderOptions = {
+        /** The format to encode keyframes in (defaults to "32vid_ans") */
+        keyframeFormat?: OutputFormat,
+        /** The fraction of changed cells above which a keyframe is sent instead, from 0 to 1 (defaults to 0.5) */
+        threshold?: number,
+        /** The number of unchanged cells a run may skip over to join the next run (defaults to 2) */
+        mergeGap?: number,
+        /** Forces a keyframe every this many frames, or never if 0 (defaults to 0) */
+        keyframeInterval?: number,
+        /** For "table" and "bimg" keyframes: whether to make the output as compact as possible */
+        compact?: boolean,
+        /** For "table" keyframes: whether to embed the palette as a `palette` key */
+        embedPalette?: boolean,
+        /** For "table" and "bimg" keyframes: whether to output binary strings */
+        binary?: boolean,
+        /** The maximum number of threads to use for keyframes (defaults to all) */
+        threads?: number
+    };
+
+    /** A frame encoded by a delta encoder. */
+    type DeltaFrame = {
+        /** Whether this is a full frame in the keyframe format, or a delta */
+        keyframe: boolean,
+        /** The encoded frame */
+        data: string | Buffer,
+        /** The number of character cells that changed */
+        cells: number
+    };
+
+    /**
+     * Encodes frames as the character cells that changed since the previous
+     * frame, falling back to full keyframes when too much has changed, or the
+     * size or palette changes.
+     *
+     * Delta frames are Buffers in the following little-endian format:
+     * - uint16 width, uint16 height (in characters)
+     * - uint32 number of runs
+     * - for each run: uint16 x, uint16 y, uint16 length, then `length`
+     *   character bytes and `length` color bytes (foreground in the low
+     *   nibble, background in the high nibble)
+     */
+    declare class DeltaEncoder {
+        constructor(options?: DeltaEncoderOptions);
+        /**
+         * Encodes the next frame.
+         * @param image The frame to encode
+         * @param palette The palette for the frame
+         * @return The encoded frame
+         */
+        push(image: IndexedImage, palette: Palette | PackedPalette): DeltaFrame;
+        /** Asynchronous version of `push`. */
+        pushAsync(image: IndexedImage, palette: Palette | PackedPalette): Promise<DeltaFrame>;
+        /** Forgets the previous frame, so the next frame is a keyframe. */
+        reset(): void;
+    }
+
+    /** Options for an incremental converter. */
+    type IncrementalConverterOptions = ConvertOptions & {
+        /** The size of the tiles frames are compared in, in characters (defaults to 8x4) */
+        tile?: {cols: number, rows: number},
+        /** For Floyd-Steinberg: the number of pixels around a changed region to dither with it (defaults to 8) */
+        margin?: number,
+        /** The fraction of changed tiles above which the whole frame is converted (defaults to 0.5) */
+        threshold?: number
+    };
+
+    /** A region of characters, as reported by an incremental converter. */
+    type CellRect = {
+        x: number,
+        y: number,
+        width: number,
+        height: number
+    };
+
+    /** The changes made by a frame pushed to an incremental converter. */
+    type IncrementalFrame = {
+        /** Whether the whole frame was converted */
+        full: boolean,
+        /** The regions of characters that changed */
+        rects: CellRect[],
+        /** The number of character cells in the regions */
+        cells: number
+    };
+
+    /**
+     * Converts a live stream of frames with a fixed palette, such as a mirrored
+     * screen or camera, only redoing the tiles that changed since the previous
+     * frame. Frames are converted at their own size, and the whole frame is
+     * converted if its size or format changes.
+     *
+     * Threshold and ordered dithering give the same result as converting the
+     * whole frame. Floyd-Steinberg dithering is redone on the changed regions
+     * plus a margin, so edges may differ slightly from a full conversion.
+     */
+    declare class IncrementalConverter {
+        /**
+         * @param palette The palette to convert to (in Lab if `lab` is set)
+         * @param options Options for conversion; `quantizer`, `numColors` and `resize` are ignored
+         */
+        constructor(palette: Palette | PackedPalette, options?: IncrementalConverterOptions);
+        /**
+         * Converts the next frame.
+         * @param data The raw pixel data of the frame
+         * @param width The width of the frame
+         * @param height The height of the frame
+         * @param format The format of the pixel data
+         * @param options Additional options
+         * @return The regions that changed
+         */
+        push(data: ArrayBuffer | Uint8Array | Uint32Array, width: number, height: number, format: PixelFormat, options?: {stride?: number}): IncrementalFrame;
+        /** Asynchronous version of `push`. */
+        pushAsync(data: ArrayBuffer | Uint8Array | Uint32Array, width: number, height: number, format: PixelFormat, options?: {stride?: number}): Promise<IncrementalFrame>;
+        /**
+         * Returns the characters and colors of a region of the current frame.
+         * Colors have the foreground in the low nibble and the background in
+         * the high nibble.
+         * @param x The X coordinate of the region, in characters
+         * @param y The Y coordinate of the region, in characters
+         * @param width The width of the region
+         * @param height The height of the region
+         * @return One byte per character for each, in row-major order
+         */
+        getCells(x: number, y: number, width: number, height: number): {chars: Buffer, colors: Buffer};
+        /**
+         * Encodes the whole current frame.
+         * @param format The format to generate (defaults to the `output` option)
+         * @return The encoded frame
+         */
+        makeOutput(format?: OutputFormat): string | Buffer;
+        /** Forgets the previous frame, so the next frame is converted in full. */
+        reset(): void;
+    }
+
+    /** Statistics about the thread pool. */
+    type ThreadPoolStats = {
+        /** The number of threads used for parallel work, including the calling thread */
+        threads: number,
+        /** The number of parallel loops currently running */
+        activeLoops: number,
+        /** The number of parallel loops run so far */
+        loops: number,
+        /** The number of chunks processed so far */
+        chunks: number
+    };
+
+    /**
+     * Sets the number of threads used for parallel work in this module,
+     * including the calling thread. Defaults to the number of CPU cores.
+     * Operations that are running while this is called finish on the threads
+     * they already have.
+     *
+     * Stages that run inside sanjuuni (such as makeCCImage, the palette
+     * reducers and the encoders) use sanjuuni's own work queue, which this
+     * doesn't affect. The SANJUUNI_THREADS environment variable sets the size
+     * this module's pool starts with.
+     * @param count The number of threads to use
+     */
+    declare function setThreadCount(count: number): void;
+    /**
+     * Returns the number of threads used for parallel work in this module.
+     * @return The number of threads, including the calling thread
+     */
+    declare function getThreadCount(): number;
+    /**
+     * Returns statistics about the thread pool.
+     * @return The current statistics
+     */
+    declare function getThreadPoolStats(): ThreadPoolStats;
+
+    /** Statistics about the pool of reusable image buffers. */
+    type ImagePoolStats = {
+        /** The number of bytes held by pooled images */
+        bytes: number,
+        /** The number of pooled images */
+        images: number,
+        /** The most bytes the pool will hold */
+        limit: number,
+        /** The number of images allocated from the pool */
+        hits: number,
+        /** The number of images that had to be newly allocated */
+        misses: number
+    };
+
+    /**
+     * Sets the most memory the image pool will hold on to. Images released
+     * by the module (including collected image objects) are kept in the pool
+     * and reused for the next image of the same size, which avoids allocating
+     * new buffers when converting many frames of the same size. Defaults to
+     * 64 MiB; set to 0 to disable pooling.
+     * @param bytes The maximum size of the pool in bytes
+     */
+    declare function setImagePoolLimit(bytes: number): void;
+    /**
+     * Frees pooled images, e.g. after the source size changes.
+     * @param bytes The number of bytes to leave in the pool (defaults to 0)
+     */
+    declare function trimImagePool(bytes?: number): void;
+    /**
+     * Returns statistics about the image pool.
+     * @return The current statistics
+     */
+    declare function getImagePoolStats(): ImagePoolStats;
+
+    /** Statistics about the result cache. */
+    type CacheStats = {
+        /** The approximate number of bytes held by the cache */
+        bytes: number,
+        /** The number of cached palettes and outputs */
+        entries: number,
+        /** The most bytes the cache will hold */
+        limit: number,
+        /** The number of lookups that found a result */
+        hits: number,
+        /** The number of lookups that didn't */
+        misses: number
+    };
+
+    /**
+     * Sets the size of the result cache, which is disabled (0) by default.
+     * While enabled, palettes made by the `reducePalette_*` functions and the
+     * outputs of `convert` and `convertFrames` are kept, keyed by a hash of the
+     * input pixels and options, so converting the same image with the same
+     * options again returns the stored result. The least recently used
+     * results are dropped once the cache is full.
+     * @param bytes The maximum size of the cache in bytes, or 0 to disable it
+     */
+    declare function setCacheLimit(bytes: number): void;
+    /** Drops every cached result. */
+    declare function clearCache(): void;
+    /**
+     * Returns statistics about the result cache.
+     * @return The current statistics
+     */
+    declare function getCacheStats(): CacheStats;
+
+    /** Timing statistics for one stage of conversion. */
+    type StageStats = {
+        /** The number of times the stage ran */
+        calls: number,
+        /** The number of source pixels processed */
+        pixels: number,
+        /** The total time spent in the stage, in milliseconds */
+        totalTime: number,
+        /** The time taken by the last run, in milliseconds */
+        lastTime: number,
+        /** When the last run started, on the `perf_hooks` `performance.now()` timeline */
+        lastStart: number
+    };
+
+    /** Statistics collected by the module. */
+    type Stats = {
+        /** Whether stage timing is enabled */
+        enabled: boolean,
+        /**
+         * Timings for each stage. Lab conversion done while reading pixels
+         * counts towards ingest or resize; "index" is the conversion of
+         * dithered colors to palette indices.
+         */
+        stages: Record<"ingest" | "resize" | "lab" | "quantize" | "dither" | "index" | "ccImage" | "encode", StageStats>,
+        /** Memory used by images allocated by this module, in bytes (always tracked) */
+        imageMemory: {
+            /** Total bytes allocated */
+            allocated: number,
+            /** Bytes currently in use */
+            live: number,
+            /** The most bytes in use at once */
+            peak: number
+        }
+    };
+
+    /**
+     * Enables or disables stage timing. Timing is off by default, and costs
+     * almost nothing while off.
+     * @param enabled Whether to time stages
+     */
+    declare function setStatsEnabled(enabled: boolean): void;
+    /**
+     * Returns the statistics collected so far.
+     * @return The current statistics
+     */
+    declare function getStats(): Stats;
+    /** Resets all counters, and sets the peak memory to the current usage. */
+    declare function resetStats(): void;
 }
@@ -1,3 +1,61 @@
+const {Transform} = require('stream');
+const {performance} = require('perf_hooks');
 const addon = require('./build/Release/sanjuuni.node');
 
+/**
+ * Streams a 32vid video from `{image, palette}` frames written to it. The
+ * header is pushed with the first frame; since it holds the size of the video,
+ * the final header is emitted as a `header` event once the stream ends, and
+ * should be written over the start of the output. Sinks that can't seek (pipes,
+ * sockets) should use the `buffered` option, which holds the frames back until
+ * the end and then pushes the final header followed by all of them.
+ */
+class VideoStream extends Transform {
+    constructor(options) {
+        super({writableObjectMode: true});
+        this.encoder = new addon.VideoEncoder(options);
+        this.frames = options && options.buffered ? [] : null;
+    }
+
+    _transform(frame, encoding, callback) {
+        const first = this.encoder.frames === 0;
+        this.encoder.pushAsync(frame.image, frame.palette).then(data => {
+            if (this.frames) {
+                this.frames.push(data);
+                return callback();
+            }
+            if (first) this.push(this.encoder.header);
+            callback(null, data);
+        }, callback);
+    }
+
+    _flush(callback) {
+        const header = this.encoder.end();
+        if (this.frames) {
+            this.push(header);
+            for (const data of this.frames) this.push(data);
+            this.frames = [];
+        }
+        this.emit('header', header);
+        callback();
+    }
+}
+
+// The native stats record start times on the monotonic clock, which is the
+// same clock process.hrtime uses; shift them onto the perf_hooks timeline so
+// they can be compared with marks and measures.
+const getStats = addon.getStats;
+addon.getStats = () => {
+    const stats = getStats();
+    const offset = performance.now() - Number(process.hrtime.bigint()) / 1e6;
+    for (const name in stats.stages) {
+        const stage = stats.stages[name];
+        stage.lastStart = stage.calls > 0 ? stage.lastStart + offset : 0;
+    }
+    return stats;
+};
+
+addon.VideoStream = VideoStream;
+addon.createVideoStream = options => new VideoStream(options);
+
 module.exports = addon;
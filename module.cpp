@@ -1,16 +1,652 @@
 #include <napi.h>
 #include <sanjuuni.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include "pixels.hpp"
 
 WorkQueue work;
 OpenCL::Device * device = NULL;
 
-void FinalizeMat(Napi::Env env, Mat * obj) {delete obj;}
-void FinalizeMat1b(Napi::Env env, Mat1b * obj) {delete obj;}
+// the calling thread takes part in every loop, so it needs one fewer worker
+ThreadPool pool(InitialThreadCount() - 1);
+thread_local unsigned threadLimit = 0;
+
+// Optional per-stage timing. When disabled, a timer costs one relaxed load.
+enum Stage {
+    STAGE_INGEST,
+    STAGE_RESIZE,
+    STAGE_LAB,
+    STAGE_QUANTIZE,
+    STAGE_DITHER,
+    STAGE_INDEX,
+    STAGE_CCIMAGE,
+    STAGE_ENCODE,
+    STAGE_COUNT
+};
+
+static const char * stageNames[STAGE_COUNT] = {"ingest", "resize", "lab", "quantize", "dither", "index", "ccImage", "encode"};
+
+struct StageStats {
+    std::atomic<uint64_t> calls{0}, pixels{0}, totalNs{0}, lastNs{0}, lastStartNs{0};
+};
+
+std::atomic<bool> statsEnabled{false};
+StageStats stageStats[STAGE_COUNT];
+
+static uint64_t MonotonicNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class StageTimer {
+public:
+    StageTimer(Stage stage, uint64_t pixels): stage(stage), pixels(pixels), start(statsEnabled.load(std::memory_order_relaxed) ? MonotonicNs() : 0) {}
+    ~StageTimer() {
+        if (start == 0) return;
+        const uint64_t time = MonotonicNs() - start;
+        StageStats& stats = stageStats[stage];
+        stats.calls++;
+        stats.pixels += pixels;
+        stats.totalNs += time;
+        stats.lastNs = time;
+        stats.lastStartNs = start;
+    }
+private:
+    Stage stage;
+    uint64_t pixels;
+    uint64_t start;
+};
+
+// Memory held by images this module allocates. This is always tracked, as
+// it's only a few atomic operations per image.
+std::atomic<int64_t> imageBytesAllocated{0}, imageBytesLive{0}, imageBytesPeak{0};
+
+void TrackImageMemory(int64_t bytes) {
+    if (bytes > 0) imageBytesAllocated += bytes;
+    int64_t live = imageBytesLive += bytes, peak = imageBytesPeak;
+    while (live > peak && !imageBytesPeak.compare_exchange_weak(peak, live));
+}
+
+int64_t ImageBytes(const Mat& img) {return (int64_t)img.width * img.height * sizeof(uchar3);}
+int64_t ImageBytes(const Mat1b& img) {return (int64_t)img.width * img.height;}
+
+// Tracks an intermediate image for as long as it's in scope.
+struct ImageMemory {
+    int64_t bytes;
+    ImageMemory(const Mat& img): bytes(ImageBytes(img)) {TrackImageMemory(bytes);}
+    ImageMemory(const Mat1b& img): bytes(ImageBytes(img)) {TrackImageMemory(bytes);}
+    ~ImageMemory() {TrackImageMemory(-bytes);}
+};
+
+// Keeps released image buffers around so converting frames of the same size
+// doesn't allocate a new image at every stage. Buffers are only reused at
+// exactly the same size, and the oldest are freed once the pool holds more
+// than its limit. Device images are never pooled.
+class ImagePool {
+public:
+    Mat * NewMat(unsigned width, unsigned height) {
+        if (Mat * img = Take(mats, width, height)) return img;
+        return new Mat(width, height, device);
+    }
+    Mat1b * NewMat1b(unsigned width, unsigned height) {
+        if (Mat1b * img = Take(mat1bs, width, height)) return img;
+        return new Mat1b(width, height, device);
+    }
+    void Release(Mat * img) {Put(mats, img);}
+    void Release(Mat1b * img) {Put(mat1bs, img);}
+    // Frees pooled images until at most `bytes` are held.
+    void Trim(int64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        TrimLocked(bytes);
+    }
+    void SetLimit(int64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        limit = bytes;
+        TrimLocked(limit);
+    }
+    int64_t Limit() {std::lock_guard<std::mutex> lock(mutex); return limit;}
+    int64_t Bytes() {std::lock_guard<std::mutex> lock(mutex); return bytes;}
+    size_t Images() {std::lock_guard<std::mutex> lock(mutex); return mats.size() + mat1bs.size();}
+    uint64_t Hits() {return hits;}
+    uint64_t Misses() {return misses;}
+private:
+    template<typename Image>
+    struct Entry {
+        uint64_t seq;
+        Image * img;
+    };
+    std::mutex mutex;
+    std::vector<Entry<Mat>> mats;
+    std::vector<Entry<Mat1b>> mat1bs;
+    uint64_t seq = 0;
+    int64_t bytes = 0;
+    int64_t limit = 64 * 1024 * 1024;
+    std::atomic<uint64_t> hits{0}, misses{0};
+
+    template<typename Image>
+    Image * Take(std::vector<Entry<Image>>& list, unsigned width, unsigned height) {
+        if (device != NULL) return NULL;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = list.size(); i > 0; i--) {
+            Image * img = list[i-1].img;
+            if (img->width == width && img->height == height) {
+                list.erase(list.begin() + (i - 1));
+                bytes -= ImageBytes(*img);
+                hits++;
+                return img;
+            }
+        }
+        misses++;
+        return NULL;
+    }
+
+    template<typename Image>
+    void Put(std::vector<Entry<Image>>& list, Image * img) {
+        const int64_t size = ImageBytes(*img);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (device == NULL && size <= limit) {
+                list.push_back({seq++, img});
+                bytes += size;
+                TrimLocked(limit);
+                return;
+            }
+        }
+        delete img;
+    }
+
+    void TrimLocked(int64_t max) {
+        while (bytes > max) {
+            // Free whichever list has the oldest entry.
+            if (!mats.empty() && (mat1bs.empty() || mats.front().seq < mat1bs.front().seq)) {
+                bytes -= ImageBytes(*mats.front().img);
+                delete mats.front().img;
+                mats.erase(mats.begin());
+            } else {
+                bytes -= ImageBytes(*mat1bs.front().img);
+                delete mat1bs.front().img;
+                mat1bs.erase(mat1bs.begin());
+            }
+        }
+    }
+};
+
+ImagePool imagePool;
+
+// Returns a temporary image to the pool when it goes out of scope.
+struct PoolDeleter {
+    void operator()(Mat * img) const {imagePool.Release(img);}
+    void operator()(Mat1b * img) const {imagePool.Release(img);}
+};
+typedef std::unique_ptr<Mat, PoolDeleter> PooledMat;
+typedef std::unique_ptr<Mat1b, PoolDeleter> PooledMat1b;
+
+// Streaming 64-bit xxHash (XXH64), used to key cached results.
+class Hasher {
+public:
+    Hasher(uint64_t seed): v{seed + P1 + P2, seed + P2, seed, seed - P1}, seed(seed) {}
+
+    void Add(const void * data, size_t len) {
+        const uint8_t * p = (const uint8_t*)data;
+        total += len;
+        if (used + len < 32) {
+            memcpy(buf + used, p, len);
+            used += len;
+            return;
+        }
+        if (used) {
+            const size_t n = 32 - used;
+            memcpy(buf + used, p, n);
+            Stripe(buf);
+            p += n;
+            len -= n;
+            used = 0;
+        }
+        for (; len >= 32; p += 32, len -= 32) Stripe(p);
+        memcpy(buf, p, len);
+        used = len;
+    }
+    template<typename T>
+    void Add(const T& value) {Add(&value, sizeof(T));}
+
+    uint64_t Digest() const {
+        uint64_t h = total >= 32 ? Rotl(v[0], 1) + Rotl(v[1], 7) + Rotl(v[2], 12) + Rotl(v[3], 18) : seed + P5;
+        if (total >= 32) for (int i = 0; i < 4; i++) h = (h ^ Round(0, v[i])) * P1 + P4;
+        h += total;
+        const uint8_t * p = buf;
+        size_t len = used;
+        for (; len >= 8; p += 8, len -= 8) h = Rotl(h ^ Round(0, Read<uint64_t>(p)), 27) * P1 + P4;
+        if (len >= 4) {
+            h = Rotl(h ^ (Read<uint32_t>(p) * P1), 23) * P2 + P3;
+            p += 4;
+            len -= 4;
+        }
+        for (; len > 0; p++, len--) h = Rotl(h ^ (*p * P5), 11) * P1;
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        return h ^ (h >> 32);
+    }
+
+private:
+    static constexpr uint64_t P1 = 11400714785074694791ULL, P2 = 14029467366897019727ULL, P3 = 1609587929392839161ULL, P4 = 9650029242287828579ULL, P5 = 2870177450012600261ULL;
+    uint64_t v[4];
+    uint64_t seed;
+    uint8_t buf[32];
+    size_t used = 0;
+    uint64_t total = 0;
+
+    static uint64_t Rotl(uint64_t x, int r) {return (x << r) | (x >> (64 - r));}
+    static uint64_t Round(uint64_t acc, uint64_t in) {return Rotl(acc + in * P2, 31) * P1;}
+    template<typename T>
+    static uint64_t Read(const uint8_t * p) {T x; memcpy(&x, p, sizeof(T)); return x;}
+    void Stripe(const uint8_t * p) {for (int i = 0; i < 4; i++) v[i] = Round(v[i], Read<uint64_t>(p + i * 8));}
+};
+
+void HashImage(Hasher& hash, Mat& img) {
+    hash.Add(img.width);
+    hash.Add(img.height);
+    for (unsigned y = 0; y < img.height; y++) hash.Add(&img[y][0], img.width * sizeof(uchar3));
+}
+
+// Opt-in cache of generated palettes and outputs, keyed by a hash of the
+// input pixels and every option that affects the result (with a different
+// seed for each kind of result). The least recently used entries are evicted
+// once it holds more than its limit, which is 0 (disabled) by default.
+class ResultCache {
+public:
+    bool Enabled() const {return limit.load(std::memory_order_relaxed) > 0;}
+
+    bool Get(uint64_t key, std::string * output) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const Entry * entry = Find(key);
+        if (entry) *output = entry->output;
+        return entry != NULL;
+    }
+    bool Get(uint64_t key, std::vector<Vec3b> * palette) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const Entry * entry = Find(key);
+        if (entry) *palette = entry->palette;
+        return entry != NULL;
+    }
+    void Put(uint64_t key, const std::string& output) {Put(Entry{key, output, {}});}
+    void Put(uint64_t key, const std::vector<Vec3b>& palette) {Put(Entry{key, "", palette});}
+
+    void SetLimit(int64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        limit = bytes;
+        Evict();
+    }
+    void Clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+        index.clear();
+        bytes = 0;
+    }
+    int64_t Limit() const {return limit;}
+    int64_t Bytes() {std::lock_guard<std::mutex> lock(mutex); return bytes;}
+    size_t Entries() {std::lock_guard<std::mutex> lock(mutex); return entries.size();}
+    uint64_t Hits() const {return hits;}
+    uint64_t Misses() const {return misses;}
+
+private:
+    struct Entry {
+        uint64_t key;
+        std::string output;
+        std::vector<Vec3b> palette;
+        // includes a rough allowance for the list and index nodes
+        int64_t Bytes() const {return output.size() + palette.size() * sizeof(Vec3b) + sizeof(Entry) + 64;}
+    };
+    std::mutex mutex;
+    std::list<Entry> entries;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    int64_t bytes = 0;
+    std::atomic<int64_t> limit{0};
+    std::atomic<uint64_t> hits{0}, misses{0};
+
+    // Must be called with the mutex held.
+    const Entry * Find(uint64_t key) {
+        auto it = index.find(key);
+        if (it == index.end()) {
+            misses++;
+            return NULL;
+        }
+        hits++;
+        entries.splice(entries.begin(), entries, it->second);
+        return &entries.front();
+    }
+
+    void Put(Entry&& entry) {
+        const int64_t size = entry.Bytes();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (size > limit || index.count(entry.key)) return;
+        entries.push_front(std::move(entry));
+        index[entries.front().key] = entries.begin();
+        bytes += size;
+        Evict();
+    }
+
+    void Evict() {
+        while (bytes > limit && !entries.empty()) {
+            bytes -= entries.back().Bytes();
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+    }
+};
+
+ResultCache resultCache;
+
+typedef std::vector<Vec3b> (*Quantizer)(Mat&, int, OpenCL::Device*);
+typedef Mat (*Ditherer)(Mat&, const std::vector<Vec3b>&, OpenCL::Device*);
+
+// Character and color planes generated by makeCCImage.
+struct CCImage {
+    std::vector<Vec3b> palette;
+    uchar * chars = NULL;
+    uchar * cols = NULL;
+    int width = 0, height = 0;
+    ~CCImage() {delete[] chars; delete[] cols;}
+};
+
+// The last CC planes generated for each live indexed image, so generating
+// several outputs for the same image and palette only runs makeCCImage once.
+std::unordered_map<const Mat1b*, std::shared_ptr<const CCImage>> ccImageCache;
+std::mutex ccImageCacheMutex;
+
+// Reports image memory to V8 as well as our own stats, so the GC knows how
+// much memory image objects are holding on to.
+void AccountImage(Napi::Env env, int64_t bytes) {
+    TrackImageMemory(bytes);
+    Napi::MemoryManagement::AdjustExternalMemory(env, bytes);
+}
+
+// Images shared with other threads by share(), with the number of image
+// objects and unopened handles referring to each. A shared image is only freed
+// once all of them are released. Handles are kept by ID until opened.
+struct SharedHandle {
+    void * img;
+    bool indexed;
+};
+std::unordered_map<const void*, unsigned> sharedImages;
+std::unordered_map<uint32_t, SharedHandle> sharedHandles;
+uint32_t nextSharedHandle = 1;
+std::mutex sharedImagesMutex;
+
+bool IsShared(const void * img) {
+    std::lock_guard<std::mutex> lock(sharedImagesMutex);
+    return sharedImages.count(img) > 0;
+}
+
+// Drops a reference to an image, returning whether it was the last one.
+bool ReleaseShared(const void * img) {
+    std::lock_guard<std::mutex> lock(sharedImagesMutex);
+    auto it = sharedImages.find(img);
+    if (it == sharedImages.end()) return true;
+    if (--it->second > 0) return false;
+    sharedImages.erase(it);
+    return true;
+}
+
+void FreeMat1b(Mat1b * obj) {
+    {
+        std::lock_guard<std::mutex> lock(ccImageCacheMutex);
+        ccImageCache.erase(obj);
+    }
+    imagePool.Release(obj);
+}
+
+// Frees the pixels of a disposed image. The object itself stays allocated
+// (as a 1x1 image) until its JS object is collected, so the External never
+// points to freed memory.
+template<typename Image>
+void FreeImage(Napi::Env env, Image * img) {
+    const int64_t before = ImageBytes(*img);
+    *img = Image(1, 1, device);
+    AccountImage(env, ImageBytes(*img) - before);
+}
+
+// Images used by pending async work or by buffers sharing their pixels, which
+// dispose() has to leave alone until they're released. Only changed on JS
+// threads, but there's one per worker thread.
+std::unordered_map<const void*, unsigned> imageUses;
+std::unordered_map<const void*, std::function<void(Napi::Env)>> pendingDisposals;
+std::mutex imageUsesMutex;
+
+// Number of live pixel buffers sharing memory with each image. The contents of
+// these images can change behind our back, so their CC planes aren't cached.
+std::unordered_map<const void*, unsigned> pixelViews;
+
+bool HasPixelViews(const void * img) {
+    std::lock_guard<std::mutex> lock(imageUsesMutex);
+    return pixelViews.count(img) > 0;
+}
+
+void UseImage(const void * img) {
+    std::lock_guard<std::mutex> lock(imageUsesMutex);
+    imageUses[img]++;
+}
+
+void ReleaseImage(Napi::Env env, const void * img) {
+    std::function<void(Napi::Env)> dispose;
+    {
+        std::lock_guard<std::mutex> lock(imageUsesMutex);
+        auto it = imageUses.find(img);
+        if (it == imageUses.end() || --it->second > 0) return;
+        imageUses.erase(it);
+        auto d = pendingDisposals.find(img);
+        if (d == pendingDisposals.end()) return;
+        dispose = d->second;
+        pendingDisposals.erase(d);
+    }
+    dispose(env);
+}
+
+// Leaves an image to be freed by ReleaseImage if something is still using it.
+bool DeferFree(const void * img, std::function<void(Napi::Env)> release) {
+    std::lock_guard<std::mutex> lock(imageUsesMutex);
+    if (!imageUses.count(img)) return false;
+    pendingDisposals[img] = release;
+    return true;
+}
+
+// Every image object reports the image's size to its own isolate, but the
+// module's stats only count the memory once, when it's freed. Pixel buffers
+// can outlive the object, in which case the last of them frees the image.
+void FinalizeMat(Napi::Env env, Mat * obj) {
+    const int64_t bytes = ImageBytes(*obj);
+    Napi::MemoryManagement::AdjustExternalMemory(env, -bytes);
+    if (!ReleaseShared(obj)) return;
+    auto release = [obj](Napi::Env) {
+        TrackImageMemory(-ImageBytes(*obj));
+        imagePool.Release(obj);
+    };
+    if (!DeferFree(obj, release)) release(env);
+}
+void FinalizeMat1b(Napi::Env env, Mat1b * obj) {
+    const int64_t bytes = ImageBytes(*obj);
+    Napi::MemoryManagement::AdjustExternalMemory(env, -bytes);
+    if (!ReleaseShared(obj)) return;
+    auto release = [obj](Napi::Env) {
+        TrackImageMemory(-ImageBytes(*obj));
+        FreeMat1b(obj);
+    };
+    if (!DeferFree(obj, release)) release(env);
+}
+
+// Gets the image held by an object, if it's an image.
+const void * GetImagePointer(Napi::Value value) {
+    if (!value.IsObject()) return NULL;
+    Napi::Object obj = value.As<Napi::Object>();
+    Napi::Value v = obj.Get("_obj");
+    if (v.IsExternal()) return v.As<Napi::External<Mat>>().Data();
+    v = obj.Get("_obji");
+    if (v.IsExternal()) return v.As<Napi::External<Mat1b>>().Data();
+    return NULL;
+}
+
+bool SamePalette(const std::vector<Vec3b>& a, const std::vector<Vec3b>& b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++)
+        if (a[i][0] != b[i][0] || a[i][1] != b[i][1] || a[i][2] != b[i][2]) return false;
+    return true;
+}
+
+// Makes the CC planes with sanjuuni's makeCCImage. Its choice of colors for
+// each cell decides the output bytes of every encoder, so it isn't replaced
+// with a kernel specialized on palette size like the nearest-color search.
+std::shared_ptr<CCImage> MakeCCImage(Mat1b& img, const std::vector<Vec3b>& palette) {
+    std::shared_ptr<CCImage> cc = std::make_shared<CCImage>();
+    cc->palette = palette;
+    cc->width = img.width / 2;
+    cc->height = img.height / 3;
+    StageTimer timer(STAGE_CCIMAGE, (uint64_t)img.width * img.height);
+    makeCCImage(img, palette, &cc->chars, &cc->cols, device);
+    return cc;
+}
+
+// Gets the CC planes for an indexed image owned by a JS object, reusing the
+// previous result if it was made with the same palette. Images whose pixels
+// are exposed through a buffer may have been written to, so they're never
+// cached.
+std::shared_ptr<const CCImage> GetCCImage(Mat1b& img, const std::vector<Vec3b>& palette) {
+    if (HasPixelViews(&img)) return MakeCCImage(img, palette);
+    {
+        std::lock_guard<std::mutex> lock(ccImageCacheMutex);
+        auto it = ccImageCache.find(&img);
+        if (it != ccImageCache.end() && SamePalette(it->second->palette, palette)) return it->second;
+    }
+    std::shared_ptr<const CCImage> cc = MakeCCImage(img, palette);
+    std::lock_guard<std::mutex> lock(ccImageCacheMutex);
+    ccImageCache[&img] = cc;
+    return cc;
+}
+
+// Lookup tables for recently used palettes, most recent first.
+std::vector<std::shared_ptr<const PaletteLUT>> paletteLUTCache;
+std::mutex paletteLUTCacheMutex;
+
+std::shared_ptr<const PaletteLUT> GetPaletteLUT(const std::vector<Vec3b>& palette) {
+    {
+        std::lock_guard<std::mutex> lock(paletteLUTCacheMutex);
+        for (auto it = paletteLUTCache.begin(); it != paletteLUTCache.end(); ++it) {
+            if (SamePalette((*it)->palette, palette)) {
+                std::shared_ptr<const PaletteLUT> lut = *it;
+                paletteLUTCache.erase(it);
+                paletteLUTCache.insert(paletteLUTCache.begin(), lut);
+                return lut;
+            }
+        }
+    }
+    std::shared_ptr<const PaletteLUT> lut = std::make_shared<PaletteLUT>(palette);
+    std::lock_guard<std::mutex> lock(paletteLUTCacheMutex);
+    paletteLUTCache.insert(paletteLUTCache.begin(), lut);
+    if (paletteLUTCache.size() > 8) paletteLUTCache.pop_back();
+    return lut;
+}
+
+// Calls fn with the nearest-color search to use for a palette. Palettes of up
+// to 16 colors (ComputerCraft's limit) are searched directly, which is as fast
+// as the lookup table and doesn't have to build one for every new palette.
+template<typename Fn>
+auto WithPaletteSearch(const std::vector<Vec3b>& palette, Fn fn) -> decltype(fn(std::declval<const PaletteLUT&>())) {
+    if (palette.empty() || palette.size() > 16) return fn(*GetPaletteLUT(palette));
+    if (palette.size() <= 8) return fn(SmallPalette<8>(palette));
+    return fn(SmallPalette<16>(palette));
+}
+
+Mat1b * MapToPalette(Mat& img, const std::vector<Vec3b>& palette) {
+    Mat1b * retval = imagePool.NewMat1b(img.width, img.height);
+    WithPaletteSearch(palette, [&img, retval](const auto& search) {MapToPalette(img, search, *retval);});
+    return retval;
+}
+
+// Options for Floyd-Steinberg dithering. sanjuuni's ditherImage is the default;
+// the integer wavefront engine rounds errors differently, so it only runs when
+// asked for, and serpentine scanning (which sanjuuni doesn't have) implies it.
+struct DitherOptions {
+    bool wavefront = false;
+    bool serpentine = false;
+    bool UseEngine() const {return wavefront || serpentine;}
+};
+
+DitherOptions GetDitherOptions(Napi::Value value) {
+    DitherOptions opts;
+    if (!value.IsObject()) return opts;
+    opts.wavefront = value.As<Napi::Object>().Get("wavefront").ToBoolean();
+    opts.serpentine = value.As<Napi::Object>().Get("serpentine").ToBoolean();
+    return opts;
+}
+
+// Reads the threads option from an options object, if there is one.
+bool GetThreadsOption(Napi::Env env, Napi::Value options, unsigned * threads) {
+    if (!options.IsObject()) return true;
+    Napi::Value v = options.As<Napi::Object>().Get("threads");
+    if (v.IsUndefined()) return true;
+    if (!v.IsNumber() || v.As<Napi::Number>().Int32Value() < 0) {
+        Napi::TypeError::New(env, "Invalid option for threads").ThrowAsJavaScriptException();
+        return false;
+    }
+    *threads = v.As<Napi::Number>().Uint32Value();
+    return true;
+}
+
+Mat1b * DitherFloydSteinberg(Mat& img, const std::vector<Vec3b>& palette, const DitherOptions& opts) {
+    if (!opts.UseEngine()) {
+        PooledMat res(new Mat(ditherImage(img, palette, device)));
+        return MapToPalette(*res, palette);
+    }
+    Mat1b * retval = imagePool.NewMat1b(img.width, img.height);
+    const bool serpentine = opts.serpentine;
+    WithPaletteSearch(palette, [&img, serpentine, retval](const auto& search) {DitherFloydSteinberg(img, search, serpentine, *retval);});
+    return retval;
+}
+
+// Dithers an image and converts it to palette indices. Threshold dithering
+// only needs the nearest color, so it maps straight to indices in one pass;
+// ordered dithering outputs exact palette colors, so the nearest-color search
+// replaces the one in rgbToPaletteImage. Floyd-Steinberg dithering is mapped
+// the same way, or runs on the wavefront engine if asked to. The OpenCL path
+// is left to sanjuuni.
+Mat1b * DitherToIndexed(Mat& img, const std::vector<Vec3b>& palette, Ditherer ditherer, const DitherOptions& dither = DitherOptions()) {
+    const uint64_t pixels = (uint64_t)img.width * img.height;
+    if (device == NULL && ditherer == thresholdImage) {
+        StageTimer timer(STAGE_DITHER, pixels);
+        return MapToPalette(img, palette);
+    }
+    if (device == NULL && ditherer == ditherImage) {
+        StageTimer timer(STAGE_DITHER, pixels);
+        return DitherFloydSteinberg(img, palette, dither);
+    }
+    PooledMat res;
+    {
+        StageTimer timer(STAGE_DITHER, pixels);
+        res.reset(new Mat(ditherer(img, palette, device)));
+    }
+    ImageMemory mem(*res);
+    StageTimer timer(STAGE_INDEX, pixels);
+    if (device == NULL && ditherer == ditherImage_ordered) return MapToPalette(*res, palette);
+    return new Mat1b(rgbToPaletteImage(*res, palette, device));
+}
 
 Mat * GetRGBImage(Napi::Env env, Napi::Value value) {
     if (!value.IsObject()) Napi::TypeError::New(env, "RGBImage expected").ThrowAsJavaScriptException();
     Napi::Object obj = value.As<Napi::Object>();
     if (!obj.Get("_obj").IsExternal()) Napi::TypeError::New(env, "RGBImage expected").ThrowAsJavaScriptException();
+    if (obj.Get("disposed").ToBoolean()) Napi::Error::New(env, "Image has been disposed").ThrowAsJavaScriptException();
     return obj.Get("_obj").As<Napi::External<Mat>>().Data();
 }
 
@@ -21,7 +657,7 @@ Napi::Object RGBImageAt(const Napi::CallbackInfo& info) {
     Mat * img = GetRGBImage(env, info.This());
     img->download();
     try {
-        const uchar3& color = img->at(info[0].As<Napi::Number>().Uint32Value(), info[0].As<Napi::Number>().Uint32Value());
+        const uchar3& color = img->at(info[0].As<Napi::Number>().Uint32Value(), info[1].As<Napi::Number>().Uint32Value());
         Napi::Object retval = Napi::Object::New(env);
         retval.Set("b", Napi::Number::New(env, color.x));
         retval.Set("g", Napi::Number::New(env, color.y));
@@ -32,19 +668,194 @@ Napi::Object RGBImageAt(const Napi::CallbackInfo& info) {
     }
 }
 
-Napi::Object NewRGBImage(Napi::Env env, Mat * img) {
+// Only touches native state, as finalizers can't call into JS.
+void FinalizeView(Napi::Env env, uint8_t * data, void * img) {
+    {
+        std::lock_guard<std::mutex> lock(imageUsesMutex);
+        auto it = pixelViews.find(img);
+        if (it != pixelViews.end() && --it->second == 0) pixelViews.erase(it);
+    }
+    ReleaseImage(env, img);
+}
+
+// Makes a Buffer sharing memory with an image's pixels. The buffer counts as a
+// use of the image, so neither dispose() nor collecting the image object frees
+// the pixels until the buffer is collected too. If the runtime doesn't allow
+// external buffers the pixels are copied instead. Returns undefined if the
+// pixels aren't tightly packed, in which case the caller has to copy them.
+template<typename Image>
+Napi::Value NewPixelView(Napi::Env env, Image * img, size_t pixelSize) {
+    if (sizeof((*img)[0][0]) != pixelSize) return env.Undefined();
+    if (img->width == 0 || img->height == 0) return Napi::Buffer<uint8_t>::New(env, 0);
+    img->download();
+    uint8_t * data = (uint8_t*)&(*img)[0][0];
+    size_t size = (size_t)img->width * img->height * pixelSize;
+    // released by FinalizeView, which runs straight away if the pixels are copied
+    UseImage(img);
+    {
+        std::lock_guard<std::mutex> lock(imageUsesMutex);
+        pixelViews[img]++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(ccImageCacheMutex);
+        ccImageCache.erase((const Mat1b*)img);
+    }
+    return Napi::Buffer<uint8_t>::NewOrCopy(env, data, size, FinalizeView, (void*)img);
+}
+
+// Reads and checks the x, y, width and height arguments of getRegion.
+bool GetRegionArgs(const Napi::CallbackInfo& info, unsigned imgWidth, unsigned imgHeight, unsigned * x, unsigned * y, unsigned * width, unsigned * height) {
+    Napi::Env env = info.Env();
+    if (info.Length() < 4 || !info[0].IsNumber() || !info[1].IsNumber() || !info[2].IsNumber() || !info[3].IsNumber()) {
+        Napi::TypeError::New(env, "Number expected").ThrowAsJavaScriptException();
+        return false;
+    }
+    *x = info[0].As<Napi::Number>().Uint32Value();
+    *y = info[1].As<Napi::Number>().Uint32Value();
+    *width = info[2].As<Napi::Number>().Uint32Value();
+    *height = info[3].As<Napi::Number>().Uint32Value();
+    if ((uint64_t)*x + *width > imgWidth || (uint64_t)*y + *height > imgHeight) {
+        Napi::RangeError::New(env, "Region is outside the image").ThrowAsJavaScriptException();
+        return false;
+    }
+    return true;
+}
+
+// Copies part of an image into packed pixels in the specified byte order. Alpha
+// channels are filled with 255.
+void WritePixels(Mat& img, unsigned x, unsigned y, unsigned width, unsigned height, PixelFormat format, uint8_t * out) {
+    const uint8_t * o = pixelOffsets[format];
+    unsigned size = PixelSize(format), alpha = 6 - o[0] - o[1] - o[2];
+    ParallelRows(width, height, [&img, x, y, width, size, alpha, o, out](unsigned start, unsigned end) {
+        for (unsigned row = start; row < end; row++) {
+            Mat::row src = img[y + row];
+            uint8_t * p = out + (size_t)row * width * size;
+            for (unsigned col = 0; col < width; col++, p += size) {
+                const uchar3& c = src[x + col];
+                p[o[0]] = c.x;
+                p[o[1]] = c.y;
+                p[o[2]] = c.z;
+                if (size == 4) p[alpha] = 255;
+            }
+        }
+    });
+}
+
+Napi::Value RGBImageToBuffer(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Mat * img = GetRGBImage(env, info.This());
+    if (env.IsExceptionPending()) return env.Null();
+    Napi::Value retval = NewPixelView(env, img, 3);
+    if (!retval.IsUndefined()) return retval;
+    Napi::Buffer<uint8_t> buf = Napi::Buffer<uint8_t>::New(env, (size_t)img->width * img->height * 3);
+    WritePixels(*img, 0, 0, img->width, img->height, PIXEL_BGR, buf.Data());
+    return buf;
+}
+
+Napi::Value RGBImageGetRegion(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Mat * img = GetRGBImage(env, info.This());
+    if (env.IsExceptionPending()) return env.Null();
+    unsigned x, y, width, height;
+    if (!GetRegionArgs(info, img->width, img->height, &x, &y, &width, &height)) return env.Null();
+    PixelFormat format = PIXEL_BGR;
+    if (info.Length() >= 5 && !info[4].IsUndefined() && !GetPixelFormat(info[4].ToString().Utf8Value(), &format)) {
+        Napi::TypeError::New(env, "Invalid format specification").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    img->download();
+    Napi::Buffer<uint8_t> buf = Napi::Buffer<uint8_t>::New(env, (size_t)width * height * PixelSize(format));
+    WritePixels(*img, x, y, width, height, format, buf.Data());
+    return buf;
+}
+
+// Frees an image's pixels now, or once pending work and pixel buffers using
+// it are done. Later use of the image throws.
+template<typename Image>
+Napi::Value DisposeImage(const Napi::CallbackInfo& info, Image * img) {
+    Napi::Env env = info.Env();
+    Napi::Object obj = info.This().As<Napi::Object>();
+    if (env.IsExceptionPending()) return env.Null();
+    obj.Set("disposed", Napi::Boolean::New(env, true));
+    // other threads may be using a shared image, so it's left for the finalizers
+    if (IsShared(img)) return env.Undefined();
+    std::unique_lock<std::mutex> lock(imageUsesMutex);
+    if (imageUses.count(img)) {
+        pendingDisposals[img] = [img](Napi::Env env) {FreeImage(env, img);};
+        return env.Undefined();
+    }
+    lock.unlock();
+    FreeImage(env, img);
+    return env.Undefined();
+}
+
+Napi::Value RGBImageDispose(const Napi::CallbackInfo& info) {
+    if (info.This().As<Napi::Object>().Get("disposed").ToBoolean()) return info.Env().Undefined();
+    return DisposeImage(info, GetRGBImage(info.Env(), info.This()));
+}
+
+// Makes a handle that another thread can open to use an image without copying
+// it. The handle holds a reference to the image until it's opened.
+Napi::Value ShareImage(Napi::Env env, void * img, bool indexed, unsigned width, unsigned height) {
+    uint32_t id;
+    {
+        std::lock_guard<std::mutex> lock(sharedImagesMutex);
+        auto it = sharedImages.find(img);
+        if (it == sharedImages.end()) sharedImages[img] = 2;
+        else it->second++;
+        id = nextSharedHandle++;
+        sharedHandles[id] = {img, indexed};
+    }
+    Napi::Object retval = Napi::Object::New(env);
+    retval.Set("type", Napi::String::New(env, indexed ? "indexed" : "rgb"));
+    retval.Set("width", Napi::Number::New(env, width));
+    retval.Set("height", Napi::Number::New(env, height));
+    retval.Set("id", Napi::Number::New(env, id));
+    return retval;
+}
+
+Napi::Value RGBImageShare(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Mat * img = GetRGBImage(env, info.This());
+    if (env.IsExceptionPending()) return env.Null();
+    return ShareImage(env, img, false, img->width, img->height);
+}
+
+// Adds dispose(), also as Symbol.dispose where the runtime has it.
+void SetDispose(Napi::Env env, Napi::Object obj, Napi::Function dispose) {
+    obj.Set("disposed", Napi::Boolean::New(env, false));
+    obj.Set("dispose", dispose);
+    Napi::Value symbol = env.Global().Get("Symbol").As<Napi::Object>().Get("dispose");
+    if (symbol.IsSymbol()) obj.Set(symbol, dispose);
+}
+
+// Makes an object for an image. Only the isolate is told about its memory, as
+// the image may be shared and already counted.
+Napi::Object WrapRGBImage(Napi::Env env, Mat * img) {
+    Napi::MemoryManagement::AdjustExternalMemory(env, ImageBytes(*img));
     Napi::Object retval = Napi::Object::New(env);
     retval.Set("_obj", Napi::External<Mat>::New(env, img, FinalizeMat));
     retval.Set("width", Napi::Number::New(env, img->width));
     retval.Set("height", Napi::Number::New(env, img->height));
     retval.Set("at", Napi::Function::New(env, RGBImageAt));
+    retval.Set("toBuffer", Napi::Function::New(env, RGBImageToBuffer));
+    retval.Set("getRegion", Napi::Function::New(env, RGBImageGetRegion));
+    retval.Set("share", Napi::Function::New(env, RGBImageShare));
+    retval.DefineProperty(Napi::PropertyDescriptor::Accessor(env, retval, "data", RGBImageToBuffer, napi_enumerable));
+    SetDispose(env, retval, Napi::Function::New(env, RGBImageDispose));
     return retval;
 }
 
+Napi::Object NewRGBImage(Napi::Env env, Mat * img) {
+    TrackImageMemory(ImageBytes(*img));
+    return WrapRGBImage(env, img);
+}
+
 Mat1b * GetIndexedImage(Napi::Env env, Napi::Value value) {
     if (!value.IsObject()) Napi::TypeError::New(env, "IndexedImage expected").ThrowAsJavaScriptException();
     Napi::Object obj = value.As<Napi::Object>();
     if (!obj.Get("_obji").IsExternal()) Napi::TypeError::New(env, "IndexedImage expected").ThrowAsJavaScriptException();
+    if (obj.Get("disposed").ToBoolean()) Napi::Error::New(env, "Image has been disposed").ThrowAsJavaScriptException();
     return obj.Get("_obji").As<Napi::External<Mat1b>>().Data();
 }
 
@@ -55,26 +866,156 @@ Napi::Number IndexedImageAt(const Napi::CallbackInfo& info) {
     Mat1b * img = GetIndexedImage(env, info.This());
     img->download();
     try {
-        uchar color = img->at(info[0].As<Napi::Number>().Uint32Value(), info[0].As<Napi::Number>().Uint32Value());
+        uchar color = img->at(info[0].As<Napi::Number>().Uint32Value(), info[1].As<Napi::Number>().Uint32Value());
         return Napi::Number::New(env, color);
     } catch (const std::out_of_range &e) {
         Napi::RangeError::New(env, e.what()).ThrowAsJavaScriptException();
     }
 }
 
-Napi::Object NewIndexedImage(Napi::Env env, Mat1b * img) {
+void CopyIndexedRegion(Mat1b& img, unsigned x, unsigned y, unsigned width, unsigned height, uint8_t * out) {
+    for (unsigned row = 0; row < height; row++) {
+        Mat1b::row src = img[y + row];
+        for (unsigned col = 0; col < width; col++) out[(size_t)row * width + col] = src[x + col];
+    }
+}
+
+Napi::Value IndexedImageToBuffer(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Mat1b * img = GetIndexedImage(env, info.This());
+    if (env.IsExceptionPending()) return env.Null();
+    Napi::Value retval = NewPixelView(env, img, 1);
+    if (!retval.IsUndefined()) return retval;
+    Napi::Buffer<uint8_t> buf = Napi::Buffer<uint8_t>::New(env, (size_t)img->width * img->height);
+    CopyIndexedRegion(*img, 0, 0, img->width, img->height, buf.Data());
+    return buf;
+}
+
+Napi::Value IndexedImageGetRegion(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Mat1b * img = GetIndexedImage(env, info.This());
+    if (env.IsExceptionPending()) return env.Null();
+    unsigned x, y, width, height;
+    if (!GetRegionArgs(info, img->width, img->height, &x, &y, &width, &height)) return env.Null();
+    img->download();
+    Napi::Buffer<uint8_t> buf = Napi::Buffer<uint8_t>::New(env, (size_t)width * height);
+    CopyIndexedRegion(*img, x, y, width, height, buf.Data());
+    return buf;
+}
+
+Napi::Value IndexedImageDispose(const Napi::CallbackInfo& info) {
+    if (info.This().As<Napi::Object>().Get("disposed").ToBoolean()) return info.Env().Undefined();
+    Mat1b * img = GetIndexedImage(info.Env(), info.This());
+    {
+        std::lock_guard<std::mutex> lock(ccImageCacheMutex);
+        ccImageCache.erase(img);
+    }
+    return DisposeImage(info, img);
+}
+
+Napi::Value IndexedImageShare(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Mat1b * img = GetIndexedImage(env, info.This());
+    if (env.IsExceptionPending()) return env.Null();
+    return ShareImage(env, img, true, img->width, img->height);
+}
+
+Napi::Object WrapIndexedImage(Napi::Env env, Mat1b * img) {
+    Napi::MemoryManagement::AdjustExternalMemory(env, ImageBytes(*img));
     Napi::Object retval = Napi::Object::New(env);
     retval.Set("_obji", Napi::External<Mat1b>::New(env, img, FinalizeMat1b));
     retval.Set("width", Napi::Number::New(env, img->width));
     retval.Set("height", Napi::Number::New(env, img->height));
     retval.Set("at", Napi::Function::New(env, IndexedImageAt));
+    retval.Set("toBuffer", Napi::Function::New(env, IndexedImageToBuffer));
+    retval.Set("getRegion", Napi::Function::New(env, IndexedImageGetRegion));
+    retval.Set("share", Napi::Function::New(env, IndexedImageShare));
+    retval.DefineProperty(Napi::PropertyDescriptor::Accessor(env, retval, "data", IndexedImageToBuffer, napi_enumerable));
+    SetDispose(env, retval, Napi::Function::New(env, IndexedImageDispose));
     return retval;
 }
 
+Napi::Object NewIndexedImage(Napi::Env env, Mat1b * img) {
+    TrackImageMemory(ImageBytes(*img));
+    return WrapIndexedImage(env, img);
+}
+
+// Takes the image out of a handle made by share(), returning false if the
+// handle isn't valid or has already been used.
+bool TakeSharedHandle(Napi::Env env, Napi::Value value, SharedHandle * handle) {
+    Napi::Value id = value.IsObject() ? value.As<Napi::Object>().Get("id") : env.Undefined();
+    if (!id.IsNumber()) {
+        Napi::TypeError::New(env, "Shared image handle expected").ThrowAsJavaScriptException();
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(sharedImagesMutex);
+    auto it = sharedHandles.find(id.As<Napi::Number>().Uint32Value());
+    if (it == sharedHandles.end()) {
+        Napi::Error::New(env, "Shared image handle has already been used").ThrowAsJavaScriptException();
+        return false;
+    }
+    *handle = it->second;
+    sharedHandles.erase(it);
+    return true;
+}
+
+Napi::Value M_openSharedImage(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    SharedHandle handle;
+    if (!TakeSharedHandle(env, info.Length() > 0 ? info[0] : env.Undefined(), &handle)) return env.Null();
+    // the handle's reference now belongs to the new object
+    if (handle.indexed) return WrapIndexedImage(env, (Mat1b*)handle.img);
+    return WrapRGBImage(env, (Mat*)handle.img);
+}
+
+Napi::Value M_releaseSharedImage(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    SharedHandle handle;
+    if (!TakeSharedHandle(env, info.Length() > 0 ? info[0] : env.Undefined(), &handle)) return env.Null();
+    if (!ReleaseShared(handle.img)) return env.Undefined();
+    if (handle.indexed) {
+        TrackImageMemory(-ImageBytes(*(Mat1b*)handle.img));
+        FreeMat1b((Mat1b*)handle.img);
+    } else {
+        TrackImageMemory(-ImageBytes(*(Mat*)handle.img));
+        imagePool.Release((Mat*)handle.img);
+    }
+    return env.Undefined();
+}
+
+// Palettes can also be packed as R, G, B bytes in a Uint8Array, which may be
+// backed by a SharedArrayBuffer to pass it between threads without copying.
+bool IsPackedPalette(Napi::Value value) {
+    return value.IsTypedArray() && value.As<Napi::TypedArray>().TypedArrayType() == napi_uint8_array;
+}
+
 std::vector<Vec3b> GetPalette(Napi::Env env, Napi::Value value) {
+    if (IsPackedPalette(value)) {
+        Napi::Uint8Array array = value.As<Napi::Uint8Array>();
+        std::vector<Vec3b> retval;
+        if (array.ElementLength() == 0 || array.ElementLength() % 3 != 0 || array.ElementLength() > 256 * 3) {
+            Napi::RangeError::New(env, "Packed palette must have 1 to 256 RGB colors").ThrowAsJavaScriptException();
+            return retval;
+        }
+        const uint8_t * data = array.Data();
+        for (size_t i = 0; i < array.ElementLength(); i += 3) {
+            Vec3b val;
+            val[0] = data[i+2];
+            val[1] = data[i+1];
+            val[2] = data[i];
+            retval.push_back(val);
+        }
+        return retval;
+    }
     if (!value.IsArray()) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
     Napi::Array array = value.As<Napi::Array>();
     std::vector<Vec3b> retval;
+    // every nearest-color search needs at least one entry to return, and
+    // indexed images only hold 256 indices
+    if (!env.IsExceptionPending() && (array.Length() == 0 || array.Length() > 256)) {
+        Napi::RangeError::New(env, "Palette must have 1 to 256 colors").ThrowAsJavaScriptException();
+        return retval;
+    }
     for (int i = 0; i < array.Length(); i++) {
         Vec3b val;
         Napi::Value v = array.Get(i);
@@ -94,6 +1035,30 @@ std::vector<Vec3b> GetPalette(Napi::Env env, Napi::Value value) {
     return retval;
 }
 
+// Packs a palette into a Uint8Array, using a SharedArrayBuffer if asked to.
+Napi::Value NewPackedPalette(Napi::Env env, const std::vector<Vec3b>& palette, bool shared = false) {
+    const size_t size = palette.size() * 3;
+    Napi::Object array;
+    if (shared) {
+        Napi::Value sab = env.Global().Get("SharedArrayBuffer").As<Napi::Function>().New({Napi::Number::New(env, size)});
+        array = env.Global().Get("Uint8Array").As<Napi::Function>().New({sab});
+    } else array = Napi::Uint8Array::New(env, size);
+    uint8_t * data = array.As<Napi::Uint8Array>().Data();
+    for (size_t i = 0; i < palette.size(); i++) {
+        data[i*3] = palette[i][2];
+        data[i*3+1] = palette[i][1];
+        data[i*3+2] = palette[i][0];
+    }
+    return array;
+}
+
+Napi::Value M_packPalette(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    std::vector<Vec3b> palette = GetPalette(env, info.Length() > 0 ? info[0] : env.Undefined());
+    if (env.IsExceptionPending()) return env.Null();
+    return NewPackedPalette(env, palette, info.Length() > 1 && info[1].ToBoolean());
+}
+
 Napi::Array NewPalette(Napi::Env env, const std::vector<Vec3b>& palette) {
     Napi::Array retval = Napi::Array::New(env);
     for (int i = 0; i < palette.size(); i++) {
@@ -106,35 +1071,608 @@ Napi::Array NewPalette(Napi::Env env, const std::vector<Vec3b>& palette) {
     return retval;
 }
 
-Napi::Boolean M_initOpenCL(const Napi::CallbackInfo& info) {
-    Napi::Env env = info.Env();
-#ifdef USE_OPENCL
-    if (device != NULL) return Napi::Boolean::New(env, true);
-    try {
-        OpenCL::Device_Info info;
-        std::vector<OpenCL::Device_Info> devices = OpenCL::get_devices(false);
-        if (info.Length() > 0) {
-            if (info[0].IsNumber()) {
-                info = OpenCL::select_device_with_id(info[0].As<Napi::Number>().Uint32Value());
-            } else if (info[0].IsString()) {
-                std::string str = info[0].As<Napi::String>().Utf8Value();
-                if (str == "best_flops") {
-                    info = OpenCL::select_device_with_most_flops(devices, false);
-                } else if (str == "best_memory") {
-                    info = OpenCL::select_device_with_most_memory(devices, false);
-                } else {
-                    Napi::TypeError::New(env, "Invalid option for device").ThrowAsJavaScriptException();
-                }
-            } else {
-                Napi::TypeError::New(env, "Number or string expected").ThrowAsJavaScriptException();
-            }
-        } else {
-            info = OpenCL::select_device_with_most_flops(devices, false);
+Napi::Value NewPaletteValue(Napi::Env env, const std::vector<Vec3b>& palette, bool packed) {
+    if (packed) return NewPackedPalette(env, palette);
+    return NewPalette(env, palette);
+}
+
+// Runs a sanjuuni operation on the libuv thread pool and settles a Promise with
+// its result. Any JS objects the operation reads from must be pinned so their
+// native data isn't collected while the worker is running.
+template<typename T>
+class SanjuuniWorker : public Napi::AsyncWorker {
+public:
+    SanjuuniWorker(Napi::Env env, std::function<T()> run, std::function<Napi::Value(Napi::Env, T&)> finish):
+        Napi::AsyncWorker(env, "sanjuuni"), deferred(Napi::Promise::Deferred::New(env)), run(run), finish(finish) {}
+    ~SanjuuniWorker() {
+        for (const void * img : images) ReleaseImage(Env(), img);
+    }
+    // Keeps an argument alive until the work is done, and stops images from
+    // being freed by dispose() in the meantime.
+    void Pin(Napi::Value value) {
+        if (!value.IsObject()) return;
+        pins.push_back(Napi::Persistent(value.As<Napi::Object>()));
+        const void * img = GetImagePointer(value);
+        if (img != NULL) {
+            UseImage(img);
+            images.push_back(img);
         }
-        device = new OpenCL::Device(info);
-    } catch (const OpenCL::OpenCLException& e) {
-        fprintf(stderr, "Failed to initialize OpenCL: %s\n", e.what());
-        return Napi::Boolean::New(env, false);
+    }
+    Napi::Promise Promise() {return deferred.Promise();}
+protected:
+    void Execute() override {
+        try {
+            result = run();
+        } catch (const std::exception &e) {
+            SetError(e.what());
+        }
+    }
+    void OnOK() override {
+        Napi::Value value = finish(Env(), result);
+        if (Env().IsExceptionPending()) deferred.Reject(Env().GetAndClearPendingException().Value());
+        else deferred.Resolve(value);
+    }
+    void OnError(const Napi::Error& e) override {deferred.Reject(e.Value());}
+private:
+    Napi::Promise::Deferred deferred;
+    std::function<T()> run;
+    std::function<Napi::Value(Napi::Env, T&)> finish;
+    std::vector<Napi::ObjectReference> pins;
+    std::vector<const void*> images;
+    T result;
+};
+
+template<typename T>
+Napi::Value QueueWorker(Napi::Env env, const std::vector<Napi::Value>& pins, std::function<T()> run, std::function<Napi::Value(Napi::Env, T&)> finish) {
+    if (env.IsExceptionPending()) return env.Undefined();
+    SanjuuniWorker<T> * worker = new SanjuuniWorker<T>(env, run, finish);
+    for (const Napi::Value& v : pins) worker->Pin(v);
+    worker->Queue();
+    return worker->Promise();
+}
+
+Napi::Value NewString(Napi::Env env, const std::string& str) {return Napi::String::New(env, str);}
+// Hands the memory of an encoded string over to a new Buffer instead of
+// copying it, leaving the string empty. Runtimes that don't allow external
+// buffers get a copy.
+void FinalizeString(Napi::Env env, uint8_t * data, std::string * str) {delete str;}
+
+Napi::Buffer<uint8_t> NewBuffer(Napi::Env env, std::string& str) {
+    if (str.empty()) return Napi::Buffer<uint8_t>::New(env, 0);
+    std::string * data = new std::string(std::move(str));
+    return Napi::Buffer<uint8_t>::NewOrCopy(env, (uint8_t*)&(*data)[0], data->size(), FinalizeString, data);
+}
+
+// Raw pixel data passed in from JS, already checked to fit the dimensions.
+struct PixelSource {
+    const uint8_t * data;
+    unsigned width, height;
+    size_t stride;
+    PixelFormat format;
+};
+
+bool IsPixelData(Napi::Value value) {
+    if (value.IsArrayBuffer()) return true;
+    if (!value.IsTypedArray()) return false;
+    napi_typedarray_type type = value.As<Napi::TypedArray>().TypedArrayType();
+    return type == napi_uint8_array || type == napi_uint32_array;
+}
+
+// Reads a pixel buffer (ArrayBuffer, Buffer, Uint8Array or Uint32Array) along
+// with the width, height and format arguments in info[1] to info[3]. The stride is the
+// number of bytes per row, and defaults to tightly packed rows.
+bool GetPixelSource(const Napi::CallbackInfo& info, Napi::Value data, Napi::Value stride, PixelSource * src) {
+    Napi::Env env = info.Env();
+    size_t length;
+    bool words = false;
+    if (data.IsArrayBuffer()) {
+        Napi::ArrayBuffer array = data.As<Napi::ArrayBuffer>();
+        src->data = (const uint8_t*)array.Data();
+        length = array.ByteLength();
+    } else if (IsPixelData(data)) {
+        Napi::TypedArray array = data.As<Napi::TypedArray>();
+        src->data = (const uint8_t*)array.ArrayBuffer().Data() + array.ByteOffset();
+        length = array.ByteLength();
+        words = array.TypedArrayType() == napi_uint32_array;
+    } else {
+        Napi::TypeError::New(env, "Buffer expected").ThrowAsJavaScriptException();
+        return false;
+    }
+    switch (info.Length()) {
+        case 1: case 2: Napi::TypeError::New(env, "Number expected").ThrowAsJavaScriptException(); return false;
+        case 3: Napi::TypeError::New(env, "String expected").ThrowAsJavaScriptException(); return false;
+    }
+    if (!info[1].IsNumber() || !info[2].IsNumber()) {
+        Napi::TypeError::New(env, "Number expected").ThrowAsJavaScriptException();
+        return false;
+    }
+    if (!info[3].IsString()) {
+        Napi::TypeError::New(env, "String expected").ThrowAsJavaScriptException();
+        return false;
+    }
+    src->width = info[1].As<Napi::Number>().Uint32Value();
+    src->height = info[2].As<Napi::Number>().Uint32Value();
+    if (!GetPixelFormat(info[3].As<Napi::String>().Utf8Value(), &src->format) || (words && PixelSize(src->format) != 4)) {
+        Napi::TypeError::New(env, "Invalid format specification").ThrowAsJavaScriptException();
+        return false;
+    }
+    if (words) {
+        // Uint32Array formats name the channels from most to least significant
+        // byte, which is the reverse of the byte order on little-endian hosts.
+        const uint32_t one = 1;
+        if (*(const uint8_t*)&one == 1) {
+            switch (src->format) {
+                case PIXEL_RGBA: src->format = PIXEL_ABGR; break;
+                case PIXEL_ARGB: src->format = PIXEL_BGRA; break;
+                case PIXEL_BGRA: src->format = PIXEL_ARGB; break;
+                case PIXEL_ABGR: src->format = PIXEL_RGBA; break;
+                default: break;
+            }
+        }
+    }
+    size_t rowSize = (size_t)src->width * PixelSize(src->format);
+    src->stride = rowSize;
+    if (!stride.IsUndefined()) {
+        if (!stride.IsNumber()) {
+            Napi::TypeError::New(env, "Number expected").ThrowAsJavaScriptException();
+            return false;
+        }
+        src->stride = stride.As<Napi::Number>().Int64Value();
+        if (src->stride < rowSize) {
+            Napi::RangeError::New(env, "Stride is smaller than a row").ThrowAsJavaScriptException();
+            return false;
+        }
+    }
+    if (src->height > 0 && length < src->stride * (src->height - 1) + rowSize) {
+        Napi::RangeError::New(env, "Image data too short for specified size").ThrowAsJavaScriptException();
+        return false;
+    }
+    return true;
+}
+
+// Makes a Lab copy of an RGB image for the conversion pipelines. This always
+// uses LabRow on the CPU, whether or not an OpenCL device is set, so palettes
+// are converted back with ConvertLabPalette. The exported makeLabImage and
+// convertLabPalette stay on sanjuuni's conversion.
+Mat * MakeLabImage(Mat& img) {
+    StageTimer timer(STAGE_LAB, (uint64_t)img.width * img.height);
+    Mat * retval = imagePool.NewMat(img.width, img.height);
+    LabRows(img, *retval);
+    return retval;
+}
+
+// Converts a Lab palette made by MakeLabImage back to BGR.
+std::vector<Vec3b> ConvertLabPalette(const std::vector<Vec3b>& palette) {
+    return LabToRGBPalette(palette);
+}
+
+// Copies pixel data into a new image. With lab set, each row is converted to
+// Lab while it's still in cache, so no separate RGB image is made.
+Mat * ReadPixels(const PixelSource& src, bool lab = false) {
+    StageTimer timer(STAGE_INGEST, (uint64_t)src.width * src.height);
+    Mat * img = imagePool.NewMat(src.width, src.height);
+    ReadRows(src.data, src.stride, src.format, *img, lab);
+    return img;
+}
+
+enum ResizeFilter {
+    RESIZE_BOX,
+    RESIZE_BILINEAR
+};
+
+bool GetResizeFilter(const std::string& str, ResizeFilter * filter) {
+    if (str == "box") *filter = RESIZE_BOX;
+    else if (str == "bilinear") *filter = RESIZE_BILINEAR;
+    else return false;
+    return true;
+}
+
+// Source pixels and weights for each output pixel along one axis. Box
+// filtering averages every source pixel the output pixel covers, weighted by
+// the area covered; bilinear filtering blends the two nearest pixels.
+struct ResizeTaps {
+    std::vector<uint32_t> start;
+    std::vector<uint32_t> index;
+    std::vector<float> weight;
+
+    ResizeTaps(unsigned src, unsigned dst, ResizeFilter filter): start(dst + 1) {
+        const double scale = (double)src / dst;
+        for (unsigned i = 0; i < dst; i++) {
+            start[i] = index.size();
+            if (filter == RESIZE_BOX) {
+                const double lo = i * scale, hi = std::min((i + 1) * scale, (double)src);
+                for (unsigned j = lo; j < hi; j++) {
+                    const double w = std::min(hi, j + 1.0) - std::max(lo, (double)j);
+                    if (w > 0) Add(j, w / (hi - lo));
+                }
+            } else {
+                const double c = std::min(std::max((i + 0.5) * scale - 0.5, 0.0), src - 1.0);
+                const unsigned j = c;
+                const double t = c - j;
+                Add(j, 1.0 - t);
+                if (t > 0) Add(j + 1, t);
+            }
+        }
+        start[dst] = index.size();
+    }
+
+    void Add(unsigned i, double w) {
+        index.push_back(i);
+        weight.push_back(w);
+    }
+};
+
+// Resizes an image whose rows are produced by fetch, which either returns a
+// pointer to the row or fills the scratch row it's given. Output rows are
+// split across threads; each source row is fetched once per output row it
+// contributes to, so it's never stored at full size. The inner loops work on
+// flat float rows so the compiler can vectorize them.
+Mat * Resample(unsigned width, unsigned height, const std::function<const uchar3*(unsigned, uchar3*)>& fetch, unsigned dw, unsigned dh, ResizeFilter filter) {
+    const ResizeTaps tx(width, dw, filter), ty(height, dh, filter);
+    Mat * img = imagePool.NewMat(dw, dh);
+    ParallelRows(dw, dh, [&](unsigned start, unsigned end) {
+        std::vector<uchar3> scratch(width);
+        std::vector<float> line(dw * 3), acc(dw * 3);
+        for (unsigned y = start; y < end; y++) {
+            std::fill(acc.begin(), acc.end(), 0.0f);
+            for (uint32_t k = ty.start[y]; k < ty.start[y+1]; k++) {
+                const uchar3 * src = fetch(ty.index[k], scratch.data());
+                for (unsigned x = 0; x < dw; x++) {
+                    float b = 0, g = 0, r = 0;
+                    for (uint32_t t = tx.start[x]; t < tx.start[x+1]; t++) {
+                        const uchar3& c = src[tx.index[t]];
+                        const float w = tx.weight[t];
+                        b += c.x * w;
+                        g += c.y * w;
+                        r += c.z * w;
+                    }
+                    line[x*3] = b;
+                    line[x*3+1] = g;
+                    line[x*3+2] = r;
+                }
+                const float w = ty.weight[k];
+                for (unsigned i = 0; i < dw * 3; i++) acc[i] += line[i] * w;
+            }
+            Mat::row dst = (*img)[y];
+            for (unsigned x = 0; x < dw; x++)
+                dst[x] = {LabByte(acc[x*3]), LabByte(acc[x*3+1]), LabByte(acc[x*3+2])};
+        }
+    });
+    return img;
+}
+
+Mat * ResizeImage(Mat& img, unsigned dw, unsigned dh, ResizeFilter filter) {
+    StageTimer timer(STAGE_RESIZE, (uint64_t)img.width * img.height);
+    return Resample(img.width, img.height, [&img](unsigned y, uchar3 *) -> const uchar3* {return &img[y][0];}, dw, dh, filter);
+}
+
+// Resizes pixel data as it's read, so the full-size image is never made.
+Mat * ResizePixels(const PixelSource& src, unsigned dw, unsigned dh, ResizeFilter filter) {
+    StageTimer timer(STAGE_RESIZE, (uint64_t)src.width * src.height);
+    return Resample(src.width, src.height, [&src](unsigned y, uchar3 * scratch) -> const uchar3* {
+        ReadRow(src.data + y * src.stride, scratch, src.width, src.format);
+        return scratch;
+    }, dw, dh, filter);
+}
+
+// Target size for an image: either fixed, or the largest size that fits in a
+// terminal of cols x rows characters (2x3 pixels each) keeping the aspect
+// ratio, rounded to whole characters.
+struct ResizeOptions {
+    unsigned width = 0, height = 0;
+    unsigned cols = 0, rows = 0;
+    ResizeFilter filter = RESIZE_BOX;
+
+    bool Active() const {return width || cols;}
+
+    void GetSize(unsigned sw, unsigned sh, unsigned * w, unsigned * h) const {
+        if (width) {
+            *w = width;
+            *h = height;
+            return;
+        }
+        const double scale = std::min(cols * 2.0 / sw, rows * 3.0 / sh);
+        *w = std::min(cols, std::max(1U, (unsigned)std::lround(sw * scale / 2))) * 2;
+        *h = std::min(rows, std::max(1U, (unsigned)std::lround(sh * scale / 3))) * 3;
+    }
+};
+
+bool GetResizeOptions(Napi::Env env, Napi::Value value, ResizeOptions * opts) {
+    if (value.IsUndefined()) return true;
+    if (!value.IsObject()) {
+        Napi::TypeError::New(env, "Object expected").ThrowAsJavaScriptException();
+        return false;
+    }
+    Napi::Object obj = value.As<Napi::Object>();
+    const char * names[4] = {"width", "height", "cols", "rows"};
+    unsigned * fields[4] = {&opts->width, &opts->height, &opts->cols, &opts->rows};
+    for (int i = 0; i < 4; i++) {
+        Napi::Value v = obj.Get(names[i]);
+        if (v.IsUndefined()) continue;
+        if (!v.IsNumber() || v.As<Napi::Number>().Int32Value() < 1) {
+            Napi::TypeError::New(env, std::string("Invalid option for ") + names[i]).ThrowAsJavaScriptException();
+            return false;
+        }
+        *fields[i] = v.As<Napi::Number>().Uint32Value();
+    }
+    if (!opts->width != !opts->height || !opts->cols != !opts->rows || !opts->width == !opts->cols) {
+        Napi::TypeError::New(env, "Either width and height or cols and rows expected").ThrowAsJavaScriptException();
+        return false;
+    }
+    Napi::Value v = obj.Get("filter");
+    if (!v.IsUndefined() && !GetResizeFilter(v.ToString().Utf8Value(), &opts->filter)) {
+        Napi::TypeError::New(env, "Invalid option for filter").ThrowAsJavaScriptException();
+        return false;
+    }
+    return true;
+}
+
+// Reads pixel data, resizing it first if requested.
+Mat * ReadPixels(const PixelSource& src, const ResizeOptions& resize, bool lab) {
+    if (!resize.Active()) return ReadPixels(src, lab);
+    unsigned w, h;
+    resize.GetSize(src.width, src.height, &w, &h);
+    Mat * img = ResizePixels(src, w, h, resize.filter);
+    StageTimer timer(STAGE_LAB, lab ? (uint64_t)w * h : 0);
+    if (lab) ParallelRows(w, h, [img, w](unsigned start, unsigned end) {
+        for (unsigned y = start; y < end; y++) LabRow(&(*img)[y][0], w);
+    });
+    return img;
+}
+
+// Packs a list of colors into a roughly square image, repeating colors from
+// the start to fill the last row.
+Mat * SampleImage(const std::vector<uchar3>& samples) {
+    const unsigned n = std::max<size_t>(samples.size(), 1);
+    const unsigned width = std::ceil(std::sqrt((double)n)), height = (n + width - 1) / width;
+    Mat * img = imagePool.NewMat(width, height);
+    for (unsigned i = 0; i < width * height; i++) (*img)[i / width][i % width] = samples.empty() ? uchar3{0, 0, 0} : samples[i % samples.size()];
+    return img;
+}
+
+// Coarse color histogram of an image, holding the pixel count and the sum of
+// the pixel values in each bin, with the specified number of bits per channel.
+struct ColorHistogram {
+    unsigned bits;
+    std::vector<uint32_t> count;
+    std::vector<uint64_t> sum;
+    uint64_t total = 0;
+
+    ColorHistogram(unsigned bits = 5): bits(bits), count(1 << (bits * 3)), sum(3 << (bits * 3)) {}
+
+    unsigned Bin(const uchar3& c) const {
+        unsigned shift = 8 - bits;
+        return ((c.x >> shift) << (bits * 2)) | ((c.y >> shift) << bits) | (c.z >> shift);
+    }
+
+    void Add(const ColorHistogram& other) {
+        for (size_t i = 0; i < count.size(); i++) count[i] += other.count[i];
+        for (size_t i = 0; i < sum.size(); i++) sum[i] += other.sum[i];
+        total += other.total;
+    }
+
+    // Only every stride-th pixel of every stride-th row is counted.
+    static ColorHistogram FromImage(Mat& img, unsigned bits, unsigned stride = 1) {
+        ColorHistogram retval(bits);
+        std::mutex mutex;
+        ParallelRows(img.width, img.height, [&img, &retval, &mutex, bits, stride](unsigned start, unsigned end) {
+            ColorHistogram local(bits);
+            for (unsigned y = (start + stride - 1) / stride * stride; y < end; y += stride) {
+                Mat::row row = img[y];
+                for (unsigned x = 0; x < img.width; x += stride) {
+                    const uchar3& c = row[x];
+                    unsigned bin = local.Bin(c);
+                    local.count[bin]++;
+                    local.sum[bin*3] += c.x;
+                    local.sum[bin*3+1] += c.y;
+                    local.sum[bin*3+2] += c.z;
+                    local.total++;
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            retval.Add(local);
+        });
+        return retval;
+    }
+
+    // Makes an image of at most maxSamples pixels holding the mean color of
+    // each bin, repeated in proportion to its count. The fractional parts are
+    // carried over, so small bins still show up once enough of them add up.
+    Mat * Samples(unsigned maxSamples) const {
+        const double scale = total > maxSamples ? (double)maxSamples / total : 1.0;
+        std::vector<uchar3> samples;
+        double carry = 0;
+        for (size_t i = 0; i < count.size(); i++) {
+            if (count[i] == 0) continue;
+            double n = count[i] * scale + carry;
+            unsigned reps = (unsigned)n;
+            carry = n - reps;
+            const uchar3 c = {(uchar)(sum[i*3] / count[i]), (uchar)(sum[i*3+1] / count[i]), (uchar)(sum[i*3+2] / count[i])};
+            samples.insert(samples.end(), reps, c);
+        }
+        return SampleImage(samples);
+    }
+
+    // Total variation distance between the two normalized histograms, from 0
+    // (identical) to 1 (no overlap).
+    double Distance(const ColorHistogram& other) const {
+        if (bits != other.bits || total == 0 || other.total == 0) return 1.0;
+        double retval = 0;
+        for (size_t i = 0; i < count.size(); i++)
+            retval += std::abs((double)count[i] / total - (double)other.count[i] / other.total);
+        return retval / 2;
+    }
+};
+
+// Options for building palettes from part of an image.
+struct SampleOptions {
+    unsigned stride = 0;
+    unsigned maxSamples = 0;
+    unsigned bits = 0;
+};
+
+bool GetSampleOptions(Napi::Env env, Napi::Value value, SampleOptions * opts) {
+    if (value.IsUndefined()) return true;
+    if (!value.IsObject()) {
+        Napi::TypeError::New(env, "Object expected").ThrowAsJavaScriptException();
+        return false;
+    }
+    Napi::Object obj = value.As<Napi::Object>();
+    const char * names[3] = {"sampleStride", "maxSamples", "histogramBits"};
+    unsigned * fields[3] = {&opts->stride, &opts->maxSamples, &opts->bits};
+    for (int i = 0; i < 3; i++) {
+        Napi::Value v = obj.Get(names[i]);
+        if (v.IsUndefined()) continue;
+        if (!v.IsNumber() || v.As<Napi::Number>().Int32Value() < 1) {
+            Napi::TypeError::New(env, std::string("Invalid option for ") + names[i]).ThrowAsJavaScriptException();
+            return false;
+        }
+        *fields[i] = v.As<Napi::Number>().Uint32Value();
+    }
+    if (opts->bits > 6) {
+        Napi::RangeError::New(env, "histogramBits must be between 1 and 6").ThrowAsJavaScriptException();
+        return false;
+    }
+    return true;
+}
+
+// The stride to sample an image with: the requested stride, raised until the
+// samples fit in maxSamples.
+unsigned GetSampleStride(const Mat& img, const SampleOptions& opts) {
+    unsigned stride = std::max(opts.stride, 1U);
+    if (opts.maxSamples) {
+        stride = std::max(stride, (unsigned)std::sqrt((double)img.width * img.height / opts.maxSamples));
+        while ((uint64_t)((img.width + stride - 1) / stride) * ((img.height + stride - 1) / stride) > opts.maxSamples) stride++;
+    }
+    return stride;
+}
+
+// Runs a palette reducer on an image, or on a sample of it if any sampling
+// options are set. With histogramBits, the reducer sees the bins' mean colors
+// weighted by count, capped at maxSamples (default 65536) pixels.
+std::vector<Vec3b> ReducePaletteUncached(Quantizer reducer, Mat& img, int numColors, const SampleOptions& opts) {
+    StageTimer timer(STAGE_QUANTIZE, (uint64_t)img.width * img.height);
+    unsigned stride = GetSampleStride(img, opts);
+    if (opts.bits) {
+        PooledMat samples(ColorHistogram::FromImage(img, opts.bits, std::max(opts.stride, 1U)).Samples(opts.maxSamples ? opts.maxSamples : 65536));
+        return reducer(*samples, numColors, device);
+    }
+    if (stride == 1) return reducer(img, numColors, device);
+    PooledMat samples(imagePool.NewMat((img.width + stride - 1) / stride, (img.height + stride - 1) / stride));
+    ParallelRows(samples->width, samples->height, [&img, &samples, stride](unsigned start, unsigned end) {
+        for (unsigned y = start; y < end; y++) {
+            Mat::row src = img[y * stride];
+            Mat::row dst = (*samples)[y];
+            for (unsigned x = 0; x < samples->width; x++) dst[x] = src[x * stride];
+        }
+    });
+    return reducer(*samples, numColors, device);
+}
+
+std::vector<Vec3b> ReducePalette(Quantizer reducer, Mat& img, int numColors, const SampleOptions& opts) {
+    if (!resultCache.Enabled()) return ReducePaletteUncached(reducer, img, numColors, opts);
+    Hasher hash(1);
+    HashImage(hash, img);
+    hash.Add(reducer);
+    hash.Add(numColors);
+    hash.Add(opts.stride);
+    hash.Add(opts.maxSamples);
+    hash.Add(opts.bits);
+    hash.Add(device != NULL);
+    const uint64_t key = hash.Digest();
+    std::vector<Vec3b> palette;
+    if (resultCache.Get(key, &palette)) return palette;
+    palette = ReducePaletteUncached(reducer, img, numColors, opts);
+    resultCache.Put(key, palette);
+    return palette;
+}
+
+void FinalizeHistogram(Napi::Env env, ColorHistogram * obj) {delete obj;}
+
+ColorHistogram * GetHistogram(Napi::Value value) {
+    if (!value.IsObject()) return NULL;
+    Napi::Value v = value.As<Napi::Object>().Get("_objh");
+    return v.IsExternal() ? v.As<Napi::External<ColorHistogram>>().Data() : NULL;
+}
+
+Napi::Object NewHistogram(Napi::Env env, ColorHistogram * hist) {
+    Napi::Object retval = Napi::Object::New(env);
+    retval.Set("_objh", Napi::External<ColorHistogram>::New(env, hist, FinalizeHistogram));
+    retval.Set("bits", Napi::Number::New(env, hist->bits));
+    retval.Set("colors", Napi::Number::New(env, hist->count.size() - std::count(hist->count.begin(), hist->count.end(), 0)));
+    retval.Set("total", Napi::Number::New(env, (double)hist->total));
+    return retval;
+}
+
+// Input to a palette reducer: either an image with sampling options, or a
+// histogram made by makeColorHistogram.
+struct PaletteSource {
+    Mat * img = NULL;
+    ColorHistogram * hist = NULL;
+    SampleOptions sample;
+    bool packed = false;
+};
+
+bool GetPaletteSource(const Napi::CallbackInfo& info, PaletteSource * src, int * numColors) {
+    Napi::Env env = info.Env();
+    if (info.Length() < 1) {
+        Napi::TypeError::New(env, "RGBImage expected").ThrowAsJavaScriptException();
+        return false;
+    }
+    if (info.Length() >= 2 && !info[1].IsUndefined()) {
+        if (!info[1].IsNumber()) {
+            Napi::TypeError::New(env, "Number expected").ThrowAsJavaScriptException();
+            return false;
+        }
+        *numColors = info[1].As<Napi::Number>().Int32Value();
+    }
+    src->hist = GetHistogram(info[0]);
+    if (src->hist == NULL) src->img = GetRGBImage(env, info[0]);
+    if (env.IsExceptionPending() || !GetSampleOptions(env, info[2], &src->sample)) return false;
+    src->packed = info[2].IsObject() && info[2].As<Napi::Object>().Get("packed").ToBoolean();
+    return true;
+}
+
+std::vector<Vec3b> ReducePalette(Quantizer reducer, const PaletteSource& src, int numColors) {
+    if (src.hist != NULL) {
+        StageTimer timer(STAGE_QUANTIZE, src.hist->total);
+        PooledMat samples(src.hist->Samples(src.sample.maxSamples ? src.sample.maxSamples : 65536));
+        return reducer(*samples, numColors, device);
+    }
+    return ReducePalette(reducer, *src.img, numColors, src.sample);
+}
+
+Napi::Boolean M_initOpenCL(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+#ifdef USE_OPENCL
+    if (device != NULL) return Napi::Boolean::New(env, true);
+    try {
+        OpenCL::Device_Info info;
+        std::vector<OpenCL::Device_Info> devices = OpenCL::get_devices(false);
+        if (info.Length() > 0) {
+            if (info[0].IsNumber()) {
+                info = OpenCL::select_device_with_id(info[0].As<Napi::Number>().Uint32Value());
+            } else if (info[0].IsString()) {
+                std::string str = info[0].As<Napi::String>().Utf8Value();
+                if (str == "best_flops") {
+                    info = OpenCL::select_device_with_most_flops(devices, false);
+                } else if (str == "best_memory") {
+                    info = OpenCL::select_device_with_most_memory(devices, false);
+                } else {
+                    Napi::TypeError::New(env, "Invalid option for device").ThrowAsJavaScriptException();
+                }
+            } else {
+                Napi::TypeError::New(env, "Number or string expected").ThrowAsJavaScriptException();
+            }
+        } else {
+            info = OpenCL::select_device_with_most_flops(devices, false);
+        }
+        device = new OpenCL::Device(info);
+        // Pooled images are host memory, which device images can't reuse.
+        imagePool.Trim(0);
+    } catch (const OpenCL::OpenCLException& e) {
+        fprintf(stderr, "Failed to initialize OpenCL: %s\n", e.what());
+        return Napi::Boolean::New(env, false);
     }
     return Napi::Boolean::New(env, true);
 #else
@@ -143,7 +1681,7 @@ Napi::Boolean M_initOpenCL(const Napi::CallbackInfo& info) {
 #endif
 }
 
-Napi::Object M_makeRGBImage(const Napi::CallbackInfo& info) {
+Napi::Value M_makeRGBImage(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
     if (info.Length() == 0)
         Napi::TypeError::New(env, "Object expected").ThrowAsJavaScriptException();
@@ -152,284 +1690,72 @@ Napi::Object M_makeRGBImage(const Napi::CallbackInfo& info) {
         // Color[][]/[number, number, number][][]
         Napi::Array array = info[0].As<Napi::Array>();
         unsigned height = array.Length();
-        if (height == 0) Napi::RangeError::New(env, "Image has no data").ThrowAsJavaScriptException();
-        if (!array.Get(0U).IsArray()) Napi::TypeError::New(env, "Invalid pixel array").ThrowAsJavaScriptException();
+        if (height == 0) {
+            Napi::RangeError::New(env, "Image has no data").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        if (!array.Get(0U).IsArray()) {
+            Napi::TypeError::New(env, "Invalid pixel array").ThrowAsJavaScriptException();
+            return env.Null();
+        }
         unsigned width = array.Get(0U).As<Napi::Array>().Length();
         for (unsigned y = 1; y < height; y++) {
             Napi::Value row = array.Get(y);
-            if (!row.IsArray() || row.As<Napi::Array>().Length() != width) Napi::TypeError::New(env, "Invalid pixel array").ThrowAsJavaScriptException();
+            if (!row.IsArray() || row.As<Napi::Array>().Length() != width) {
+                Napi::TypeError::New(env, "Invalid pixel array").ThrowAsJavaScriptException();
+                return env.Null();
+            }
         }
-        img = new Mat(width, height, device);
+        // goes back to the pool if a pixel turns out to be invalid
+        PooledMat pixels(imagePool.NewMat(width, height));
         for (unsigned y = 0; y < height; y++) {
             Napi::Array row = array.Get(y).As<Napi::Array>();
-            Mat::row imgrow = (*img)[y];
+            Mat::row imgrow = (*pixels)[y];
             for (unsigned x = 0; x < width; x++) {
                 Napi::Value color = row.Get(x);
                 if (color.IsArray()) {
                     Napi::Array carr = color.As<Napi::Array>();
-                    if (carr.Length() != 3) {
-                        delete img;
-                        Napi::TypeError::New(env, "Invalid pixel array").ThrowAsJavaScriptException();
-                    }
-                    if (!carr.Get(0U).IsNumber()) {
-                        delete img;
+                    if (carr.Length() != 3 || !carr.Get(0U).IsNumber() || !carr.Get(1U).IsNumber() || !carr.Get(2U).IsNumber()) {
                         Napi::TypeError::New(env, "Invalid pixel array").ThrowAsJavaScriptException();
+                        return env.Null();
                     }
                     imgrow[x].z = carr.Get(0U).As<Napi::Number>().Uint32Value();
-                    if (!carr.Get(1U).IsNumber()) {
-                        delete img;
-                        Napi::TypeError::New(env, "Invalid pixel array").ThrowAsJavaScriptException();
-                    }
                     imgrow[x].y = carr.Get(1U).As<Napi::Number>().Uint32Value();
-                    if (!carr.Get(2U).IsNumber()) {
-                        delete img;
-                        Napi::TypeError::New(env, "Invalid pixel array").ThrowAsJavaScriptException();
-                    }
                     imgrow[x].x = carr.Get(2U).As<Napi::Number>().Uint32Value();
                 } else if (color.IsObject()) {
                     Napi::Object carr = color.As<Napi::Object>();
-                    if (!carr.Get("r").IsNumber()) {
-                        delete img;
+                    if (!carr.Get("r").IsNumber() || !carr.Get("g").IsNumber() || !carr.Get("b").IsNumber()) {
                         Napi::TypeError::New(env, "Invalid pixel array").ThrowAsJavaScriptException();
+                        return env.Null();
                     }
                     imgrow[x].z = carr.Get("r").As<Napi::Number>().Uint32Value();
-                    if (!carr.Get("g").IsNumber()) {
-                        delete img;
-                        Napi::TypeError::New(env, "Invalid pixel array").ThrowAsJavaScriptException();
-                    }
                     imgrow[x].y = carr.Get("g").As<Napi::Number>().Uint32Value();
-                    if (!carr.Get("b").IsNumber()) {
-                        delete img;
-                        Napi::TypeError::New(env, "Invalid pixel array").ThrowAsJavaScriptException();
-                    }
                     imgrow[x].x = carr.Get("b").As<Napi::Number>().Uint32Value();
                 } else {
-                    delete img;
                     Napi::TypeError::New(env, "Invalid pixel array").ThrowAsJavaScriptException();
+                    return env.Null();
                 }
             }
         }
-    } else if (info[0].IsArrayBuffer()) {
-        // ArrayBuffer
-        Napi::ArrayBuffer array = info[0].As<Napi::ArrayBuffer>();
-        switch (info.Length()) {
-            case 1: case 2: Napi::TypeError::New(env, "Number expected").ThrowAsJavaScriptException();
-            case 3: Napi::TypeError::New(env, "String expected").ThrowAsJavaScriptException();
-        }
-        if (!info[1].IsNumber() || !info[2].IsNumber())
-            Napi::TypeError::New(env, "Number expected").ThrowAsJavaScriptException();
-        if (!info[3].IsString())
-            Napi::TypeError::New(env, "String expected").ThrowAsJavaScriptException();
-        unsigned width = info[1].As<Napi::Number>().Uint32Value(),
-                 height = info[2].As<Napi::Number>().Uint32Value();
-        std::string format = info[3].As<Napi::String>().Utf8Value();
-        img = new Mat(width, height, device);
-        const uint8_t* data = (const uint8_t*)array.Data();
-        if (format == "rgb" || format == "bgr") {
-            bool bgr = format == "bgr";
-            for (unsigned y = 0; y < height; y++) {
-                Mat::row row = (*img)[y];
-                for (unsigned x = 0; x < width; x++) {
-                    unsigned pos = (y * width + x) * 3;
-                    if (pos + 2 >= array.ByteLength()) {
-                        delete img;
-                        Napi::RangeError::New(env, "Image data too short for specified size").ThrowAsJavaScriptException();
-                    }
-                    if (!bgr) row[x] = {data[pos + 2], data[pos + 1], data[pos]};
-                    else row[x] = {data[pos], data[pos + 1], data[pos + 2]};
-                }
-            }
-        } else {
-            int tp;
-            if (format == "rgba") tp = 0;
-            else if (format == "argb") tp = 1;
-            else if (format == "bgra") tp = 2;
-            else if (format == "abgr") tp = 3;
-            else {
-                delete img;
-                Napi::TypeError::New(env, "Invalid format specification").ThrowAsJavaScriptException();
-            }
-            for (unsigned y = 0; y < height; y++) {
-                Mat::row row = (*img)[y];
-                for (unsigned x = 0; x < width; x++) {
-                    unsigned pos = (y * width + x) * 4;
-                    if (pos + 3 >= array.ByteLength()) {
-                        delete img;
-                        Napi::RangeError::New(env, "Image data too short for specified size").ThrowAsJavaScriptException();
-                    }
-                    switch (tp) {
-                        case 0: row[x] = {data[pos + 2], data[pos + 1], data[pos]}; break;
-                        case 1: row[x] = {data[pos + 3], data[pos + 2], data[pos + 1]}; break;
-                        case 2: row[x] = {data[pos], data[pos + 1], data[pos + 2]}; break;
-                        case 3: row[x] = {data[pos + 1], data[pos + 2], data[pos + 3]}; break;
-                    }
-                }
-            }
-        }
-    } else if (info[0].IsBuffer()) {
-        // Buffer
-        Napi::Buffer<uint8_t> buffer = info[0].As<Napi::Buffer<uint8_t>>();
-        switch (info.Length()) {
-            case 1: case 2: Napi::TypeError::New(env, "Number expected").ThrowAsJavaScriptException();
-            case 3: Napi::TypeError::New(env, "String expected").ThrowAsJavaScriptException();
-        }
-        if (!info[1].IsNumber() || !info[2].IsNumber())
-            Napi::TypeError::New(env, "Number expected").ThrowAsJavaScriptException();
-        if (!info[3].IsString())
-            Napi::TypeError::New(env, "String expected").ThrowAsJavaScriptException();
-        unsigned width = info[1].As<Napi::Number>().Uint32Value(),
-                 height = info[2].As<Napi::Number>().Uint32Value();
-        std::string format = info[3].As<Napi::String>().Utf8Value();
-        img = new Mat(width, height, device);
-        const uint8_t* data = buffer.Data();
-        if (format == "rgb" || format == "bgr") {
-            bool bgr = format == "bgr";
-            for (unsigned y = 0; y < height; y++) {
-                Mat::row row = (*img)[y];
-                for (unsigned x = 0; x < width; x++) {
-                    unsigned pos = (y * width + x) * 3;
-                    if (pos + 2 >= buffer.ByteLength()) {
-                        delete img;
-                        Napi::RangeError::New(env, "Image data too short for specified size").ThrowAsJavaScriptException();
-                    }
-                    if (!bgr) row[x] = {data[pos + 2], data[pos + 1], data[pos]};
-                    else row[x] = {data[pos], data[pos + 1], data[pos + 2]};
-                }
-            }
-        } else {
-            int tp;
-            if (format == "rgba") tp = 0;
-            else if (format == "argb") tp = 1;
-            else if (format == "bgra") tp = 2;
-            else if (format == "abgr") tp = 3;
-            else {
-                delete img;
-                Napi::TypeError::New(env, "Invalid format specification").ThrowAsJavaScriptException();
-            }
-            for (unsigned y = 0; y < height; y++) {
-                Mat::row row = (*img)[y];
-                for (unsigned x = 0; x < width; x++) {
-                    unsigned pos = (y * width + x) * 4;
-                    if (pos + 3 >= buffer.ByteLength()) {
-                        delete img;
-                        Napi::RangeError::New(env, "Image data too short for specified size").ThrowAsJavaScriptException();
-                    }
-                    switch (tp) {
-                        case 0: row[x] = {data[pos + 2], data[pos + 1], data[pos]}; break;
-                        case 1: row[x] = {data[pos + 3], data[pos + 2], data[pos + 1]}; break;
-                        case 2: row[x] = {data[pos], data[pos + 1], data[pos + 2]}; break;
-                        case 3: row[x] = {data[pos + 1], data[pos + 2], data[pos + 3]}; break;
-                    }
-                }
-            }
+        img = pixels.release();
+    } else if (IsPixelData(info[0])) {
+        // ArrayBuffer/Buffer/Uint8Array/Uint32Array
+        PixelSource src;
+        ResizeOptions resize;
+        Napi::Value stride = info[4];
+        if (info[4].IsObject()) {
+            stride = info[4].As<Napi::Object>().Get("stride");
+            if (!GetResizeOptions(env, info[4].As<Napi::Object>().Get("resize"), &resize)) return env.Null();
         }
+        if (!GetPixelSource(info, info[0], stride, &src)) return env.Null();
+        img = ReadPixels(src, resize, false);
     } else if (info[0].IsTypedArray()) {
-        // Uint8Array/Uint32Array
-        Napi::TypedArray tarray = info[0].As<Napi::TypedArray>();
-        if (tarray.TypedArrayType() == napi_uint8_array) {
-            Napi::TypedArrayOf<uint8_t> array = tarray.As<Napi::TypedArrayOf<uint8_t>>();
-            switch (info.Length()) {
-                case 1: case 2: Napi::TypeError::New(env, "Number expected").ThrowAsJavaScriptException();
-                case 3: Napi::TypeError::New(env, "String expected").ThrowAsJavaScriptException();
-            }
-            if (!info[1].IsNumber() || !info[2].IsNumber())
-                Napi::TypeError::New(env, "Number expected").ThrowAsJavaScriptException();
-            if (!info[3].IsString())
-                Napi::TypeError::New(env, "String expected").ThrowAsJavaScriptException();
-            unsigned width = info[1].As<Napi::Number>().Uint32Value(),
-                     height = info[2].As<Napi::Number>().Uint32Value();
-            std::string format = info[3].As<Napi::String>().Utf8Value();
-            img = new Mat(width, height, device);
-            const uint8_t* data = array.Data();
-            if (format == "rgb" || format == "bgr") {
-                bool bgr = format == "bgr";
-                for (unsigned y = 0; y < height; y++) {
-                    Mat::row row = (*img)[y];
-                    for (unsigned x = 0; x < width; x++) {
-                        unsigned pos = (y * width + x) * 3;
-                        if (pos + 2 >= array.ByteLength()) {
-                            delete img;
-                            Napi::RangeError::New(env, "Image data too short for specified size").ThrowAsJavaScriptException();
-                        }
-                        if (!bgr) row[x] = {data[pos + 2], data[pos + 1], data[pos]};
-                        else row[x] = {data[pos], data[pos + 1], data[pos + 2]};
-                    }
-                }
-            } else {
-                int tp;
-                if (format == "rgba") tp = 0;
-                else if (format == "argb") tp = 1;
-                else if (format == "bgra") tp = 2;
-                else if (format == "abgr") tp = 3;
-                else {
-                    delete img;
-                    Napi::TypeError::New(env, "Invalid format specification").ThrowAsJavaScriptException();
-                }
-                for (unsigned y = 0; y < height; y++) {
-                    Mat::row row = (*img)[y];
-                    for (unsigned x = 0; x < width; x++) {
-                        unsigned pos = (y * width + x) * 4;
-                        if (pos + 3 >= array.ByteLength()) {
-                            delete img;
-                            Napi::RangeError::New(env, "Image data too short for specified size").ThrowAsJavaScriptException();
-                        }
-                        switch (tp) {
-                            case 0: row[x] = {data[pos + 2], data[pos + 1], data[pos]}; break;
-                            case 1: row[x] = {data[pos + 3], data[pos + 2], data[pos + 1]}; break;
-                            case 2: row[x] = {data[pos], data[pos + 1], data[pos + 2]}; break;
-                            case 3: row[x] = {data[pos + 1], data[pos + 2], data[pos + 3]}; break;
-                        }
-                    }
-                }
-            }
-        } else if (tarray.TypedArrayType() == napi_uint32_array) {
-            Napi::TypedArrayOf<uint32_t> array = tarray.As<Napi::TypedArrayOf<uint32_t>>();
-            switch (info.Length()) {
-                case 1: case 2: Napi::TypeError::New(env, "Number expected").ThrowAsJavaScriptException();
-                case 3: Napi::TypeError::New(env, "String expected").ThrowAsJavaScriptException();
-            }
-            if (!info[1].IsNumber() || !info[2].IsNumber())
-                Napi::TypeError::New(env, "Number expected").ThrowAsJavaScriptException();
-            if (!info[3].IsString())
-                Napi::TypeError::New(env, "String expected").ThrowAsJavaScriptException();
-            unsigned width = info[1].As<Napi::Number>().Uint32Value(),
-                     height = info[2].As<Napi::Number>().Uint32Value();
-            std::string format = info[3].As<Napi::String>().Utf8Value();
-            img = new Mat(width, height, device);
-            const uint32_t* data = array.Data();
-            int tp;
-            if (format == "rgba") tp = 0;
-            else if (format == "argb") tp = 1;
-            else if (format == "bgra") tp = 2;
-            else if (format == "abgr") tp = 3;
-            else {
-                delete img;
-                Napi::TypeError::New(env, "Invalid format specification").ThrowAsJavaScriptException();
-            }
-            for (unsigned y = 0; y < height; y++) {
-                Mat::row row = (*img)[y];
-                for (unsigned x = 0; x < width; x++) {
-                    unsigned pos = y * width + x;
-                    if (pos >= array.ByteLength()) {
-                        delete img;
-                        Napi::RangeError::New(env, "Image data too short for specified size").ThrowAsJavaScriptException();
-                    }
-                    uint32_t d = data[pos];
-                    switch (tp) {
-                        case 0: row[x] = {(uint8_t)((d >> 8) & 0xFF), (uint8_t)((d >> 16) & 0xFF), (uint8_t)((d >> 24) & 0xFF)}; break;
-                        case 1: row[x] = {(uint8_t)((d) & 0xFF), (uint8_t)((d >> 8) & 0xFF), (uint8_t)((d >> 16) & 0xFF)}; break;
-                        case 2: row[x] = {(uint8_t)((d >> 24) & 0xFF), (uint8_t)((d >> 16) & 0xFF), (uint8_t)((d >> 8) & 0xFF)}; break;
-                        case 3: row[x] = {(uint8_t)((d >> 16) & 0xFF), (uint8_t)((d >> 8) & 0xFF), (uint8_t)((d) & 0xFF)}; break;
-                    }
-                }
-            }
-        } else {
-            Napi::TypeError::New(env, "Unknown typed array type").ThrowAsJavaScriptException();
-        }
+        Napi::TypeError::New(env, "Unknown typed array type").ThrowAsJavaScriptException();
     } else {
         Napi::TypeError::New(env, "Object expected").ThrowAsJavaScriptException();
     }
 
+    if (img == NULL) return env.Null();
     return NewRGBImage(env, img);
 }
 
@@ -439,196 +1765,1843 @@ Napi::Object M_makeLabImage(const Napi::CallbackInfo& info) {
     return NewRGBImage(env, new Mat(makeLabImage(*GetRGBImage(env, info[0]), device)));
 }
 
-Napi::Object M_convertLabPalette(const Napi::CallbackInfo& info) {
+Napi::Value M_convertLabPalette(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
     if (info.Length() < 1) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
-    return NewPalette(env, convertLabPalette(GetPalette(env, info[0])));
+    std::vector<Vec3b> palette = GetPalette(env, info[0]);
+    if (env.IsExceptionPending()) return env.Null();
+    return NewPaletteValue(env, convertLabPalette(palette), IsPackedPalette(info[0]));
 }
 
-Napi::Object M_reducePalette_medianCut(const Napi::CallbackInfo& info) {
+Napi::Value M_reducePalette_medianCut(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
-    if (info.Length() < 1) Napi::TypeError::New(env, "RGBImage expected").ThrowAsJavaScriptException();
+    PaletteSource src;
     int numColors = 16;
-    if (info.Length() >= 2) {
-        if (!info[1].IsNumber()) Napi::TypeError::New(env, "Number expected").ThrowAsJavaScriptException();
-        numColors = info[1].As<Napi::Number>().Int32Value();
-    }
-    return NewPalette(env, reducePalette_medianCut(*GetRGBImage(env, info[0]), numColors, device));
+    if (!GetPaletteSource(info, &src, &numColors)) return env.Null();
+    return NewPaletteValue(env, ReducePalette(reducePalette_medianCut, src, numColors), src.packed);
 }
 
-Napi::Object M_reducePalette_kMeans(const Napi::CallbackInfo& info) {
+Napi::Value M_reducePalette_kMeans(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
-    if (info.Length() < 1) Napi::TypeError::New(env, "RGBImage expected").ThrowAsJavaScriptException();
+    PaletteSource src;
     int numColors = 16;
-    if (info.Length() >= 2) {
-        if (!info[1].IsNumber()) Napi::TypeError::New(env, "Number expected").ThrowAsJavaScriptException();
-        numColors = info[1].As<Napi::Number>().Int32Value();
-    }
-    return NewPalette(env, reducePalette_kMeans(*GetRGBImage(env, info[0]), numColors, device));
+    if (!GetPaletteSource(info, &src, &numColors)) return env.Null();
+    return NewPaletteValue(env, ReducePalette(reducePalette_kMeans, src, numColors), src.packed);
 }
 
-Napi::Object M_reducePalette_octree(const Napi::CallbackInfo& info) {
+Napi::Value M_reducePalette_octree(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
-    if (info.Length() < 1) Napi::TypeError::New(env, "RGBImage expected").ThrowAsJavaScriptException();
+    PaletteSource src;
     int numColors = 16;
-    if (info.Length() >= 2) {
-        if (!info[1].IsNumber()) Napi::TypeError::New(env, "Number expected").ThrowAsJavaScriptException();
-        numColors = info[1].As<Napi::Number>().Int32Value();
-    }
-    return NewPalette(env, reducePalette_octree(*GetRGBImage(env, info[0]), numColors, device));
+    if (!GetPaletteSource(info, &src, &numColors)) return env.Null();
+    return NewPaletteValue(env, ReducePalette(reducePalette_octree, src, numColors), src.packed);
 }
 
-Napi::Object M_thresholdImage(const Napi::CallbackInfo& info) {
+Napi::Value M_thresholdImage(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
     if (info.Length() == 0) Napi::TypeError::New(env, "RGBImage expected").ThrowAsJavaScriptException();
     else if (info.Length() == 1) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
     Mat * img = GetRGBImage(env, info[0]);
     std::vector<Vec3b> palette = GetPalette(env, info[1]);
-    Mat res = thresholdImage(*img, palette, device);
-    return NewIndexedImage(env, new Mat1b(rgbToPaletteImage(res, palette, device)));
+    unsigned threads = 0;
+    if (env.IsExceptionPending() || !GetThreadsOption(env, info.Length() > 2 ? info[2] : env.Undefined(), &threads)) return env.Null();
+    ThreadLimit limit(threads);
+    return NewIndexedImage(env, DitherToIndexed(*img, palette, thresholdImage));
 }
 
-Napi::Object M_ditherImage_ordered(const Napi::CallbackInfo& info) {
+Napi::Value M_ditherImage_ordered(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
     if (info.Length() == 0) Napi::TypeError::New(env, "RGBImage expected").ThrowAsJavaScriptException();
     else if (info.Length() == 1) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
     Mat * img = GetRGBImage(env, info[0]);
     std::vector<Vec3b> palette = GetPalette(env, info[1]);
-    Mat res = ditherImage_ordered(*img, palette, device);
-    return NewIndexedImage(env, new Mat1b(rgbToPaletteImage(res, palette, device)));
+    unsigned threads = 0;
+    if (env.IsExceptionPending() || !GetThreadsOption(env, info.Length() > 2 ? info[2] : env.Undefined(), &threads)) return env.Null();
+    ThreadLimit limit(threads);
+    return NewIndexedImage(env, DitherToIndexed(*img, palette, ditherImage_ordered));
 }
 
-Napi::Object M_ditherImage_floydSteinberg(const Napi::CallbackInfo& info) {
+Napi::Value M_ditherImage_floydSteinberg(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
     if (info.Length() == 0) Napi::TypeError::New(env, "RGBImage expected").ThrowAsJavaScriptException();
     else if (info.Length() == 1) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
     Mat * img = GetRGBImage(env, info[0]);
     std::vector<Vec3b> palette = GetPalette(env, info[1]);
-    Mat res = ditherImage(*img, palette, device);
-    return NewIndexedImage(env, new Mat1b(rgbToPaletteImage(res, palette, device)));
+    unsigned threads = 0;
+    if (env.IsExceptionPending() || !GetThreadsOption(env, info.Length() > 2 ? info[2] : env.Undefined(), &threads)) return env.Null();
+    DitherOptions dither = GetDitherOptions(info.Length() > 2 ? info[2] : env.Undefined());
+    ThreadLimit limit(threads);
+    return NewIndexedImage(env, DitherToIndexed(*img, palette, ditherImage, dither));
 }
 
-Napi::String M_makeTable(const Napi::CallbackInfo& info) {
+Napi::Value M_makeTable(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
     if (info.Length() == 0) Napi::TypeError::New(env, "IndexedImage expected").ThrowAsJavaScriptException();
     else if (info.Length() == 1) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
     Mat1b * img = GetIndexedImage(env, info[0]);
     std::vector<Vec3b> palette = GetPalette(env, info[1]);
-    uchar *chars, *cols;
-    makeCCImage(*img, palette, &chars, &cols, device);
-    std::string retval = makeTable(chars, cols, palette, img->width / 2, img->height / 3, info.Length() >= 2 && info[2].ToBoolean(), info.Length() >= 3 && info[3].ToBoolean(), info.Length() >= 4 && info[4].ToBoolean());
-    delete[] chars;
-    delete[] cols;
+    if (env.IsExceptionPending()) return env.Null();
+    std::shared_ptr<const CCImage> cc = GetCCImage(*img, palette);
+    StageTimer timer(STAGE_ENCODE, (uint64_t)cc->width * cc->height * 6);
+    std::string retval = makeTable(cc->chars, cc->cols, palette, cc->width, cc->height, info.Length() >= 2 && info[2].ToBoolean(), info.Length() >= 3 && info[3].ToBoolean(), info.Length() >= 4 && info[4].ToBoolean());
     return Napi::String::New(env, retval);
 }
 
-Napi::String M_makeNFP(const Napi::CallbackInfo& info) {
+Napi::Value M_makeNFP(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
     if (info.Length() == 0) Napi::TypeError::New(env, "IndexedImage expected").ThrowAsJavaScriptException();
     else if (info.Length() == 1) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
     Mat1b * img = GetIndexedImage(env, info[0]);
     std::vector<Vec3b> palette = GetPalette(env, info[1]);
-    uchar *chars, *cols;
-    makeCCImage(*img, palette, &chars, &cols, device);
-    std::string retval = makeNFP(chars, cols, palette, img->width / 2, img->height / 3);
-    delete[] chars;
-    delete[] cols;
+    if (env.IsExceptionPending()) return env.Null();
+    std::shared_ptr<const CCImage> cc = GetCCImage(*img, palette);
+    StageTimer timer(STAGE_ENCODE, (uint64_t)cc->width * cc->height * 6);
+    std::string retval = makeNFP(cc->chars, cc->cols, palette, cc->width, cc->height);
     return Napi::String::New(env, retval);
 }
 
-Napi::String M_makeLuaFile(const Napi::CallbackInfo& info) {
+Napi::Value M_makeLuaFile(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
     if (info.Length() == 0) Napi::TypeError::New(env, "IndexedImage expected").ThrowAsJavaScriptException();
     else if (info.Length() == 1) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
     Mat1b * img = GetIndexedImage(env, info[0]);
     std::vector<Vec3b> palette = GetPalette(env, info[1]);
-    uchar *chars, *cols;
-    makeCCImage(*img, palette, &chars, &cols, device);
-    std::string retval = makeLuaFile(chars, cols, palette, img->width / 2, img->height / 3);
-    delete[] chars;
-    delete[] cols;
+    if (env.IsExceptionPending()) return env.Null();
+    std::shared_ptr<const CCImage> cc = GetCCImage(*img, palette);
+    StageTimer timer(STAGE_ENCODE, (uint64_t)cc->width * cc->height * 6);
+    std::string retval = makeLuaFile(cc->chars, cc->cols, palette, cc->width, cc->height);
     return Napi::String::New(env, retval);
 }
 
-Napi::String M_makeRawImage(const Napi::CallbackInfo& info) {
+Napi::Value M_makeRawImage(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
     if (info.Length() == 0) Napi::TypeError::New(env, "IndexedImage expected").ThrowAsJavaScriptException();
     else if (info.Length() == 1) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
     Mat1b * img = GetIndexedImage(env, info[0]);
     std::vector<Vec3b> palette = GetPalette(env, info[1]);
-    uchar *chars, *cols;
-    makeCCImage(*img, palette, &chars, &cols, device);
-    std::string retval = makeRawImage(chars, cols, palette, img->width / 2, img->height / 3);
-    delete[] chars;
-    delete[] cols;
+    if (env.IsExceptionPending()) return env.Null();
+    std::shared_ptr<const CCImage> cc = GetCCImage(*img, palette);
+    StageTimer timer(STAGE_ENCODE, (uint64_t)cc->width * cc->height * 6);
+    std::string retval = makeRawImage(cc->chars, cc->cols, palette, cc->width, cc->height);
     return Napi::String::New(env, retval);
 }
 
-Napi::Buffer<uint8_t> M_make32vid(const Napi::CallbackInfo& info) {
+Napi::Value M_make32vid(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
     if (info.Length() == 0) Napi::TypeError::New(env, "IndexedImage expected").ThrowAsJavaScriptException();
     else if (info.Length() == 1) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
     Mat1b * img = GetIndexedImage(env, info[0]);
     std::vector<Vec3b> palette = GetPalette(env, info[1]);
-    uchar *chars, *cols;
-    makeCCImage(*img, palette, &chars, &cols, device);
-    std::string retval = make32vid(chars, cols, palette, img->width / 2, img->height / 3);
-    delete[] chars;
-    delete[] cols;
-    return Napi::Buffer<uint8_t>::Copy(env, (const uint8_t*)retval.c_str(), retval.size());
+    if (env.IsExceptionPending()) return env.Null();
+    std::shared_ptr<const CCImage> cc = GetCCImage(*img, palette);
+    StageTimer timer(STAGE_ENCODE, (uint64_t)cc->width * cc->height * 6);
+    std::string retval = make32vid(cc->chars, cc->cols, palette, cc->width, cc->height);
+    return NewBuffer(env, retval);
 }
 
-Napi::Buffer<uint8_t> M_make32vid_cmp(const Napi::CallbackInfo& info) {
+Napi::Value M_make32vid_cmp(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
     if (info.Length() == 0) Napi::TypeError::New(env, "IndexedImage expected").ThrowAsJavaScriptException();
     else if (info.Length() == 1) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
     Mat1b * img = GetIndexedImage(env, info[0]);
     std::vector<Vec3b> palette = GetPalette(env, info[1]);
-    uchar *chars, *cols;
-    makeCCImage(*img, palette, &chars, &cols, device);
-    std::string retval = make32vid_cmp(chars, cols, palette, img->width / 2, img->height / 3);
-    delete[] chars;
-    delete[] cols;
-    return Napi::Buffer<uint8_t>::Copy(env, (const uint8_t*)retval.c_str(), retval.size());
+    if (env.IsExceptionPending()) return env.Null();
+    std::shared_ptr<const CCImage> cc = GetCCImage(*img, palette);
+    StageTimer timer(STAGE_ENCODE, (uint64_t)cc->width * cc->height * 6);
+    std::string retval = make32vid_cmp(cc->chars, cc->cols, palette, cc->width, cc->height);
+    return NewBuffer(env, retval);
 }
 
-Napi::Buffer<uint8_t> M_make32vid_ans(const Napi::CallbackInfo& info) {
+Napi::Value M_make32vid_ans(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
     if (info.Length() == 0) Napi::TypeError::New(env, "IndexedImage expected").ThrowAsJavaScriptException();
     else if (info.Length() == 1) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
     Mat1b * img = GetIndexedImage(env, info[0]);
     std::vector<Vec3b> palette = GetPalette(env, info[1]);
-    uchar *chars, *cols;
-    makeCCImage(*img, palette, &chars, &cols, device);
-    std::string retval = make32vid_ans(chars, cols, palette, img->width / 2, img->height / 3);
-    delete[] chars;
-    delete[] cols;
-    return Napi::Buffer<uint8_t>::Copy(env, (const uint8_t*)retval.c_str(), retval.size());
+    if (env.IsExceptionPending()) return env.Null();
+    std::shared_ptr<const CCImage> cc = GetCCImage(*img, palette);
+    StageTimer timer(STAGE_ENCODE, (uint64_t)cc->width * cc->height * 6);
+    std::string retval = make32vid_ans(cc->chars, cc->cols, palette, cc->width, cc->height);
+    return NewBuffer(env, retval);
 }
 
-void Cleanup() {
-    if (device != NULL) delete device;
+Napi::Value M_makeLabImageAsync(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (info.Length() < 1) Napi::TypeError::New(env, "RGBImage expected").ThrowAsJavaScriptException();
+    Mat * img = GetRGBImage(env, info[0]);
+    return QueueWorker<Mat*>(env, {info[0]}, [img]() {return new Mat(makeLabImage(*img, device));}, NewRGBImage);
 }
 
-#define addFunction(name) exports.Set(#name, Napi::Function::New(env, M_ ## name))
-Napi::Object InitAll(Napi::Env env, Napi::Object exports) {
-    addFunction(initOpenCL);
-    addFunction(makeRGBImage);
-    addFunction(makeLabImage);
-    addFunction(convertLabPalette);
-    addFunction(reducePalette_medianCut);
-    addFunction(reducePalette_kMeans);
-    addFunction(reducePalette_octree);
-    addFunction(thresholdImage);
-    addFunction(ditherImage_ordered);
-    addFunction(ditherImage_floydSteinberg);
-    addFunction(makeTable);
-    addFunction(makeNFP);
-    addFunction(makeLuaFile);
-    addFunction(makeRawImage);
-    addFunction(make32vid);
-    addFunction(make32vid_cmp);
-    addFunction(make32vid_ans);
+Napi::Value ReducePaletteAsync(const Napi::CallbackInfo& info, Quantizer reducer) {
+    Napi::Env env = info.Env();
+    PaletteSource src;
+    int numColors = 16;
+    if (!GetPaletteSource(info, &src, &numColors)) return env.Null();
+    return QueueWorker<std::vector<Vec3b>>(env, {info[0]}, [src, numColors, reducer]() {return ReducePalette(reducer, src, numColors);},
+        [packed = src.packed](Napi::Env env, std::vector<Vec3b>& palette) {return NewPaletteValue(env, palette, packed);});
+}
+
+bool GetResizeArgs(const Napi::CallbackInfo& info, bool fit, Mat ** img, ResizeOptions * opts) {
+    Napi::Env env = info.Env();
+    if (info.Length() < 1) {
+        Napi::TypeError::New(env, "RGBImage expected").ThrowAsJavaScriptException();
+        return false;
+    }
+    *img = GetRGBImage(env, info[0]);
+    if (env.IsExceptionPending()) return false;
+    if (info.Length() < 3 || !info[1].IsNumber() || !info[2].IsNumber() || info[1].As<Napi::Number>().Int32Value() < 1 || info[2].As<Napi::Number>().Int32Value() < 1) {
+        Napi::TypeError::New(env, "Positive number expected").ThrowAsJavaScriptException();
+        return false;
+    }
+    (fit ? opts->cols : opts->width) = info[1].As<Napi::Number>().Uint32Value();
+    (fit ? opts->rows : opts->height) = info[2].As<Napi::Number>().Uint32Value();
+    if (info.Length() > 3 && !info[3].IsUndefined() && !GetResizeFilter(info[3].ToString().Utf8Value(), &opts->filter)) {
+        Napi::TypeError::New(env, "Invalid option for filter").ThrowAsJavaScriptException();
+        return false;
+    }
+    return true;
+}
+
+Mat * ResizeImage(Mat& img, const ResizeOptions& opts) {
+    unsigned w, h;
+    opts.GetSize(img.width, img.height, &w, &h);
+    return ResizeImage(img, w, h, opts.filter);
+}
+
+Napi::Value ResizeImageSync(const Napi::CallbackInfo& info, bool fit) {
+    Napi::Env env = info.Env();
+    Mat * img;
+    ResizeOptions opts;
+    if (!GetResizeArgs(info, fit, &img, &opts)) return env.Null();
+    return NewRGBImage(env, ResizeImage(*img, opts));
+}
+
+Napi::Value ResizeImageAsync(const Napi::CallbackInfo& info, bool fit) {
+    Napi::Env env = info.Env();
+    Mat * img;
+    ResizeOptions opts;
+    if (!GetResizeArgs(info, fit, &img, &opts)) return env.Null();
+    return QueueWorker<Mat*>(env, {info[0]}, [img, opts]() {return ResizeImage(*img, opts);}, NewRGBImage);
+}
+
+Napi::Value M_resizeImage(const Napi::CallbackInfo& info) {return ResizeImageSync(info, false);}
+Napi::Value M_fitTerminal(const Napi::CallbackInfo& info) {return ResizeImageSync(info, true);}
+Napi::Value M_resizeImageAsync(const Napi::CallbackInfo& info) {return ResizeImageAsync(info, false);}
+Napi::Value M_fitTerminalAsync(const Napi::CallbackInfo& info) {return ResizeImageAsync(info, true);}
+
+Napi::Value M_makeColorHistogram(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (info.Length() < 1) {
+        Napi::TypeError::New(env, "RGBImage expected").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    Mat * img = GetRGBImage(env, info[0]);
+    SampleOptions opts;
+    if (env.IsExceptionPending() || !GetSampleOptions(env, info[1], &opts)) return env.Null();
+    return NewHistogram(env, new ColorHistogram(ColorHistogram::FromImage(*img, opts.bits ? opts.bits : 5, GetSampleStride(*img, opts))));
+}
+
+Napi::Value M_reducePalette_medianCutAsync(const Napi::CallbackInfo& info) {return ReducePaletteAsync(info, reducePalette_medianCut);}
+Napi::Value M_reducePalette_kMeansAsync(const Napi::CallbackInfo& info) {return ReducePaletteAsync(info, reducePalette_kMeans);}
+Napi::Value M_reducePalette_octreeAsync(const Napi::CallbackInfo& info) {return ReducePaletteAsync(info, reducePalette_octree);}
+
+Napi::Value DitherImageAsync(const Napi::CallbackInfo& info, Ditherer ditherer) {
+    Napi::Env env = info.Env();
+    if (info.Length() == 0) Napi::TypeError::New(env, "RGBImage expected").ThrowAsJavaScriptException();
+    else if (info.Length() == 1) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
+    Mat * img = GetRGBImage(env, info[0]);
+    std::vector<Vec3b> palette = GetPalette(env, info[1]);
+    unsigned threads = 0;
+    if (env.IsExceptionPending() || !GetThreadsOption(env, info.Length() > 2 ? info[2] : env.Undefined(), &threads)) return env.Null();
+    DitherOptions dither = GetDitherOptions(info.Length() > 2 ? info[2] : env.Undefined());
+    return QueueWorker<Mat1b*>(env, {info[0]}, [img, palette, ditherer, dither, threads]() {
+        ThreadLimit limit(threads);
+        return DitherToIndexed(*img, palette, ditherer, dither);
+    }, NewIndexedImage);
+}
+
+Napi::Value M_thresholdImageAsync(const Napi::CallbackInfo& info) {return DitherImageAsync(info, thresholdImage);}
+Napi::Value M_ditherImage_orderedAsync(const Napi::CallbackInfo& info) {return DitherImageAsync(info, ditherImage_ordered);}
+Napi::Value M_ditherImage_floydSteinbergAsync(const Napi::CallbackInfo& info) {return DitherImageAsync(info, ditherImage);}
+
+Napi::Value EncodeImageAsync(const Napi::CallbackInfo& info, std::function<std::string(const uchar*, const uchar*, const std::vector<Vec3b>&, int, int)> encoder, std::function<Napi::Value(Napi::Env, std::string&)> finish) {
+    Napi::Env env = info.Env();
+    if (info.Length() == 0) Napi::TypeError::New(env, "IndexedImage expected").ThrowAsJavaScriptException();
+    else if (info.Length() == 1) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
+    Mat1b * img = GetIndexedImage(env, info[0]);
+    std::vector<Vec3b> palette = GetPalette(env, info[1]);
+    if (env.IsExceptionPending()) return env.Null();
+    return QueueWorker<std::string>(env, {info[0]}, [img, palette, encoder]() {
+        std::shared_ptr<const CCImage> cc = GetCCImage(*img, palette);
+        StageTimer timer(STAGE_ENCODE, (uint64_t)cc->width * cc->height * 6);
+        return encoder(cc->chars, cc->cols, palette, cc->width, cc->height);
+    }, finish);
+}
+
+Napi::Value M_makeTableAsync(const Napi::CallbackInfo& info) {
+    bool compact = info.Length() >= 3 && info[2].ToBoolean(), embedPalette = info.Length() >= 4 && info[3].ToBoolean(), binary = info.Length() >= 5 && info[4].ToBoolean();
+    return EncodeImageAsync(info, [compact, embedPalette, binary](const uchar* chars, const uchar* cols, const std::vector<Vec3b>& palette, int width, int height) {
+        return makeTable(chars, cols, palette, width, height, compact, embedPalette, binary);
+    }, NewString);
+}
+
+Napi::Value M_makeNFPAsync(const Napi::CallbackInfo& info) {return EncodeImageAsync(info, makeNFP, NewString);}
+Napi::Value M_makeLuaFileAsync(const Napi::CallbackInfo& info) {return EncodeImageAsync(info, makeLuaFile, NewString);}
+Napi::Value M_makeRawImageAsync(const Napi::CallbackInfo& info) {return EncodeImageAsync(info, makeRawImage, NewString);}
+Napi::Value M_make32vidAsync(const Napi::CallbackInfo& info) {return EncodeImageAsync(info, make32vid, NewBuffer);}
+Napi::Value M_make32vid_cmpAsync(const Napi::CallbackInfo& info) {return EncodeImageAsync(info, make32vid_cmp, NewBuffer);}
+Napi::Value M_make32vid_ansAsync(const Napi::CallbackInfo& info) {return EncodeImageAsync(info, make32vid_ans, NewBuffer);}
+
+enum OutputFormat {
+    OUTPUT_TABLE,
+    OUTPUT_BIMG,
+    OUTPUT_NFP,
+    OUTPUT_LUA,
+    OUTPUT_RAW,
+    OUTPUT_32VID,
+    OUTPUT_32VID_CMP,
+    OUTPUT_32VID_ANS
+};
+
+bool GetOutputFormat(const std::string& str, OutputFormat * format) {
+    if (str == "table") *format = OUTPUT_TABLE;
+    else if (str == "bimg") *format = OUTPUT_BIMG;
+    else if (str == "nfp") *format = OUTPUT_NFP;
+    else if (str == "lua") *format = OUTPUT_LUA;
+    else if (str == "raw") *format = OUTPUT_RAW;
+    else if (str == "32vid") *format = OUTPUT_32VID;
+    else if (str == "32vid_cmp") *format = OUTPUT_32VID_CMP;
+    else if (str == "32vid_ans") *format = OUTPUT_32VID_ANS;
+    else return false;
+    return true;
+}
+
+// 32vid outputs are returned as Buffers, everything else as strings.
+bool IsBinaryOutput(OutputFormat format) {
+    return format == OUTPUT_32VID || format == OUTPUT_32VID_CMP || format == OUTPUT_32VID_ANS;
+}
+
+Napi::Value NewOutput(Napi::Env env, OutputFormat format, std::string& str) {
+    return IsBinaryOutput(format) ? NewBuffer(env, str) : NewString(env, str);
+}
+
+struct ConvertOptions {
+    bool lab = false;
+    Quantizer quantizer = reducePalette_medianCut;
+    Ditherer ditherer = ditherImage;
+    DitherOptions dither;
+    int numColors = 16;
+    OutputFormat output = OUTPUT_LUA;
+    bool compact = false;
+    bool embedPalette = false;
+    bool binary = false;
+    unsigned threads = 0;
+    SampleOptions sample;
+    ResizeOptions resize;
+};
+
+std::string EncodeOutput(OutputFormat format, const ConvertOptions& opts, const CCImage& cc) {
+    const uchar * chars = cc.chars, * cols = cc.cols;
+    const std::vector<Vec3b>& palette = cc.palette;
+    int width = cc.width, height = cc.height;
+    StageTimer timer(STAGE_ENCODE, (uint64_t)width * height * 6);
+    switch (format) {
+        case OUTPUT_TABLE: return makeTable(chars, cols, palette, width, height, opts.compact, opts.embedPalette, opts.binary);
+        case OUTPUT_BIMG: return makeTable(chars, cols, palette, width, height, opts.compact, true, opts.binary);
+        case OUTPUT_NFP: return makeNFP(chars, cols, palette, width, height);
+        case OUTPUT_LUA: return makeLuaFile(chars, cols, palette, width, height);
+        case OUTPUT_RAW: return makeRawImage(chars, cols, palette, width, height);
+        case OUTPUT_32VID: return make32vid(chars, cols, palette, width, height);
+        case OUTPUT_32VID_CMP: return make32vid_cmp(chars, cols, palette, width, height);
+        case OUTPUT_32VID_ANS: return make32vid_ans(chars, cols, palette, width, height);
+    }
+    return "";
+}
+
+bool GetConvertOptions(Napi::Env env, Napi::Value value, ConvertOptions * opts) {
+    if (value.IsUndefined()) return true;
+    if (!value.IsObject()) {
+        Napi::TypeError::New(env, "Object expected").ThrowAsJavaScriptException();
+        return false;
+    }
+    Napi::Object obj = value.As<Napi::Object>();
+    Napi::Value v = obj.Get("lab");
+    if (!v.IsUndefined()) opts->lab = v.ToBoolean();
+    v = obj.Get("quantizer");
+    if (!v.IsUndefined()) {
+        std::string str = v.ToString().Utf8Value();
+        if (str == "medianCut") opts->quantizer = reducePalette_medianCut;
+        else if (str == "kMeans") opts->quantizer = reducePalette_kMeans;
+        else if (str == "octree") opts->quantizer = reducePalette_octree;
+        else {
+            Napi::TypeError::New(env, "Invalid option for quantizer").ThrowAsJavaScriptException();
+            return false;
+        }
+    }
+    v = obj.Get("ditherer");
+    if (!v.IsUndefined()) {
+        std::string str = v.ToString().Utf8Value();
+        if (str == "threshold") opts->ditherer = thresholdImage;
+        else if (str == "ordered") opts->ditherer = ditherImage_ordered;
+        else if (str == "floydSteinberg") opts->ditherer = ditherImage;
+        else {
+            Napi::TypeError::New(env, "Invalid option for ditherer").ThrowAsJavaScriptException();
+            return false;
+        }
+    }
+    v = obj.Get("numColors");
+    if (!v.IsUndefined()) {
+        if (!v.IsNumber()) {
+            Napi::TypeError::New(env, "Number expected").ThrowAsJavaScriptException();
+            return false;
+        }
+        opts->numColors = v.As<Napi::Number>().Int32Value();
+    }
+    v = obj.Get("output");
+    if (!v.IsUndefined() && !GetOutputFormat(v.ToString().Utf8Value(), &opts->output)) {
+        Napi::TypeError::New(env, "Invalid option for output").ThrowAsJavaScriptException();
+        return false;
+    }
+    opts->compact = obj.Get("compact").ToBoolean();
+    opts->embedPalette = obj.Get("embedPalette").ToBoolean();
+    opts->binary = obj.Get("binary").ToBoolean();
+    opts->dither = GetDitherOptions(obj);
+    return GetSampleOptions(env, obj, &opts->sample) && GetResizeOptions(env, obj.Get("resize"), &opts->resize) && GetThreadsOption(env, obj, &opts->threads);
+}
+
+// Runs the whole conversion pipeline on pixel data without creating any
+// intermediate JS objects. Resizing and Lab conversion happen as the pixels
+// are read, so only one image is allocated, at the output size.
+std::string ConvertPixelsUncached(const PixelSource& src, const ConvertOptions& opts) {
+    PooledMat img(ReadPixels(src, opts.resize, opts.lab));
+    ImageMemory mem(*img);
+    std::vector<Vec3b> palette = ReducePalette(opts.quantizer, *img, opts.numColors, opts.sample);
+    PooledMat1b indexed(DitherToIndexed(*img, palette, opts.ditherer, opts.dither));
+    ImageMemory indexedMem(*indexed);
+    if (opts.lab) palette = ConvertLabPalette(palette);
+    return EncodeOutput(opts.output, opts, *MakeCCImage(*indexed, palette));
+}
+
+// Hashes pixel data and the options that affect the output (not threads,
+// which don't change the result).
+uint64_t HashConvert(const PixelSource& src, const ConvertOptions& opts) {
+    Hasher hash(2);
+    hash.Add(src.width);
+    hash.Add(src.height);
+    hash.Add(src.format);
+    for (unsigned y = 0; y < src.height; y++) hash.Add(src.data + y * src.stride, (size_t)src.width * PixelSize(src.format));
+    hash.Add(opts.lab);
+    hash.Add(opts.quantizer);
+    hash.Add(opts.ditherer);
+    hash.Add(opts.dither.wavefront);
+    hash.Add(opts.dither.serpentine);
+    hash.Add(opts.numColors);
+    hash.Add(opts.output);
+    hash.Add(opts.compact);
+    hash.Add(opts.embedPalette);
+    hash.Add(opts.binary);
+    hash.Add(opts.sample.stride);
+    hash.Add(opts.sample.maxSamples);
+    hash.Add(opts.sample.bits);
+    hash.Add(opts.resize.width);
+    hash.Add(opts.resize.height);
+    hash.Add(opts.resize.cols);
+    hash.Add(opts.resize.rows);
+    hash.Add(opts.resize.filter);
+    hash.Add(device != NULL);
+    return hash.Digest();
+}
+
+std::string ConvertPixels(const PixelSource& src, const ConvertOptions& opts) {
+    ThreadLimit limit(opts.threads);
+    if (!resultCache.Enabled()) return ConvertPixelsUncached(src, opts);
+    const uint64_t key = HashConvert(src, opts);
+    std::string retval;
+    if (resultCache.Get(key, &retval)) return retval;
+    retval = ConvertPixelsUncached(src, opts);
+    resultCache.Put(key, retval);
+    return retval;
+}
+
+bool GetConvertArgs(const Napi::CallbackInfo& info, PixelSource * src, ConvertOptions * opts) {
+    Napi::Env env = info.Env();
+    Napi::Value stride = env.Undefined();
+    if (info.Length() >= 5 && info[4].IsObject()) stride = info[4].As<Napi::Object>().Get("stride");
+    return GetPixelSource(info, info[0], stride, src) && GetConvertOptions(env, info[4], opts);
+}
+
+Napi::Value M_convert(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    PixelSource src;
+    ConvertOptions opts;
+    if (!GetConvertArgs(info, &src, &opts)) return env.Null();
+    std::string retval = ConvertPixels(src, opts);
+    return NewOutput(env, opts.output, retval);
+}
+
+Napi::Value M_convertAsync(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    PixelSource src;
+    ConvertOptions opts;
+    if (!GetConvertArgs(info, &src, &opts)) return env.Null();
+    return QueueWorker<std::string>(env, {info[0]}, [src, opts]() {
+        return ConvertPixels(src, opts);
+    }, [format = opts.output](Napi::Env env, std::string& output) {return NewOutput(env, format, output);});
+}
+
+// Converts a batch of frames, running up to `window` frames at once. Threads
+// take the next frame as soon as they finish one, so only `window` frames'
+// intermediate images are alive at any time, and outputs stay in input order.
+std::vector<std::string> ConvertFrames(const std::vector<PixelSource>& frames, const ConvertOptions& opts, unsigned window) {
+    unsigned threads = opts.threads ? opts.threads : pool.Size() + 1;
+    if (window == 0) window = threads;
+    ConvertOptions frameOpts = opts;
+    frameOpts.threads = std::max(threads / window, 1U);
+    std::vector<std::string> retval(frames.size());
+    std::mutex mutex;
+    std::string error;
+    pool.ParallelFor(frames.size(), std::min(window, threads), [&](unsigned i) {
+        try {
+            retval[i] = ConvertPixels(frames[i], frameOpts);
+        } catch (const std::exception &e) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (error.empty()) error = "Frame " + std::to_string(i) + ": " + e.what();
+        }
+    });
+    if (!error.empty()) throw std::runtime_error(error);
+    return retval;
+}
+
+// Also returns each frame's buffer, which async callers have to pin: the array
+// only holds them for as long as JS doesn't replace its elements.
+bool GetFramesArgs(const Napi::CallbackInfo& info, std::vector<PixelSource> * frames, ConvertOptions * opts, unsigned * window, std::vector<Napi::Value> * buffers = NULL) {
+    Napi::Env env = info.Env();
+    if (info.Length() == 0 || !info[0].IsArray()) {
+        Napi::TypeError::New(env, "Array expected").ThrowAsJavaScriptException();
+        return false;
+    }
+    Napi::Value stride = env.Undefined(), win = env.Undefined();
+    if (info.Length() >= 5 && info[4].IsObject()) {
+        stride = info[4].As<Napi::Object>().Get("stride");
+        win = info[4].As<Napi::Object>().Get("window");
+    }
+    if (!GetConvertOptions(env, info[4], opts)) return false;
+    *window = 0;
+    if (!win.IsUndefined()) {
+        if (!win.IsNumber() || win.As<Napi::Number>().Int32Value() < 1) {
+            Napi::TypeError::New(env, "Invalid option for window").ThrowAsJavaScriptException();
+            return false;
+        }
+        *window = win.As<Napi::Number>().Uint32Value();
+    }
+    Napi::Array array = info[0].As<Napi::Array>();
+    frames->resize(array.Length());
+    for (uint32_t i = 0; i < array.Length(); i++) {
+        Napi::Value frame = array.Get(i);
+        if (!GetPixelSource(info, frame, stride, &(*frames)[i])) return false;
+        if (buffers) buffers->push_back(frame);
+    }
+    return true;
+}
+
+Napi::Value NewFrameOutputs(Napi::Env env, OutputFormat format, std::vector<std::string>& outputs) {
+    Napi::Array retval = Napi::Array::New(env, outputs.size());
+    for (size_t i = 0; i < outputs.size(); i++) retval.Set(i, NewOutput(env, format, outputs[i]));
+    return retval;
+}
+
+Napi::Value M_convertFrames(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    std::vector<PixelSource> frames;
+    ConvertOptions opts;
+    unsigned window;
+    if (!GetFramesArgs(info, &frames, &opts, &window)) return env.Null();
+    std::vector<std::string> outputs;
+    try {
+        outputs = ConvertFrames(frames, opts, window);
+    } catch (const std::exception &e) {
+        Napi::Error::New(env, e.what()).ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    return NewFrameOutputs(env, opts.output, outputs);
+}
+
+Napi::Value M_convertFramesAsync(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    std::vector<PixelSource> frames;
+    ConvertOptions opts;
+    unsigned window;
+    std::vector<Napi::Value> buffers;
+    if (!GetFramesArgs(info, &frames, &opts, &window, &buffers)) return env.Null();
+    OutputFormat format = opts.output;
+    return QueueWorker<std::vector<std::string>>(env, buffers, [frames, opts, window]() {
+        return ConvertFrames(frames, opts, window);
+    }, [format](Napi::Env env, std::vector<std::string>& outputs) {return NewFrameOutputs(env, format, outputs);});
+}
+
+// Layout of a wall of monitors. Each tile is one monitor, cols x rows
+// characters in size (0 to split the image evenly), and tiles can share one
+// palette or each have their own.
+struct WallOptions {
+    unsigned tileCols = 1, tileRows = 1;
+    unsigned cols = 0, rows = 0;
+    bool tilePalettes = false;
+    ResizeFilter filter = RESIZE_BOX;
+};
+
+// Copies the part of an image starting at (x, y) into a smaller image.
+template<typename Image>
+void CopyRegion(Image& src, Image& dst, unsigned x, unsigned y) {
+    for (unsigned row = 0; row < dst.height; row++)
+        memcpy(&dst[row][0], &src[y + row][x], dst.width * sizeof(src[0][0]));
+}
+
+// Converts an image for a wall of monitors, returning one output per tile in
+// row-major order. The image is scaled to fill the wall exactly. A shared
+// palette is reduced from the whole image, and the whole image is dithered at
+// once, so dithering error carries across
+// tile borders and there are no seams; the per-tile CC planes and encoding
+// then run in parallel. With per-tile palettes, each tile is converted on its
+// own, all in parallel.
+std::vector<std::string> ConvertWall(Mat& src, const ConvertOptions& opts, const WallOptions& wall) {
+    unsigned cols = wall.cols ? wall.cols : src.width / 2 / wall.tileCols, rows = wall.rows ? wall.rows : src.height / 3 / wall.tileRows;
+    if (cols == 0 || rows == 0) throw std::range_error("Image is too small for the wall");
+    const unsigned tileWidth = cols * 2, tileHeight = rows * 3, tiles = wall.tileCols * wall.tileRows;
+    const unsigned width = tileWidth * wall.tileCols, height = tileHeight * wall.tileRows;
+    unsigned threads = opts.threads ? opts.threads : pool.Size() + 1;
+    ThreadLimit limit(threads);
+    PooledMat img;
+    if (src.width == width && src.height == height) {
+        if (opts.lab) img.reset(MakeLabImage(src));
+    } else {
+        img.reset(ResizeImage(src, width, height, wall.filter));
+        if (opts.lab) img.reset(MakeLabImage(*img));
+    }
+    Mat& full = img ? *img : src;
+    std::vector<std::string> retval(tiles);
+    std::vector<Vec3b> palette;
+    PooledMat1b indexed;
+    if (!wall.tilePalettes) {
+        palette = ReducePalette(opts.quantizer, full, opts.numColors, opts.sample);
+        indexed.reset(DitherToIndexed(full, palette, opts.ditherer, opts.dither));
+        if (opts.lab) palette = ConvertLabPalette(palette);
+    }
+    std::mutex mutex;
+    std::string error;
+    const unsigned tileThreads = std::max(threads / tiles, 1U);
+    pool.ParallelFor(tiles, threads, [&](unsigned i) {
+        ThreadLimit tileLimit(tileThreads);
+        const unsigned x = (i % wall.tileCols) * tileWidth, y = (i / wall.tileCols) * tileHeight;
+        try {
+            PooledMat1b tile;
+            std::vector<Vec3b> tilePalette = palette;
+            if (wall.tilePalettes) {
+                PooledMat pixels(imagePool.NewMat(tileWidth, tileHeight));
+                CopyRegion(full, *pixels, x, y);
+                tilePalette = ReducePalette(opts.quantizer, *pixels, opts.numColors, opts.sample);
+                tile.reset(DitherToIndexed(*pixels, tilePalette, opts.ditherer, opts.dither));
+                if (opts.lab) tilePalette = ConvertLabPalette(tilePalette);
+            } else {
+                tile.reset(imagePool.NewMat1b(tileWidth, tileHeight));
+                CopyRegion(*indexed, *tile, x, y);
+            }
+            retval[i] = EncodeOutput(opts.output, opts, *MakeCCImage(*tile, tilePalette));
+        } catch (const std::exception &e) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (error.empty()) error = "Tile " + std::to_string(i) + ": " + e.what();
+        }
+    });
+    if (!error.empty()) throw std::runtime_error(error);
+    return retval;
+}
+
+bool GetWallArgs(const Napi::CallbackInfo& info, Mat ** img, ConvertOptions * opts, WallOptions * wall) {
+    Napi::Env env = info.Env();
+    if (info.Length() == 0) Napi::TypeError::New(env, "RGBImage expected").ThrowAsJavaScriptException();
+    else if (info.Length() == 1 || !info[1].IsObject()) Napi::TypeError::New(env, "Object expected").ThrowAsJavaScriptException();
+    if (env.IsExceptionPending()) return false;
+    *img = GetRGBImage(env, info[0]);
+    if (env.IsExceptionPending() || !GetConvertOptions(env, info[1], opts)) return false;
+    Napi::Object obj = info[1].As<Napi::Object>();
+    const char * names[2] = {"tileCols", "tileRows"};
+    unsigned * fields[2] = {&wall->tileCols, &wall->tileRows};
+    for (int i = 0; i < 2; i++) {
+        Napi::Value v = obj.Get(names[i]);
+        if (!v.IsNumber() || v.As<Napi::Number>().Int32Value() < 1) {
+            Napi::TypeError::New(env, std::string("Invalid option for ") + names[i]).ThrowAsJavaScriptException();
+            return false;
+        }
+        *fields[i] = v.As<Napi::Number>().Uint32Value();
+    }
+    Napi::Value v = obj.Get("cellsPerTile");
+    if (!v.IsUndefined()) {
+        Napi::Value c = v.IsObject() ? v.As<Napi::Object>().Get("cols") : env.Undefined(), r = v.IsObject() ? v.As<Napi::Object>().Get("rows") : env.Undefined();
+        if (!c.IsNumber() || !r.IsNumber() || c.As<Napi::Number>().Int32Value() < 1 || r.As<Napi::Number>().Int32Value() < 1) {
+            Napi::TypeError::New(env, "Invalid option for cellsPerTile").ThrowAsJavaScriptException();
+            return false;
+        }
+        wall->cols = c.As<Napi::Number>().Uint32Value();
+        wall->rows = r.As<Napi::Number>().Uint32Value();
+    }
+    v = obj.Get("palette");
+    if (!v.IsUndefined()) {
+        std::string str = v.ToString().Utf8Value();
+        if (str == "shared") wall->tilePalettes = false;
+        else if (str == "tile") wall->tilePalettes = true;
+        else {
+            Napi::TypeError::New(env, "Invalid option for palette").ThrowAsJavaScriptException();
+            return false;
+        }
+    }
+    v = obj.Get("filter");
+    if (!v.IsUndefined() && !GetResizeFilter(v.ToString().Utf8Value(), &wall->filter)) {
+        Napi::TypeError::New(env, "Invalid option for filter").ThrowAsJavaScriptException();
+        return false;
+    }
+    return true;
+}
+
+Napi::Value M_convertWall(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Mat * img;
+    ConvertOptions opts;
+    WallOptions wall;
+    if (!GetWallArgs(info, &img, &opts, &wall)) return env.Null();
+    std::vector<std::string> outputs;
+    try {
+        outputs = ConvertWall(*img, opts, wall);
+    } catch (const std::exception &e) {
+        Napi::Error::New(env, e.what()).ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    return NewFrameOutputs(env, opts.output, outputs);
+}
+
+Napi::Value M_convertWallAsync(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Mat * img;
+    ConvertOptions opts;
+    WallOptions wall;
+    if (!GetWallArgs(info, &img, &opts, &wall)) return env.Null();
+    OutputFormat format = opts.output;
+    return QueueWorker<std::vector<std::string>>(env, {info[0]}, [img, opts, wall]() {
+        return ConvertWall(*img, opts, wall);
+    }, [format](Napi::Env env, std::vector<std::string>& outputs) {return NewFrameOutputs(env, format, outputs);});
+}
+
+std::vector<std::string> EncodeOutputs(const CCImage& cc, const std::vector<OutputFormat>& formats, const ConvertOptions& opts, bool parallel) {
+    std::vector<std::string> retval(formats.size());
+    ThreadLimit limit(opts.threads);
+    unsigned threads = !parallel ? 1 : threadLimit ? threadLimit : pool.Size() + 1;
+    pool.ParallelFor(formats.size(), threads, [&retval, &formats, &opts, &cc](unsigned i) {
+        retval[i] = EncodeOutput(formats[i], opts, cc);
+    });
+    return retval;
+}
+
+bool GetOutputsArgs(const Napi::CallbackInfo& info, Mat1b ** img, std::vector<Vec3b> * palette, std::vector<OutputFormat> * formats, ConvertOptions * opts, bool * parallel) {
+    Napi::Env env = info.Env();
+    if (info.Length() == 0) Napi::TypeError::New(env, "IndexedImage expected").ThrowAsJavaScriptException();
+    else if (info.Length() == 1) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
+    else if (info.Length() == 2 || !info[2].IsArray()) Napi::TypeError::New(env, "Array expected").ThrowAsJavaScriptException();
+    if (env.IsExceptionPending()) return false;
+    *img = GetIndexedImage(env, info[0]);
+    *palette = GetPalette(env, info[1]);
+    if (env.IsExceptionPending()) return false;
+    Napi::Array array = info[2].As<Napi::Array>();
+    for (uint32_t i = 0; i < array.Length(); i++) {
+        OutputFormat format;
+        if (!GetOutputFormat(array.Get(i).ToString().Utf8Value(), &format)) {
+            Napi::TypeError::New(env, "Invalid output format").ThrowAsJavaScriptException();
+            return false;
+        }
+        formats->push_back(format);
+    }
+    if (!GetConvertOptions(env, info[3], opts)) return false;
+    *parallel = info[3].IsObject() && info[3].As<Napi::Object>().Get("parallel").ToBoolean();
+    return !env.IsExceptionPending();
+}
+
+Napi::Array NewOutputs(Napi::Env env, const std::vector<OutputFormat>& formats, std::vector<std::string>& outputs) {
+    Napi::Array retval = Napi::Array::New(env, outputs.size());
+    for (size_t i = 0; i < outputs.size(); i++) retval.Set(i, NewOutput(env, formats[i], outputs[i]));
+    return retval;
+}
+
+Napi::Value M_makeOutputs(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Mat1b * img;
+    std::vector<Vec3b> palette;
+    std::vector<OutputFormat> formats;
+    ConvertOptions opts;
+    bool parallel;
+    if (!GetOutputsArgs(info, &img, &palette, &formats, &opts, &parallel)) return env.Null();
+    std::vector<std::string> outputs = EncodeOutputs(*GetCCImage(*img, palette), formats, opts, parallel);
+    return NewOutputs(env, formats, outputs);
+}
+
+Napi::Value M_makeOutputsAsync(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Mat1b * img;
+    std::vector<Vec3b> palette;
+    std::vector<OutputFormat> formats;
+    ConvertOptions opts;
+    bool parallel;
+    if (!GetOutputsArgs(info, &img, &palette, &formats, &opts, &parallel)) return env.Null();
+    return QueueWorker<std::vector<std::string>>(env, {info[0]}, [img, palette, formats, opts, parallel]() {
+        return EncodeOutputs(*GetCCImage(*img, palette), formats, opts, parallel);
+    }, [formats](Napi::Env env, std::vector<std::string>& outputs) {return NewOutputs(env, formats, outputs);});
+}
+
+// Part of a caller-supplied buffer to write an output into.
+struct OutputTarget {
+    uint8_t * data;
+    size_t length;
+};
+
+bool GetOutputIntoArgs(const Napi::CallbackInfo& info, Mat1b ** img, std::vector<Vec3b> * palette, OutputFormat * format, OutputTarget * target, ConvertOptions * opts) {
+    Napi::Env env = info.Env();
+    if (info.Length() == 0) Napi::TypeError::New(env, "IndexedImage expected").ThrowAsJavaScriptException();
+    else if (info.Length() == 1) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
+    else if (info.Length() == 2) Napi::TypeError::New(env, "Output format expected").ThrowAsJavaScriptException();
+    else if (info.Length() == 3 || !(info[3].IsArrayBuffer() || (info[3].IsTypedArray() && info[3].As<Napi::TypedArray>().TypedArrayType() == napi_uint8_array)))
+        Napi::TypeError::New(env, "Buffer expected").ThrowAsJavaScriptException();
+    if (env.IsExceptionPending()) return false;
+    *img = GetIndexedImage(env, info[0]);
+    *palette = GetPalette(env, info[1]);
+    if (env.IsExceptionPending()) return false;
+    if (!GetOutputFormat(info[2].ToString().Utf8Value(), format)) {
+        Napi::TypeError::New(env, "Invalid output format").ThrowAsJavaScriptException();
+        return false;
+    }
+    uint8_t * data;
+    size_t length;
+    if (info[3].IsArrayBuffer()) {
+        Napi::ArrayBuffer array = info[3].As<Napi::ArrayBuffer>();
+        data = (uint8_t*)array.Data();
+        length = array.ByteLength();
+    } else {
+        Napi::TypedArray array = info[3].As<Napi::TypedArray>();
+        data = (uint8_t*)array.ArrayBuffer().Data() + array.ByteOffset();
+        length = array.ByteLength();
+    }
+    size_t offset = 0;
+    if (info.Length() > 4 && !info[4].IsUndefined()) {
+        if (!info[4].IsNumber() || info[4].As<Napi::Number>().DoubleValue() < 0 || info[4].As<Napi::Number>().DoubleValue() > length) {
+            Napi::RangeError::New(env, "Offset is out of range").ThrowAsJavaScriptException();
+            return false;
+        }
+        offset = info[4].As<Napi::Number>().Int64Value();
+    }
+    target->data = data + offset;
+    target->length = length - offset;
+    return GetConvertOptions(env, info[5], opts);
+}
+
+// Copies an encoded output into the target and returns its size. Nothing is
+// written if the output doesn't fit. sanjuuni's encoders only return strings,
+// so this is one native copy; there's no JS string or Buffer in between.
+size_t WriteOutput(const std::string& output, const OutputTarget& target) {
+    if (output.size() > target.length)
+        throw std::range_error("Output needs " + std::to_string(output.size()) + " bytes, but only " + std::to_string(target.length) + " are available");
+    memcpy(target.data, output.data(), output.size());
+    return output.size();
+}
+
+Napi::Value M_makeOutputInto(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Mat1b * img;
+    std::vector<Vec3b> palette;
+    OutputFormat format;
+    OutputTarget target;
+    ConvertOptions opts;
+    if (!GetOutputIntoArgs(info, &img, &palette, &format, &target, &opts)) return env.Null();
+    try {
+        return Napi::Number::New(env, WriteOutput(EncodeOutput(format, opts, *GetCCImage(*img, palette)), target));
+    } catch (const std::range_error& e) {
+        Napi::RangeError::New(env, e.what()).ThrowAsJavaScriptException();
+        return env.Null();
+    }
+}
+
+Napi::Value M_makeOutputIntoAsync(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Mat1b * img;
+    std::vector<Vec3b> palette;
+    OutputFormat format;
+    OutputTarget target;
+    ConvertOptions opts;
+    if (!GetOutputIntoArgs(info, &img, &palette, &format, &target, &opts)) return env.Null();
+    return QueueWorker<size_t>(env, {info[0], info[3]}, [img, palette, format, target, opts]() {
+        return WriteOutput(EncodeOutput(format, opts, *GetCCImage(*img, palette)), target);
+    }, [](Napi::Env env, size_t& size) {return Napi::Number::New(env, size);});
+}
+
+// 32vid header flags for each compression mode.
+uint16_t Get32vidFlags(OutputFormat format) {
+    switch (format) {
+        // make32vid_cmp writes its Huffman code lengths as 5-bit fields
+        case OUTPUT_32VID_CMP: return VID32_FLAG_VIDEO_COMPRESSION_CUSTOM | VID32_FLAG_VIDEO_5BIT_CODES;
+        case OUTPUT_32VID_ANS: return VID32_FLAG_VIDEO_COMPRESSION_ANS;
+        default: return VID32_FLAG_VIDEO_COMPRESSION_NONE;
+    }
+}
+
+void WriteLE(std::string& str, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) str += (char)((value >> (i * 8)) & 0xFF);
+}
+
+// Encodes a sequence of frames into a 32vid stream with a single video chunk.
+// Each frame can be written out as soon as it's encoded; the chunk's size and
+// frame count are only known once the video is finished, so end() returns the
+// final header to be written back over the one at the start of the output.
+// 32vid has no layout without sizes up front, so output going to a sink that
+// can't seek has to hold the frames back until the end instead (VideoStream's
+// buffered option).
+class VideoEncoder : public Napi::ObjectWrap<VideoEncoder> {
+public:
+    static Napi::Function Init(Napi::Env env) {
+        return DefineClass(env, "VideoEncoder", {
+            InstanceMethod("push", &VideoEncoder::Push),
+            InstanceMethod("pushAsync", &VideoEncoder::PushAsync),
+            InstanceMethod("end", &VideoEncoder::End),
+            InstanceAccessor("header", &VideoEncoder::GetHeader, NULL),
+            InstanceAccessor("frames", &VideoEncoder::GetFrames, NULL)
+        });
+    }
+
+    VideoEncoder(const Napi::CallbackInfo& info): Napi::ObjectWrap<VideoEncoder>(info) {
+        Napi::Env env = info.Env();
+        if (info.Length() == 0 || info[0].IsUndefined()) return;
+        if (!info[0].IsObject()) {
+            Napi::TypeError::New(env, "Object expected").ThrowAsJavaScriptException();
+            return;
+        }
+        Napi::Object opts = info[0].As<Napi::Object>();
+        Napi::Value v = opts.Get("fps");
+        if (!v.IsUndefined()) {
+            if (!v.IsNumber() || v.As<Napi::Number>().Uint32Value() == 0 || v.As<Napi::Number>().Uint32Value() > 255) {
+                Napi::RangeError::New(env, "Frame rate must be between 1 and 255").ThrowAsJavaScriptException();
+                return;
+            }
+            fps = v.As<Napi::Number>().Uint32Value();
+        }
+        v = opts.Get("compression");
+        if (!v.IsUndefined()) {
+            std::string str = v.ToString().Utf8Value();
+            if (str == "none") format = OUTPUT_32VID;
+            else if (str == "custom") format = OUTPUT_32VID_CMP;
+            else if (str == "ans") format = OUTPUT_32VID_ANS;
+            else Napi::TypeError::New(env, "Invalid option for compression").ThrowAsJavaScriptException();
+        }
+    }
+
+private:
+    OutputFormat format = OUTPUT_32VID_ANS;
+    unsigned fps = 20;
+    unsigned width = 0, height = 0;
+    unsigned frames = 0;
+    uint64_t size = 0;
+    bool sized = false, ended = false;
+
+    // File header followed by the video chunk header.
+    std::string MakeHeader() {
+        std::string retval = "32VD";
+        WriteLE(retval, width, 2);
+        WriteLE(retval, height, 2);
+        WriteLE(retval, fps, 1);
+        WriteLE(retval, 1, 1);
+        WriteLE(retval, Get32vidFlags(format), 2);
+        WriteLE(retval, size, 4);
+        WriteLE(retval, frames, 4);
+        WriteLE(retval, 0, 1);
+        return retval;
+    }
+
+    // Counts an encoded frame towards the header, setting the video's
+    // dimensions from the first one. Frames that fail to encode or don't fit
+    // in the chunk aren't counted, and don't set the dimensions. Frames pushed
+    // asynchronously before the first one finishes are checked again here.
+    Napi::Value AddFrameData(Napi::Env env, std::string& data, unsigned frameWidth, unsigned frameHeight) {
+        if (sized && (frameWidth != width || frameHeight != height)) {
+            Napi::RangeError::New(env, "Frame size does not match video").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        if (size + data.size() > UINT32_MAX) {
+            Napi::RangeError::New(env, "Video is too large for a 32vid chunk").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        width = frameWidth;
+        height = frameHeight;
+        sized = true;
+        size += data.size();
+        frames++;
+        return NewBuffer(env, data);
+    }
+
+    // Checks a frame against the video's dimensions, once the first frame has
+    // set them.
+    bool AddFrame(const Napi::CallbackInfo& info, Mat1b ** img, std::vector<Vec3b> * palette) {
+        Napi::Env env = info.Env();
+        if (ended) Napi::Error::New(env, "Video has already ended").ThrowAsJavaScriptException();
+        else if (info.Length() == 0) Napi::TypeError::New(env, "IndexedImage expected").ThrowAsJavaScriptException();
+        else if (info.Length() == 1) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
+        if (env.IsExceptionPending()) return false;
+        *img = GetIndexedImage(env, info[0]);
+        *palette = GetPalette(env, info[1]);
+        if (env.IsExceptionPending()) return false;
+        if (sized && ((*img)->width / 2 != width || (*img)->height / 3 != height)) {
+            Napi::RangeError::New(env, "Frame size does not match video").ThrowAsJavaScriptException();
+            return false;
+        }
+        return true;
+    }
+
+    Napi::Value Push(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        Mat1b * img;
+        std::vector<Vec3b> palette;
+        if (!AddFrame(info, &img, &palette)) return env.Null();
+        std::string data;
+        try {
+            data = EncodeOutput(format, ConvertOptions(), *GetCCImage(*img, palette));
+        } catch (const std::exception &e) {
+            Napi::Error::New(env, e.what()).ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        return AddFrameData(env, data, img->width / 2, img->height / 3);
+    }
+
+    Napi::Value PushAsync(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        Mat1b * img;
+        std::vector<Vec3b> palette;
+        if (!AddFrame(info, &img, &palette)) return env.Null();
+        OutputFormat format = this->format;
+        const unsigned frameWidth = img->width / 2, frameHeight = img->height / 3;
+        return QueueWorker<std::string>(env, {info[0], info.This()}, [img, palette, format]() {
+            return EncodeOutput(format, ConvertOptions(), *GetCCImage(*img, palette));
+        }, [this, frameWidth, frameHeight](Napi::Env env, std::string& data) {return AddFrameData(env, data, frameWidth, frameHeight);});
+    }
+
+    Napi::Value End(const Napi::CallbackInfo& info) {
+        ended = true;
+        return GetHeader(info);
+    }
+
+    Napi::Value GetHeader(const Napi::CallbackInfo& info) {
+        std::string header = MakeHeader();
+        return NewBuffer(info.Env(), header);
+    }
+    Napi::Value GetFrames(const Napi::CallbackInfo& info) {return Napi::Number::New(info.Env(), frames);}
+};
+
+// Runs k-means over the bins of a histogram, weighted by their pixel counts,
+// starting from the specified centroids. Stops once no centroid moves further
+// than the tolerance, or after the maximum number of iterations.
+std::vector<Vec3b> KMeansFromHistogram(const ColorHistogram& hist, const std::vector<Vec3b>& seed, unsigned maxIterations, double tolerance, unsigned * iterations) {
+    struct Point {double c[3]; double weight;};
+    std::vector<Point> points;
+    for (size_t i = 0; i < hist.count.size(); i++) {
+        if (hist.count[i] == 0) continue;
+        double n = hist.count[i];
+        points.push_back({{hist.sum[i*3] / n, hist.sum[i*3+1] / n, hist.sum[i*3+2] / n}, n});
+    }
+    std::vector<std::array<double, 3>> centroids(seed.size());
+    for (size_t i = 0; i < seed.size(); i++) centroids[i] = {(double)seed[i][0], (double)seed[i][1], (double)seed[i][2]};
+    *iterations = 0;
+    while (*iterations < maxIterations) {
+        std::vector<std::array<double, 4>> sums(centroids.size(), {0, 0, 0, 0});
+        for (const Point& p : points) {
+            size_t best = 0;
+            double bestDist = INFINITY;
+            for (size_t i = 0; i < centroids.size(); i++) {
+                double dx = p.c[0] - centroids[i][0], dy = p.c[1] - centroids[i][1], dz = p.c[2] - centroids[i][2];
+                double dist = dx*dx + dy*dy + dz*dz;
+                if (dist < bestDist) {best = i; bestDist = dist;}
+            }
+            for (int j = 0; j < 3; j++) sums[best][j] += p.c[j] * p.weight;
+            sums[best][3] += p.weight;
+        }
+        double moved = 0;
+        for (size_t i = 0; i < centroids.size(); i++) {
+            if (sums[i][3] == 0) continue;
+            for (int j = 0; j < 3; j++) {
+                double c = sums[i][j] / sums[i][3];
+                moved = std::max(moved, std::abs(c - centroids[i][j]));
+                centroids[i][j] = c;
+            }
+        }
+        (*iterations)++;
+        if (moved <= tolerance) break;
+    }
+    std::vector<Vec3b> retval(centroids.size());
+    for (size_t i = 0; i < centroids.size(); i++)
+        for (int j = 0; j < 3; j++) retval[i][j] = (uchar)std::min(std::max(std::round(centroids[i][j]), 0.0), 255.0);
+    return retval;
+}
+
+// Generates palettes for consecutive video frames. Frames whose histogram is
+// close to the one the current palette was made from reuse it outright; frames
+// with moderate changes refine it with a few k-means iterations; and scene
+// changes get a full k-means palette from scratch.
+// Reads a number option, leaving *value alone if it isn't set. Numbers must be
+// finite and between min and max (by default, non-negative).
+bool GetNumberOption(Napi::Env env, Napi::Object opts, const char * name, double * value, double min = 0, double max = INFINITY) {
+    Napi::Value v = opts.Get(name);
+    if (v.IsUndefined()) return true;
+    if (!v.IsNumber()) {
+        Napi::TypeError::New(env, std::string("Invalid option for ") + name).ThrowAsJavaScriptException();
+        return false;
+    }
+    double n = v.As<Napi::Number>().DoubleValue();
+    if (!std::isfinite(n) || n < min || n > max) {
+        Napi::RangeError::New(env, std::string("Option ") + name + " is out of range").ThrowAsJavaScriptException();
+        return false;
+    }
+    *value = n;
+    return true;
+}
+
+class PaletteGenerator : public Napi::ObjectWrap<PaletteGenerator> {
+public:
+    static Napi::Function Init(Napi::Env env) {
+        return DefineClass(env, "PaletteGenerator", {
+            InstanceMethod("generate", &PaletteGenerator::Generate),
+            InstanceMethod("generateAsync", &PaletteGenerator::GenerateAsync),
+            InstanceMethod("reset", &PaletteGenerator::Reset)
+        });
+    }
+
+    PaletteGenerator(const Napi::CallbackInfo& info): Napi::ObjectWrap<PaletteGenerator>(info) {
+        Napi::Env env = info.Env();
+        if (info.Length() == 0 || info[0].IsUndefined()) return;
+        if (!info[0].IsObject()) {
+            Napi::TypeError::New(env, "Object expected").ThrowAsJavaScriptException();
+            return;
+        }
+        Napi::Object opts = info[0].As<Napi::Object>();
+        double colors = numColors, iterations = maxIterations, histogramBits = bits;
+        if (!GetNumberOption(env, opts, "numColors", &colors, 1, 256) ||
+            !GetNumberOption(env, opts, "reuseThreshold", &reuseThreshold) ||
+            !GetNumberOption(env, opts, "sceneThreshold", &sceneThreshold) ||
+            !GetNumberOption(env, opts, "maxIterations", &iterations) ||
+            !GetNumberOption(env, opts, "tolerance", &tolerance) ||
+            !GetNumberOption(env, opts, "histogramBits", &histogramBits, 1, 6)) return;
+        numColors = colors;
+        maxIterations = iterations;
+        bits = histogramBits;
+    }
+
+private:
+    struct Result {
+        std::vector<Vec3b> palette;
+        const char * mode;
+        unsigned iterations;
+        double distance;
+    };
+
+    unsigned numColors = 16;
+    double reuseThreshold = 0.02;
+    double sceneThreshold = 0.5;
+    unsigned maxIterations = 8;
+    double tolerance = 0.5;
+    unsigned bits = 5;
+    std::vector<Vec3b> palette;
+    ColorHistogram hist;
+    std::mutex mutex;
+
+    Result Run(Mat& img) {
+        std::lock_guard<std::mutex> lock(mutex);
+        StageTimer timer(STAGE_QUANTIZE, (uint64_t)img.width * img.height);
+        ColorHistogram current = ColorHistogram::FromImage(img, bits);
+        Result retval;
+        retval.iterations = 0;
+        retval.distance = palette.empty() ? 1.0 : current.Distance(hist);
+        if (palette.empty() || retval.distance >= sceneThreshold) {
+            palette = reducePalette_kMeans(img, numColors, device);
+            retval.mode = "cold";
+        } else if (retval.distance < reuseThreshold) {
+            // keep the old histogram, so slow drift still triggers an update
+            retval.palette = palette;
+            retval.mode = "reused";
+            return retval;
+        } else {
+            palette = KMeansFromHistogram(current, palette, maxIterations, tolerance, &retval.iterations);
+            retval.mode = "warm";
+        }
+        hist = std::move(current);
+        retval.palette = palette;
+        return retval;
+    }
+
+    static Napi::Value NewResult(Napi::Env env, const Result& result) {
+        Napi::Object retval = Napi::Object::New(env);
+        retval.Set("palette", NewPalette(env, result.palette));
+        retval.Set("mode", Napi::String::New(env, result.mode));
+        retval.Set("iterations", Napi::Number::New(env, result.iterations));
+        retval.Set("distance", Napi::Number::New(env, result.distance));
+        return retval;
+    }
+
+    Napi::Value Generate(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        if (info.Length() < 1) Napi::TypeError::New(env, "RGBImage expected").ThrowAsJavaScriptException();
+        Mat * img = GetRGBImage(env, info[0]);
+        if (env.IsExceptionPending()) return env.Null();
+        return NewResult(env, Run(*img));
+    }
+
+    Napi::Value GenerateAsync(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        if (info.Length() < 1) Napi::TypeError::New(env, "RGBImage expected").ThrowAsJavaScriptException();
+        Mat * img = GetRGBImage(env, info[0]);
+        return QueueWorker<Result>(env, {info[0], info.This()}, [this, img]() {return Run(*img);}, NewResult);
+    }
+
+    Napi::Value Reset(const Napi::CallbackInfo& info) {
+        std::lock_guard<std::mutex> lock(mutex);
+        palette.clear();
+        return info.Env().Undefined();
+    }
+};
+
+// Encodes frames as deltas against the previous frame's CC planes, holding only
+// the runs of character cells that changed. Frames with too many changes, a
+// different size or a different palette are encoded as full keyframes instead.
+//
+// Delta format (little-endian):
+//   uint16 width, uint16 height (in characters)
+//   uint32 number of runs
+//   for each run:
+//     uint16 x, uint16 y, uint16 length
+//     uint8 characters[length]
+//     uint8 colors[length] (foreground in the low nibble, background in the high)
+class DeltaEncoder : public Napi::ObjectWrap<DeltaEncoder> {
+public:
+    static Napi::Function Init(Napi::Env env) {
+        return DefineClass(env, "DeltaEncoder", {
+            InstanceMethod("push", &DeltaEncoder::Push),
+            InstanceMethod("pushAsync", &DeltaEncoder::PushAsync),
+            InstanceMethod("reset", &DeltaEncoder::Reset)
+        });
+    }
+
+    DeltaEncoder(const Napi::CallbackInfo& info): Napi::ObjectWrap<DeltaEncoder>(info) {
+        Napi::Env env = info.Env();
+        if (info.Length() == 0 || info[0].IsUndefined()) return;
+        if (!info[0].IsObject()) {
+            Napi::TypeError::New(env, "Object expected").ThrowAsJavaScriptException();
+            return;
+        }
+        Napi::Object obj = info[0].As<Napi::Object>();
+        Napi::Value v = obj.Get("keyframeFormat");
+        if (!v.IsUndefined() && !GetOutputFormat(v.ToString().Utf8Value(), &format)) {
+            Napi::TypeError::New(env, "Invalid option for keyframeFormat").ThrowAsJavaScriptException();
+            return;
+        }
+        double gap = mergeGap, interval = keyframeInterval;
+        if (!GetNumberOption(env, obj, "threshold", &threshold, 0, 1) ||
+            !GetNumberOption(env, obj, "mergeGap", &gap, 0, UINT_MAX) ||
+            !GetNumberOption(env, obj, "keyframeInterval", &interval, 0, UINT_MAX) ||
+            !GetConvertOptions(env, info[0], &opts)) return;
+        mergeGap = gap;
+        keyframeInterval = interval;
+    }
+
+private:
+    struct Result {
+        bool keyframe;
+        std::string data;
+        unsigned cells;
+    };
+
+    OutputFormat format = OUTPUT_32VID_ANS;
+    ConvertOptions opts;
+    double threshold = 0.5;
+    unsigned mergeGap = 2;
+    unsigned keyframeInterval = 0;
+    unsigned sinceKeyframe = 0;
+    std::shared_ptr<const CCImage> prev;
+    std::mutex mutex;
+
+    static bool Dirty(const CCImage& a, const CCImage& b, size_t i) {
+        return a.chars[i] != b.chars[i] || a.cols[i] != b.cols[i];
+    }
+
+    // Finds the runs of changed cells; runs separated by up to mergeGap
+    // unchanged cells are joined, as that's cheaper than a new run header.
+    std::string MakeDelta(const CCImage& cur, unsigned * cells) {
+        std::string runs;
+        uint32_t nruns = 0;
+        *cells = 0;
+        for (int y = 0; y < cur.height; y++) {
+            const size_t line = (size_t)y * cur.width;
+            int x = 0;
+            while (x < cur.width) {
+                if (!Dirty(*prev, cur, line + x)) {x++; continue;}
+                int start = x, end = x + 1;
+                unsigned gap = 0;
+                for (x = end; x < cur.width; x++) {
+                    if (Dirty(*prev, cur, line + x)) {end = x + 1; gap = 0; (*cells)++;}
+                    else if (++gap > mergeGap) break;
+                }
+                (*cells)++;
+                WriteLE(runs, start, 2);
+                WriteLE(runs, y, 2);
+                WriteLE(runs, end - start, 2);
+                runs.append((const char*)cur.chars + line + start, end - start);
+                runs.append((const char*)cur.cols + line + start, end - start);
+                nruns++;
+                x = end;
+            }
+        }
+        std::string retval;
+        WriteLE(retval, cur.width, 2);
+        WriteLE(retval, cur.height, 2);
+        WriteLE(retval, nruns, 4);
+        return retval + runs;
+    }
+
+    Result Run(Mat1b& img, const std::vector<Vec3b>& palette) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ThreadLimit limit(opts.threads);
+        std::shared_ptr<const CCImage> cur = GetCCImage(img, palette);
+        Result retval;
+        retval.keyframe = !prev || prev->width != cur->width || prev->height != cur->height ||
+            !SamePalette(prev->palette, cur->palette) || (keyframeInterval > 0 && sinceKeyframe + 1 >= keyframeInterval);
+        if (!retval.keyframe) {
+            retval.data = MakeDelta(*cur, &retval.cells);
+            if (retval.cells > threshold * cur->width * cur->height) retval.keyframe = true;
+        }
+        if (retval.keyframe) {
+            retval.data = EncodeOutput(format, opts, *cur);
+            retval.cells = cur->width * cur->height;
+            sinceKeyframe = 0;
+        } else sinceKeyframe++;
+        prev = cur;
+        return retval;
+    }
+
+    Napi::Value NewResult(Napi::Env env, Result& result) {
+        Napi::Object retval = Napi::Object::New(env);
+        retval.Set("keyframe", Napi::Boolean::New(env, result.keyframe));
+        retval.Set("data", result.keyframe && !IsBinaryOutput(format) ? NewString(env, result.data) : NewBuffer(env, result.data));
+        retval.Set("cells", Napi::Number::New(env, result.cells));
+        return retval;
+    }
+
+    bool GetArgs(const Napi::CallbackInfo& info, Mat1b ** img, std::vector<Vec3b> * palette) {
+        Napi::Env env = info.Env();
+        if (info.Length() == 0) Napi::TypeError::New(env, "IndexedImage expected").ThrowAsJavaScriptException();
+        else if (info.Length() == 1) Napi::TypeError::New(env, "Palette expected").ThrowAsJavaScriptException();
+        if (env.IsExceptionPending()) return false;
+        *img = GetIndexedImage(env, info[0]);
+        *palette = GetPalette(env, info[1]);
+        return !env.IsExceptionPending();
+    }
+
+    Napi::Value Push(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        Mat1b * img;
+        std::vector<Vec3b> palette;
+        if (!GetArgs(info, &img, &palette)) return env.Null();
+        Result result = Run(*img, palette);
+        return NewResult(env, result);
+    }
+
+    Napi::Value PushAsync(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        Mat1b * img;
+        std::vector<Vec3b> palette;
+        if (!GetArgs(info, &img, &palette)) return env.Null();
+        return QueueWorker<Result>(env, {info[0], info.This()}, [this, img, palette]() {return Run(*img, palette);},
+            [this](Napi::Env env, Result& result) {return NewResult(env, result);});
+    }
+
+    Napi::Value Reset(const Napi::CallbackInfo& info) {
+        std::lock_guard<std::mutex> lock(mutex);
+        prev.reset();
+        return info.Env().Undefined();
+    }
+};
+
+// Converts a live stream of frames at a fixed palette, only redoing the parts
+// that changed. The previous frame's pixels and CC planes are kept; each new
+// frame is compared against them in tiles of whole characters,
+// and only the changed tiles are dithered and turned into characters again.
+// Adjacent changed tiles in a row are done together, and the changed regions
+// are reported in characters so only they need to be sent on.
+//
+// Threshold and ordered dithering give exactly the same result as converting
+// the whole frame. Floyd-Steinberg error can't be carried in from the rest of
+// the frame, so each region is dithered with a margin of source pixels around
+// it to settle the error before its edges.
+class IncrementalConverter : public Napi::ObjectWrap<IncrementalConverter> {
+public:
+    static Napi::Function Init(Napi::Env env) {
+        return DefineClass(env, "IncrementalConverter", {
+            InstanceMethod("push", &IncrementalConverter::Push),
+            InstanceMethod("pushAsync", &IncrementalConverter::PushAsync),
+            InstanceMethod("getCells", &IncrementalConverter::GetCells),
+            InstanceMethod("makeOutput", &IncrementalConverter::MakeOutput),
+            InstanceMethod("reset", &IncrementalConverter::Reset)
+        });
+    }
+
+    IncrementalConverter(const Napi::CallbackInfo& info): Napi::ObjectWrap<IncrementalConverter>(info) {
+        Napi::Env env = info.Env();
+        palette = GetPalette(env, info.Length() > 0 ? info[0] : env.Undefined());
+        if (env.IsExceptionPending()) return;
+        if (info.Length() < 2 || info[1].IsUndefined()) {
+            ccPalette = palette;
+            return;
+        }
+        if (!GetConvertOptions(env, info[1], &opts)) return;
+        ccPalette = opts.lab ? ConvertLabPalette(palette) : palette;
+        Napi::Object obj = info[1].As<Napi::Object>();
+        Napi::Value v = obj.Get("tile");
+        if (v.IsObject()) {
+            Napi::Value cols = v.As<Napi::Object>().Get("cols"), rows = v.As<Napi::Object>().Get("rows");
+            if (cols.IsNumber()) tileCols = cols.As<Napi::Number>().Int32Value();
+            if (rows.IsNumber()) tileRows = rows.As<Napi::Number>().Int32Value();
+            if (tileCols < 1 || tileRows < 1) Napi::RangeError::New(env, "Tile must be at least one character").ThrowAsJavaScriptException();
+        }
+        v = obj.Get("margin");
+        if (v.IsNumber()) margin = v.As<Napi::Number>().Uint32Value();
+        v = obj.Get("threshold");
+        if (v.IsNumber()) threshold = v.As<Napi::Number>().DoubleValue();
+    }
+
+private:
+    // A changed region, in characters.
+    struct CellRect {
+        unsigned x, y, width, height;
+    };
+
+    struct Result {
+        bool full;
+        std::vector<CellRect> rects;
+        unsigned cells;
+    };
+
+    std::vector<Vec3b> palette, ccPalette;
+    ConvertOptions opts;
+    int tileCols = 8, tileRows = 4;
+    unsigned margin = 8;
+    double threshold = 0.5;
+    unsigned width = 0, height = 0;
+    PixelFormat format = PIXEL_RGB;
+    std::vector<uint8_t> prev;
+    std::shared_ptr<CCImage> cc;
+    std::mutex mutex;
+
+    // Compares the frame with the previous one, tile by tile, and updates the
+    // stored pixels of the tiles that changed. Rows of tiles run in parallel.
+    std::vector<uint8_t> FindChanges(const PixelSource& src, unsigned tilesX, unsigned tilesY) {
+        const unsigned size = PixelSize(src.format), areaWidth = cc->width * 2, areaHeight = cc->height * 3;
+        const size_t rowBytes = (size_t)areaWidth * size, tileBytes = (size_t)tileCols * 2 * size;
+        std::vector<uint8_t> dirty((size_t)tilesX * tilesY);
+        StageTimer timer(STAGE_INGEST, (uint64_t)areaWidth * areaHeight);
+        pool.ParallelFor(tilesY, threadLimit ? threadLimit : pool.Size() + 1, [&](unsigned ty) {
+            uint8_t * flags = &dirty[(size_t)ty * tilesX];
+            bool any = false;
+            for (unsigned y = ty * tileRows * 3; y < std::min((ty + 1) * tileRows * 3, areaHeight); y++) {
+                const uint8_t * cur = src.data + y * src.stride;
+                uint8_t * old = &prev[y * rowBytes];
+                if (!any && memcmp(cur, old, rowBytes) == 0) continue;
+                for (unsigned tx = 0; tx < tilesX; tx++) {
+                    const size_t offset = tx * tileBytes, len = std::min(tileBytes, rowBytes - offset);
+                    // once a tile has changed, the rest of its rows are copied without comparing
+                    if (!flags[tx] && memcmp(cur + offset, old + offset, len) == 0) continue;
+                    flags[tx] = 1;
+                    any = true;
+                    memcpy(old + offset, cur + offset, len);
+                }
+            }
+        });
+        return dirty;
+    }
+
+    // Redoes one changed region, given in pixels: dithers it with its margin,
+    // then redoes the characters inside it.
+    void Update(const PixelSource& src, unsigned x0, unsigned y0, unsigned x1, unsigned y1) {
+        // ordered dithering patterns repeat every 8 pixels at most, so regions
+        // start on a multiple of 8 to line up with the whole frame
+        const unsigned m = opts.ditherer == ditherImage ? margin : 0, size = PixelSize(src.format);
+        const unsigned ex0 = x0 > m ? (x0 - m) & ~7U : 0, ey0 = y0 > m ? (y0 - m) & ~7U : 0;
+        const unsigned ex1 = std::min(x1 + m, (unsigned)cc->width * 2), ey1 = std::min(y1 + m, (unsigned)cc->height * 3);
+        PixelSource region = {src.data + ey0 * src.stride + ex0 * size, ex1 - ex0, ey1 - ey0, src.stride, src.format};
+        PooledMat pixels(ReadPixels(region, opts.lab));
+        PooledMat1b dithered(DitherToIndexed(*pixels, palette, opts.ditherer, opts.dither));
+        PooledMat1b inside(imagePool.NewMat1b(x1 - x0, y1 - y0));
+        CopyRegion(*dithered, *inside, x0 - ex0, y0 - ey0);
+        std::shared_ptr<CCImage> part = MakeCCImage(*inside, ccPalette);
+        for (int y = 0; y < part->height; y++) {
+            const size_t offset = (size_t)(y0 / 3 + y) * cc->width + x0 / 2;
+            memcpy(cc->chars + offset, part->chars + (size_t)y * part->width, part->width);
+            memcpy(cc->cols + offset, part->cols + (size_t)y * part->width, part->width);
+        }
+    }
+
+    Result Run(const PixelSource& src) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ThreadLimit limit(opts.threads);
+        const unsigned cols = src.width / 2, rows = src.height / 3, size = PixelSize(src.format);
+        if (cols == 0 || rows == 0) throw std::range_error("Frame is smaller than one character");
+        const unsigned tilesX = (cols + tileCols - 1) / tileCols, tilesY = (rows + tileRows - 1) / tileRows;
+        Result retval;
+        retval.full = !cc || src.width != width || src.height != height || src.format != format;
+        std::vector<uint8_t> dirty;
+        if (!retval.full) {
+            dirty = FindChanges(src, tilesX, tilesY);
+            retval.full = std::count(dirty.begin(), dirty.end(), 1) > threshold * dirty.size();
+        }
+        if (retval.full) {
+            PooledMat img(ReadPixels(src, opts.lab));
+            PooledMat1b indexed(DitherToIndexed(*img, palette, opts.ditherer, opts.dither));
+            cc = MakeCCImage(*indexed, ccPalette);
+            width = src.width;
+            height = src.height;
+            format = src.format;
+            const size_t rowBytes = (size_t)cols * 2 * size;
+            prev.resize(rowBytes * rows * 3);
+            for (unsigned y = 0; y < rows * 3; y++) memcpy(&prev[y * rowBytes], src.data + y * src.stride, rowBytes);
+            retval.rects.push_back({0, 0, (unsigned)cols, (unsigned)rows});
+            retval.cells = cols * rows;
+            return retval;
+        }
+        // join runs of changed tiles in each row of tiles
+        for (unsigned ty = 0; ty < tilesY; ty++) {
+            for (unsigned tx = 0; tx < tilesX; tx++) {
+                if (!dirty[(size_t)ty * tilesX + tx]) continue;
+                unsigned end = tx + 1;
+                while (end < tilesX && dirty[(size_t)ty * tilesX + end]) end++;
+                const unsigned x = tx * tileCols, y = ty * tileRows;
+                retval.rects.push_back({x, y, std::min(end * tileCols, cols) - x, std::min(y + tileRows, rows) - y});
+                tx = end;
+            }
+        }
+        std::mutex errorMutex;
+        std::string error;
+        pool.ParallelFor(retval.rects.size(), threadLimit ? threadLimit : pool.Size() + 1, [&](unsigned i) {
+            const CellRect& r = retval.rects[i];
+            try {
+                Update(src, r.x * 2, r.y * 3, (r.x + r.width) * 2, (r.y + r.height) * 3);
+            } catch (const std::exception &e) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (error.empty()) error = e.what();
+            }
+        });
+        if (!error.empty()) {
+            // the stored frame no longer matches the planes, so start over
+            cc.reset();
+            throw std::runtime_error(error);
+        }
+        retval.cells = 0;
+        for (const CellRect& r : retval.rects) retval.cells += r.width * r.height;
+        return retval;
+    }
+
+    static Napi::Value NewResult(Napi::Env env, Result& result) {
+        Napi::Object retval = Napi::Object::New(env);
+        Napi::Array rects = Napi::Array::New(env, result.rects.size());
+        for (size_t i = 0; i < result.rects.size(); i++) {
+            Napi::Object rect = Napi::Object::New(env);
+            rect.Set("x", Napi::Number::New(env, result.rects[i].x));
+            rect.Set("y", Napi::Number::New(env, result.rects[i].y));
+            rect.Set("width", Napi::Number::New(env, result.rects[i].width));
+            rect.Set("height", Napi::Number::New(env, result.rects[i].height));
+            rects.Set(i, rect);
+        }
+        retval.Set("full", Napi::Boolean::New(env, result.full));
+        retval.Set("rects", rects);
+        retval.Set("cells", Napi::Number::New(env, result.cells));
+        return retval;
+    }
+
+    static bool GetArgs(const Napi::CallbackInfo& info, PixelSource * src) {
+        Napi::Value stride = info.Env().Undefined();
+        if (info.Length() >= 5 && info[4].IsObject()) stride = info[4].As<Napi::Object>().Get("stride");
+        return GetPixelSource(info, info[0], stride, src);
+    }
+
+    Napi::Value Push(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        PixelSource src;
+        if (!GetArgs(info, &src)) return env.Null();
+        Result result;
+        try {
+            result = Run(src);
+        } catch (const std::exception &e) {
+            Napi::Error::New(env, e.what()).ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        return NewResult(env, result);
+    }
+
+    Napi::Value PushAsync(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        PixelSource src;
+        if (!GetArgs(info, &src)) return env.Null();
+        return QueueWorker<Result>(env, {info[0], info.This()}, [this, src]() {return Run(src);}, NewResult);
+    }
+
+    // Returns the characters and colors of a region of the current frame, in
+    // the same layout as the runs in DeltaEncoder's output.
+    Napi::Value GetCells(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!cc) {
+            Napi::Error::New(env, "No frame has been converted").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        unsigned x, y, w, h;
+        if (!GetRegionArgs(info, cc->width, cc->height, &x, &y, &w, &h)) return env.Null();
+        Napi::Buffer<uint8_t> chars = Napi::Buffer<uint8_t>::New(env, (size_t)w * h), colors = Napi::Buffer<uint8_t>::New(env, (size_t)w * h);
+        for (unsigned row = 0; row < h; row++) {
+            const size_t offset = (size_t)(y + row) * cc->width + x;
+            memcpy(chars.Data() + (size_t)row * w, cc->chars + offset, w);
+            memcpy(colors.Data() + (size_t)row * w, cc->cols + offset, w);
+        }
+        Napi::Object retval = Napi::Object::New(env);
+        retval.Set("chars", chars);
+        retval.Set("colors", colors);
+        return retval;
+    }
+
+    // Encodes the whole current frame, e.g. for a client that just connected.
+    Napi::Value MakeOutput(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        OutputFormat format = opts.output;
+        if (info.Length() > 0 && !info[0].IsUndefined() && !GetOutputFormat(info[0].ToString().Utf8Value(), &format)) {
+            Napi::TypeError::New(env, "Invalid output format").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!cc) {
+            Napi::Error::New(env, "No frame has been converted").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        std::string retval = EncodeOutput(format, opts, *cc);
+        return NewOutput(env, format, retval);
+    }
+
+    Napi::Value Reset(const Napi::CallbackInfo& info) {
+        std::lock_guard<std::mutex> lock(mutex);
+        cc.reset();
+        prev.clear();
+        return info.Env().Undefined();
+    }
+};
+
+Napi::Value M_setThreadCount(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (info.Length() == 0 || !info[0].IsNumber() || info[0].As<Napi::Number>().Int32Value() < 1) {
+        Napi::TypeError::New(env, "Positive number expected").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    // the calling thread takes part in every loop, so it needs one fewer worker
+    pool.Resize(info[0].As<Napi::Number>().Uint32Value() - 1);
+    return env.Undefined();
+}
+
+Napi::Number M_getThreadCount(const Napi::CallbackInfo& info) {
+    return Napi::Number::New(info.Env(), pool.Size() + 1);
+}
+
+Napi::Object M_getThreadPoolStats(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Napi::Object retval = Napi::Object::New(env);
+    retval.Set("threads", Napi::Number::New(env, pool.Size() + 1));
+    retval.Set("activeLoops", Napi::Number::New(env, pool.ActiveLoops()));
+    retval.Set("loops", Napi::Number::New(env, (double)pool.Loops()));
+    retval.Set("chunks", Napi::Number::New(env, (double)pool.Chunks()));
+    return retval;
+}
+
+Napi::Value M_setImagePoolLimit(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (info.Length() == 0 || !info[0].IsNumber() || info[0].As<Napi::Number>().DoubleValue() < 0) {
+        Napi::TypeError::New(env, "Non-negative number expected").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    imagePool.SetLimit(info[0].As<Napi::Number>().Int64Value());
+    return env.Undefined();
+}
+
+Napi::Value M_trimImagePool(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    int64_t bytes = 0;
+    if (info.Length() > 0 && !info[0].IsUndefined()) {
+        if (!info[0].IsNumber() || info[0].As<Napi::Number>().DoubleValue() < 0) {
+            Napi::TypeError::New(env, "Non-negative number expected").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        bytes = info[0].As<Napi::Number>().Int64Value();
+    }
+    imagePool.Trim(bytes);
+    return env.Undefined();
+}
+
+Napi::Object M_getImagePoolStats(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Napi::Object retval = Napi::Object::New(env);
+    retval.Set("bytes", Napi::Number::New(env, (double)imagePool.Bytes()));
+    retval.Set("images", Napi::Number::New(env, (double)imagePool.Images()));
+    retval.Set("limit", Napi::Number::New(env, (double)imagePool.Limit()));
+    retval.Set("hits", Napi::Number::New(env, (double)imagePool.Hits()));
+    retval.Set("misses", Napi::Number::New(env, (double)imagePool.Misses()));
+    return retval;
+}
+
+Napi::Value M_setCacheLimit(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (info.Length() == 0 || !info[0].IsNumber() || info[0].As<Napi::Number>().DoubleValue() < 0) {
+        Napi::TypeError::New(env, "Non-negative number expected").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    resultCache.SetLimit(info[0].As<Napi::Number>().Int64Value());
+    return env.Undefined();
+}
+
+Napi::Value M_clearCache(const Napi::CallbackInfo& info) {
+    resultCache.Clear();
+    return info.Env().Undefined();
+}
+
+Napi::Object M_getCacheStats(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Napi::Object retval = Napi::Object::New(env);
+    retval.Set("bytes", Napi::Number::New(env, (double)resultCache.Bytes()));
+    retval.Set("entries", Napi::Number::New(env, (double)resultCache.Entries()));
+    retval.Set("limit", Napi::Number::New(env, (double)resultCache.Limit()));
+    retval.Set("hits", Napi::Number::New(env, (double)resultCache.Hits()));
+    retval.Set("misses", Napi::Number::New(env, (double)resultCache.Misses()));
+    return retval;
+}
+
+Napi::Value M_setStatsEnabled(const Napi::CallbackInfo& info) {
+    statsEnabled = info.Length() > 0 && info[0].ToBoolean();
+    return info.Env().Undefined();
+}
+
+Napi::Object M_getStats(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Napi::Object retval = Napi::Object::New(env);
+    retval.Set("enabled", Napi::Boolean::New(env, statsEnabled));
+    Napi::Object stages = Napi::Object::New(env);
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        const StageStats& stats = stageStats[i];
+        Napi::Object stage = Napi::Object::New(env);
+        stage.Set("calls", Napi::Number::New(env, (double)stats.calls));
+        stage.Set("pixels", Napi::Number::New(env, (double)stats.pixels));
+        stage.Set("totalTime", Napi::Number::New(env, stats.totalNs / 1e6));
+        stage.Set("lastTime", Napi::Number::New(env, stats.lastNs / 1e6));
+        stage.Set("lastStart", Napi::Number::New(env, stats.lastStartNs / 1e6));
+        stages.Set(stageNames[i], stage);
+    }
+    retval.Set("stages", stages);
+    Napi::Object memory = Napi::Object::New(env);
+    memory.Set("allocated", Napi::Number::New(env, (double)imageBytesAllocated));
+    memory.Set("live", Napi::Number::New(env, (double)imageBytesLive));
+    memory.Set("peak", Napi::Number::New(env, (double)imageBytesPeak));
+    retval.Set("imageMemory", memory);
+    return retval;
+}
+
+Napi::Value M_resetStats(const Napi::CallbackInfo& info) {
+    for (StageStats& stats : stageStats) stats.calls = stats.pixels = stats.totalNs = stats.lastNs = stats.lastStartNs = 0;
+    imageBytesAllocated = 0;
+    imageBytesPeak = imageBytesLive.load();
+    return info.Env().Undefined();
+}
+
+// Number of environments (the main thread and each worker) the module is
+// loaded in. The OpenCL device and image pool are shared by all of them, so
+// they're only freed when the last one exits.
+unsigned envCount = 0;
+std::mutex envCountMutex;
+
+void Cleanup() {
+    std::lock_guard<std::mutex> lock(envCountMutex);
+    if (--envCount > 0) return;
+    imagePool.Trim(0);
+    delete device;
+    device = NULL;
+}
+
+#define addFunction(name) exports.Set(#name, Napi::Function::New(env, M_ ## name))
+Napi::Object InitAll(Napi::Env env, Napi::Object exports) {
+    addFunction(initOpenCL);
+    addFunction(makeRGBImage);
+    addFunction(makeLabImage);
+    addFunction(resizeImage);
+    addFunction(fitTerminal);
+    addFunction(convertLabPalette);
+    addFunction(reducePalette_medianCut);
+    addFunction(reducePalette_kMeans);
+    addFunction(reducePalette_octree);
+    addFunction(makeColorHistogram);
+    addFunction(thresholdImage);
+    addFunction(ditherImage_ordered);
+    addFunction(ditherImage_floydSteinberg);
+    addFunction(makeTable);
+    addFunction(makeNFP);
+    addFunction(makeLuaFile);
+    addFunction(makeRawImage);
+    addFunction(make32vid);
+    addFunction(make32vid_cmp);
+    addFunction(make32vid_ans);
+    addFunction(makeLabImageAsync);
+    addFunction(resizeImageAsync);
+    addFunction(fitTerminalAsync);
+    addFunction(reducePalette_medianCutAsync);
+    addFunction(reducePalette_kMeansAsync);
+    addFunction(reducePalette_octreeAsync);
+    addFunction(thresholdImageAsync);
+    addFunction(ditherImage_orderedAsync);
+    addFunction(ditherImage_floydSteinbergAsync);
+    addFunction(makeTableAsync);
+    addFunction(makeNFPAsync);
+    addFunction(makeLuaFileAsync);
+    addFunction(makeRawImageAsync);
+    addFunction(make32vidAsync);
+    addFunction(make32vid_cmpAsync);
+    addFunction(make32vid_ansAsync);
+    addFunction(convert);
+    addFunction(convertAsync);
+    addFunction(convertFrames);
+    addFunction(convertFramesAsync);
+    addFunction(convertWall);
+    addFunction(convertWallAsync);
+    addFunction(makeOutputs);
+    addFunction(makeOutputInto);
+    addFunction(makeOutputsAsync);
+    addFunction(makeOutputIntoAsync);
+    addFunction(setThreadCount);
+    addFunction(getThreadCount);
+    addFunction(getThreadPoolStats);
+    addFunction(setImagePoolLimit);
+    addFunction(trimImagePool);
+    addFunction(getImagePoolStats);
+    addFunction(openSharedImage);
+    addFunction(releaseSharedImage);
+    addFunction(packPalette);
+    addFunction(setCacheLimit);
+    addFunction(clearCache);
+    addFunction(getCacheStats);
+    addFunction(setStatsEnabled);
+    addFunction(getStats);
+    addFunction(resetStats);
+    exports.Set("VideoEncoder", VideoEncoder::Init(env));
+    exports.Set("PaletteGenerator", PaletteGenerator::Init(env));
+    exports.Set("DeltaEncoder", DeltaEncoder::Init(env));
+    exports.Set("IncrementalConverter", IncrementalConverter::Init(env));
+    {
+        std::lock_guard<std::mutex> lock(envCountMutex);
+        envCount++;
+    }
     env.AddCleanupHook(Cleanup);
     return exports;
 }
@@ -0,0 +1,648 @@
+// Pixel kernels shared by the module and the native benchmark: packed pixel
+// ingest, CIELAB conversion, nearest-color search and Floyd-Steinberg
+// dithering, along with the thread pool they run on. Callers allocate the
+// output images, so the module can take them from its image pool.
+#ifndef PIXELS_HPP
+#define PIXELS_HPP
+#include <sanjuuni.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define PIXEL_SIMD
+#include <immintrin.h>
+#endif
+
+// Number of threads the ThreadPool below starts with: SANJUUNI_THREADS if it's
+// set, or one per CPU core. It doesn't affect sanjuuni's own work queue, used
+// inside stages like makeCCImage and k-means; setThreadCount resizes the pool
+// later.
+inline unsigned InitialThreadCount() {
+    const char * str = getenv("SANJUUNI_THREADS");
+    if (str != NULL && atoi(str) > 0) return atoi(str);
+    return std::max(std::thread::hardware_concurrency(), 1U);
+}
+
+enum PixelFormat {
+    PIXEL_RGB,
+    PIXEL_BGR,
+    PIXEL_RGBA,
+    PIXEL_ARGB,
+    PIXEL_BGRA,
+    PIXEL_ABGR
+};
+
+inline bool GetPixelFormat(const std::string& str, PixelFormat * format) {
+    if (str == "rgb") *format = PIXEL_RGB;
+    else if (str == "bgr") *format = PIXEL_BGR;
+    else if (str == "rgba") *format = PIXEL_RGBA;
+    else if (str == "argb") *format = PIXEL_ARGB;
+    else if (str == "bgra") *format = PIXEL_BGRA;
+    else if (str == "abgr") *format = PIXEL_ABGR;
+    else return false;
+    return true;
+}
+
+inline unsigned PixelSize(PixelFormat format) {
+    return format == PIXEL_RGB || format == PIXEL_BGR ? 3 : 4;
+}
+
+// Byte offsets of the blue, green and red channels in each pixel format.
+static const uint8_t pixelOffsets[6][3] = {
+    {2, 1, 0}, // rgb
+    {0, 1, 2}, // bgr
+    {2, 1, 0}, // rgba
+    {3, 2, 1}, // argb
+    {0, 1, 2}, // bgra
+    {1, 2, 3}  // abgr
+};
+
+// Pool of worker threads for the parallel loops in this module. A loop is split
+// into chunks which threads claim from an atomic counter, so faster threads take
+// more of them. The calling thread works on its own loop as well, so several
+// conversions running at once share the same workers instead of each adding
+// their own threads.
+class ThreadPool {
+public:
+    ThreadPool(unsigned size): size(size) {}
+    ~ThreadPool() {Stop(0);}
+
+    unsigned Size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return size;
+    }
+
+    void Resize(unsigned n) {Stop(n);}
+
+    uint64_t Loops() const {return loops;}
+    uint64_t Chunks() const {return chunks;}
+    unsigned ActiveLoops() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return jobs.size();
+    }
+
+    // Runs fn(0) to fn(count - 1) on up to maxThreads threads (including the
+    // caller), returning once all of them have finished.
+    void ParallelFor(unsigned count, unsigned maxThreads, const std::function<void(unsigned)>& fn) {
+        if (count == 0) return;
+        loops++;
+        Job job(fn, count);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (threads.size() != size && !exiting) Start();
+            job.helpers = std::min(std::min(maxThreads, size + 1), count) - 1;
+            if (job.helpers > 0) jobs.push_back(&job);
+        }
+        if (job.helpers == 0) {
+            for (unsigned i = 0; i < count; i++) fn(i);
+            chunks += count;
+            return;
+        }
+        cv.notify_all();
+        Run(&job);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.erase(std::find(jobs.begin(), jobs.end(), &job));
+        }
+        std::unique_lock<std::mutex> lock(job.mutex);
+        job.cv.wait(lock, [&job]() {return job.done == job.count && job.active == 0;});
+    }
+
+private:
+    struct Job {
+        const std::function<void(unsigned)>& fn;
+        const unsigned count;
+        unsigned helpers = 0;
+        std::atomic<unsigned> next{0}, done{0}, active{0};
+        std::mutex mutex;
+        std::condition_variable cv;
+        Job(const std::function<void(unsigned)>& fn, unsigned count): fn(fn), count(count) {}
+    };
+
+    unsigned size;
+    std::vector<std::thread> threads;
+    std::vector<Job*> jobs;
+    std::mutex mutex, stopMutex;
+    std::condition_variable cv;
+    bool exiting = false;
+    std::atomic<uint64_t> loops{0}, chunks{0};
+
+    void Run(Job * job) {
+        unsigned i;
+        while ((i = job->next++) < job->count) {
+            job->fn(i);
+            chunks++;
+            if (++job->done == job->count) {
+                std::lock_guard<std::mutex> lock(job->mutex);
+                job->cv.notify_all();
+            }
+        }
+    }
+
+    Job * FindJob() {
+        for (Job * job : jobs)
+            if (job->active < job->helpers && job->next < job->count) return job;
+        return NULL;
+    }
+
+    void Worker() {
+        for (;;) {
+            Job * job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this, &job]() {return exiting || (job = FindJob()) != NULL;});
+                if (exiting) return;
+                job->active++;
+            }
+            Run(job);
+            std::lock_guard<std::mutex> lock(job->mutex);
+            job->active--;
+            job->cv.notify_all();
+        }
+    }
+
+    // Must be called with the mutex held.
+    void Start() {
+        for (unsigned i = threads.size(); i < size; i++) threads.emplace_back(&ThreadPool::Worker, this);
+    }
+
+    // Any loops still running are finished by their callers. The threads are
+    // taken out of the pool and the new size is set under the lock, and no new
+    // threads are started until the old ones have all exited, so they're only
+    // ever started at the new size.
+    void Stop(unsigned newSize) {
+        std::lock_guard<std::mutex> stopLock(stopMutex);
+        std::vector<std::thread> stopping;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            exiting = true;
+            size = newSize;
+            stopping.swap(threads);
+        }
+        cv.notify_all();
+        for (std::thread& t : stopping) t.join();
+        std::lock_guard<std::mutex> lock(mutex);
+        exiting = false;
+    }
+};
+
+// The pool the kernels below run on, defined by the program using them.
+extern ThreadPool pool;
+
+// Maximum number of threads for parallel loops on this thread, or 0 to use the
+// whole pool. Set for the duration of a call with ThreadLimit.
+extern thread_local unsigned threadLimit;
+
+struct ThreadLimit {
+    unsigned old;
+    ThreadLimit(unsigned limit): old(threadLimit) {if (limit) threadLimit = limit;}
+    ~ThreadLimit() {threadLimit = old;}
+};
+
+// Splits the rows of an image into chunks and runs them on the thread pool.
+// Chunks are at least 64K pixels, so small images run inline.
+inline void ParallelRows(unsigned width, unsigned height, const std::function<void(unsigned, unsigned)>& fn) {
+    unsigned threads = threadLimit ? threadLimit : pool.Size() + 1;
+    unsigned chunk = std::max(65536 / std::max(width, 1U) + 1, (height + threads * 4 - 1) / (threads * 4));
+    unsigned count = (height + chunk - 1) / chunk;
+    if (count <= 1) {
+        fn(0, height);
+        return;
+    }
+    pool.ParallelFor(count, threads, [&fn, chunk, height](unsigned i) {
+        fn(i * chunk, std::min((i + 1) * chunk, height));
+    });
+}
+
+// Nearest-color lookup table for a palette. The color cube is split into 32^3
+// cells, and each cell lists the palette entries that can be nearest to some
+// color in it: those whose closest distance to the cell is within the best
+// farthest distance of any entry. Most cells have a single candidate, and the
+// rest are searched in palette order, so lookups match a full linear search
+// (squared distance, first entry wins ties).
+struct PaletteLUT {
+    static const unsigned shift = 3;
+    static const unsigned size = 256 >> shift;
+    std::vector<Vec3b> palette;
+    std::vector<uint32_t> start;
+    std::vector<uint8_t> candidates;
+
+    PaletteLUT(const std::vector<Vec3b>& palette): palette(palette), start(size * size * size + 1) {
+        std::vector<unsigned> minDist(palette.size());
+        for (unsigned cell = 0; cell < size * size * size; cell++) {
+            const unsigned lo[3] = {(cell / (size * size)) << shift, ((cell / size) % size) << shift, (cell % size) << shift};
+            unsigned best = UINT_MAX;
+            for (size_t i = 0; i < palette.size(); i++) {
+                unsigned dmin = 0, dmax = 0;
+                for (int c = 0; c < 3; c++) {
+                    const int v = palette[i][c], l = lo[c], h = lo[c] + (1 << shift) - 1;
+                    const int n = v < l ? l - v : v > h ? v - h : 0, f = std::max(v - l, h - v);
+                    dmin += n * n;
+                    dmax += f * f;
+                }
+                minDist[i] = dmin;
+                best = std::min(best, dmax);
+            }
+            start[cell] = candidates.size();
+            for (size_t i = 0; i < palette.size(); i++)
+                if (minDist[i] <= best) candidates.push_back(i);
+        }
+        start[size * size * size] = candidates.size();
+    }
+
+    uint8_t Nearest(const uchar3& c) const {
+        const unsigned cell = ((c.x >> shift) * size + (c.y >> shift)) * size + (c.z >> shift);
+        uint32_t i = start[cell], end = start[cell + 1];
+        if (end - i <= 1) return i < end ? candidates[i] : 0;
+        uint8_t retval = 0;
+        unsigned best = UINT_MAX;
+        for (; i < end; i++) {
+            const Vec3b& p = palette[candidates[i]];
+            const int db = c.x - p[0], dg = c.y - p[1], dr = c.z - p[2];
+            const unsigned d = db * db + dg * dg + dr * dr;
+            if (d < best) {best = d; retval = candidates[i];}
+        }
+        return retval;
+    }
+};
+
+// Nearest-color search for palettes of up to Size colors, unrolled at compile
+// time. Distances are computed four at a time as 32-bit sums of 16-bit
+// products, and combined with their index as (distance << 4 | index) so the
+// minimum picks the lowest index on ties, like a linear search. The palette is
+// padded with copies of its first color, which can never win.
+template<unsigned Size>
+struct SmallPalette {
+    static_assert(Size % 4 == 0 && Size <= 16, "SmallPalette holds up to 16 colors");
+    std::vector<Vec3b> palette;
+#if defined(PIXEL_SIMD) && defined(__SSE2__)
+    __m128i bg[Size / 4], r[Size / 4], index[Size / 4];
+#endif
+
+    SmallPalette(const std::vector<Vec3b>& palette): palette(palette) {
+#if defined(PIXEL_SIMD) && defined(__SSE2__)
+        for (unsigned i = 0; i < Size / 4; i++) {
+            int16_t b[4], g[4], rr[4];
+            for (unsigned j = 0; j < 4; j++) {
+                const Vec3b& p = palette[i * 4 + j < palette.size() ? i * 4 + j : 0];
+                b[j] = p[0];
+                g[j] = p[1];
+                rr[j] = p[2];
+            }
+            bg[i] = _mm_setr_epi16(b[0], g[0], b[1], g[1], b[2], g[2], b[3], g[3]);
+            r[i] = _mm_setr_epi16(rr[0], 0, rr[1], 0, rr[2], 0, rr[3], 0);
+            index[i] = _mm_setr_epi32(i * 4, i * 4 + 1, i * 4 + 2, i * 4 + 3);
+        }
+#endif
+    }
+
+    uint8_t Nearest(const uchar3& c) const {
+#if defined(PIXEL_SIMD) && defined(__SSE2__)
+        const __m128i pbg = _mm_set1_epi32(c.x | (c.y << 16)), pr = _mm_set1_epi32(c.z);
+        __m128i best = _mm_set1_epi32(INT_MAX);
+        for (unsigned i = 0; i < Size / 4; i++) {
+            const __m128i d1 = _mm_sub_epi16(pbg, bg[i]), d2 = _mm_sub_epi16(pr, r[i]);
+            const __m128i dist = _mm_add_epi32(_mm_madd_epi16(d1, d1), _mm_madd_epi16(d2, d2));
+            best = Min(best, _mm_or_si128(_mm_slli_epi32(dist, 4), index[i]));
+        }
+        best = Min(best, _mm_shuffle_epi32(best, _MM_SHUFFLE(1, 0, 3, 2)));
+        best = Min(best, _mm_shuffle_epi32(best, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(best) & 15;
+#else
+        unsigned best = UINT_MAX;
+        for (unsigned i = 0; i < Size; i++) {
+            const Vec3b& p = palette[i < palette.size() ? i : 0];
+            const int db = c.x - p[0], dg = c.y - p[1], dr = c.z - p[2];
+            best = std::min(best, (unsigned)(db * db + dg * dg + dr * dr) << 4 | i);
+        }
+        return best & 15;
+#endif
+    }
+
+#if defined(PIXEL_SIMD) && defined(__SSE2__)
+    static __m128i Min(__m128i a, __m128i b) {
+        const __m128i gt = _mm_cmpgt_epi32(a, b);
+        return _mm_or_si128(_mm_and_si128(gt, b), _mm_andnot_si128(gt, a));
+    }
+#endif
+};
+
+// Maps each pixel of an image to the index of its nearest palette color in
+// out, which must be the same size.
+template<typename Search>
+void MapToPalette(Mat& img, const Search& search, Mat1b& out) {
+    ParallelRows(img.width, img.height, [&img, &search, &out](unsigned start, unsigned end) {
+        for (unsigned y = start; y < end; y++) {
+            Mat::row src = img[y];
+            Mat1b::row dst = out[y];
+            for (unsigned x = 0; x < img.width; x++) dst[x] = search.Nearest(src[x]);
+        }
+    });
+}
+
+static inline uchar ClampByte(int v) {return v < 0 ? 0 : v > 255 ? 255 : v;}
+
+// Floyd-Steinberg dithering straight to palette indices. Errors are kept as
+// integers in 16ths, so the sum each pixel receives doesn't depend on the order
+// it's added up in. That lets rows run as a wavefront: each thread takes the
+// next row and stays at least one block behind the row above it, which has
+// then finished every pixel that spreads error to the block. The result is
+// identical to a serial run with any number of threads.
+//
+// With serpentine scanning, odd rows run right to left. A row then can't start
+// until the one above has finished, so serpentine dithering always runs on a
+// single thread.
+static const unsigned ditherBlock = 64;
+
+// Whether an image is big enough to split across threads. Smaller images
+// are dithered on the calling thread.
+static bool DitherAsWavefront(const Mat& img) {
+    return (uint64_t)img.width * img.height >= 65536 && img.width >= ditherBlock * 2;
+}
+
+template<typename Search>
+void DitherFloydSteinberg(Mat& img, const Search& search, bool serpentine, Mat1b& out) {
+    const unsigned width = img.width, height = img.height, block = ditherBlock;
+    unsigned threads = std::min(threadLimit ? threadLimit : pool.Size() + 1, height);
+    if (serpentine || !DitherAsWavefront(img)) threads = 1;
+    // Error spread to each row in flight, with a pixel of padding on each side.
+    // Row y reads slot y % slots, and clears each pixel as it reads it (and the
+    // padding in its last block), so the slot is empty again by the time row
+    // y + slots - 1 starts writing to it.
+    const unsigned slots = threads + 1, stride = (width + 2) * 3;
+    std::vector<int32_t> errors((size_t)slots * stride);
+    std::vector<std::atomic<unsigned>> progress(threads > 1 ? height : 0);
+    auto runRow = [&](unsigned y) {
+        int32_t * in = &errors[(size_t)(y % slots) * stride + 3];
+        int32_t * next = &errors[(size_t)((y + 1) % slots) * stride + 3];
+        const bool reverse = serpentine && (y & 1);
+        const int back = reverse ? 3 : -3;
+        Mat::row src = img[y];
+        Mat1b::row dst = out[y];
+        int32_t carry[3] = {0, 0, 0};
+        for (unsigned x0 = 0; x0 < width; x0 += block) {
+            const unsigned x1 = std::min(x0 + block, width);
+            if (threads > 1 && y > 0) {
+                const unsigned need = std::min(x1 + 1, width);
+                while (progress[y-1].load(std::memory_order_acquire) < need) std::this_thread::yield();
+            }
+            if (x1 == width) {
+                // the row above has finished, so the padding it spilled into can be cleared
+                std::fill(in - 3, in, 0);
+                std::fill(in + width * 3, in + width * 3 + 3, 0);
+            }
+            for (unsigned i = x0; i < x1; i++) {
+                const unsigned x = reverse ? width - 1 - i : i;
+                const uchar3 c = src[x];
+                int32_t * e = in + x * 3;
+                const uchar3 v = {ClampByte(c.x + ((e[0] + carry[0] + 8) >> 4)), ClampByte(c.y + ((e[1] + carry[1] + 8) >> 4)), ClampByte(c.z + ((e[2] + carry[2] + 8) >> 4))};
+                e[0] = e[1] = e[2] = 0;
+                const uint8_t index = search.Nearest(v);
+                dst[x] = index;
+                const Vec3b& p = search.palette[index];
+                const int32_t err[3] = {v.x - p[0], v.y - p[1], v.z - p[2]};
+                int32_t * n = next + x * 3;
+                for (int k = 0; k < 3; k++) {
+                    carry[k] = err[k] * 7;
+                    n[k + back] += err[k] * 3;
+                    n[k] += err[k] * 5;
+                    n[k - back] += err[k];
+                }
+            }
+            if (threads > 1) progress[y].store(x1, std::memory_order_release);
+        }
+    };
+    if (threads == 1) {
+        for (unsigned y = 0; y < height; y++) runRow(y);
+        return;
+    }
+    std::atomic<unsigned> nextRow{0};
+    pool.ParallelFor(threads, threads, [&runRow, &nextRow, height](unsigned) {
+        unsigned y;
+        while ((y = nextRow++) < height) runRow(y);
+    });
+}
+
+#ifdef PIXEL_SIMD
+// Converts 4-byte pixels 8 at a time; shuffles each 128-bit lane to packed BGR
+// and then closes the gap between the lanes. The store writes 8 bytes past the
+// end of the block, so it stops while at least 3 pixels remain.
+__attribute__((target("avx2")))
+static unsigned ReadRow_avx2(const uint8_t * src, uint8_t * dst, unsigned width, PixelFormat format) {
+    if (PixelSize(format) != 4) return 0;
+    const uint8_t * o = pixelOffsets[format];
+    const __m256i mask = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+        o[0], o[1], o[2], 4+o[0], 4+o[1], 4+o[2], 8+o[0], 8+o[1], 8+o[2], 12+o[0], 12+o[1], 12+o[2], -1, -1, -1, -1));
+    const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    unsigned x = 0;
+    for (; x + 11 <= width; x += 8) {
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src + x * 4)), mask);
+        _mm256_storeu_si256((__m256i*)(dst + x * 3), _mm256_permutevar8x32_epi32(v, pack));
+    }
+    return x;
+}
+
+// Converts 4 4-byte or 5 3-byte pixels at a time. Loads and stores are a full
+// 16 bytes, so the loop stops while at least 6 pixels remain.
+__attribute__((target("ssse3")))
+static unsigned ReadRow_ssse3(const uint8_t * src, uint8_t * dst, unsigned width, PixelFormat format) {
+    const uint8_t * o = pixelOffsets[format];
+    unsigned x = 0;
+    if (PixelSize(format) == 4) {
+        const __m128i mask = _mm_setr_epi8(
+            o[0], o[1], o[2], 4+o[0], 4+o[1], 4+o[2], 8+o[0], 8+o[1], 8+o[2], 12+o[0], 12+o[1], 12+o[2], -1, -1, -1, -1);
+        for (; x + 6 <= width; x += 4)
+            _mm_storeu_si128((__m128i*)(dst + x * 3), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + x * 4)), mask));
+    } else {
+        const __m128i mask = _mm_setr_epi8(
+            o[0], o[1], o[2], 3+o[0], 3+o[1], 3+o[2], 6+o[0], 6+o[1], 6+o[2], 9+o[0], 9+o[1], 9+o[2], 12+o[0], 12+o[1], 12+o[2], 15);
+        for (; x + 6 <= width; x += 5)
+            _mm_storeu_si128((__m128i*)(dst + x * 3), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + x * 3)), mask));
+    }
+    return x;
+}
+#endif
+
+// Converts one row of packed pixels to BGR. The vector kernels write straight
+// into the row, so they're only used when uchar3 has no padding.
+static void ReadRow(const uint8_t * src, uchar3 * dst, unsigned width, PixelFormat format) {
+    unsigned x = 0, size = PixelSize(format);
+    if (sizeof(uchar3) == 3) {
+        if (format == PIXEL_BGR) {
+            memcpy(dst, src, (size_t)width * 3);
+            return;
+        }
+#ifdef PIXEL_SIMD
+        static const bool avx2 = __builtin_cpu_supports("avx2"), ssse3 = __builtin_cpu_supports("ssse3");
+        if (avx2) x = ReadRow_avx2(src, (uint8_t*)dst, width, format);
+        if (ssse3) x += ReadRow_ssse3(src + x * size, (uint8_t*)(dst + x), width - x, format);
+#endif
+    }
+    const uint8_t * o = pixelOffsets[format];
+    for (const uint8_t * p = src + x * size; x < width; x++, p += size)
+        dst[x] = {p[o[0]], p[o[1]], p[o[2]]};
+}
+
+// CIELAB conversion. Pixels are stored as L scaled to 0-255 in the first
+// channel and a and b offset by 128 in the others. sRGB linearization is a
+// table lookup and the cube root is a bit-level estimate refined with two
+// Newton steps, which is well within a byte of precision; the scalar and AVX2
+// paths do the same float operations so they give identical results.
+static const float labM[3][3] = {
+    {0.4124564f / 0.95047f, 0.3575761f / 0.95047f, 0.1804375f / 0.95047f},
+    {0.2126729f, 0.7151522f, 0.0721750f},
+    {0.0193339f / 1.08883f, 0.1191920f / 1.08883f, 0.9503041f / 1.08883f}
+};
+
+static const float * LinearTable() {
+    static const std::array<float, 256> table = []() {
+        std::array<float, 256> t;
+        for (int i = 0; i < 256; i++) {
+            double c = i / 255.0;
+            t[i] = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+static inline float LabF(float t) {
+    if (t <= 0.008856f) return 7.787f * t + 16.0f / 116.0f;
+    uint32_t i;
+    memcpy(&i, &t, 4);
+    i = i / 3 + 0x2a514067;
+    float y;
+    memcpy(&y, &i, 4);
+    y = (2.0f * y + t / (y * y)) * (1.0f / 3.0f);
+    y = (2.0f * y + t / (y * y)) * (1.0f / 3.0f);
+    return y;
+}
+
+static inline uint8_t LabByte(float v) {
+    return (uint8_t)std::min(std::max(v + 0.5f, 0.0f), 255.0f);
+}
+
+#ifdef PIXEL_SIMD
+__attribute__((target("avx2")))
+static inline __m256 LabF_avx2(__m256 t) {
+    __m256i i = _mm256_castps_si256(t);
+    // no vector integer divide: i / 3 == (i * 0xAAAAAAAB) >> 33 for 32-bit i
+    __m256i lo = _mm256_srli_epi64(_mm256_mul_epu32(i, _mm256_set1_epi32(0xAAAAAAAB)), 33);
+    __m256i hi = _mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(i, 32), _mm256_set1_epi32(0xAAAAAAAB)), 33);
+    i = _mm256_add_epi32(_mm256_blend_epi32(lo, _mm256_slli_epi64(hi, 32), 0xAA), _mm256_set1_epi32(0x2a514067));
+    __m256 y = _mm256_castsi256_ps(i);
+    const __m256 two = _mm256_set1_ps(2.0f), third = _mm256_set1_ps(1.0f / 3.0f);
+    y = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(two, y), _mm256_div_ps(t, _mm256_mul_ps(y, y))), third);
+    y = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(two, y), _mm256_div_ps(t, _mm256_mul_ps(y, y))), third);
+    __m256 lin = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(7.787f), t), _mm256_set1_ps(16.0f / 116.0f));
+    return _mm256_blendv_ps(y, lin, _mm256_cmp_ps(t, _mm256_set1_ps(0.008856f), _CMP_LE_OQ));
+}
+
+// Converts 8 pixels at a time; returns the number of pixels converted.
+__attribute__((target("avx2")))
+static unsigned LabRow_avx2(uchar3 * row, unsigned width) {
+    const float * lin = LinearTable();
+    const __m256 zero = _mm256_setzero_ps(), max = _mm256_set1_ps(255.0f), half = _mm256_set1_ps(0.5f);
+    unsigned x = 0;
+    for (; x + 8 <= width; x += 8) {
+        alignas(32) int32_t c[3][8];
+        for (int j = 0; j < 8; j++) {
+            c[0][j] = row[x + j].z;
+            c[1][j] = row[x + j].y;
+            c[2][j] = row[x + j].x;
+        }
+        __m256 rgb[3];
+        for (int k = 0; k < 3; k++) rgb[k] = _mm256_i32gather_ps(lin, _mm256_load_si256((const __m256i*)c[k]), 4);
+        __m256 f[3];
+        for (int k = 0; k < 3; k++)
+            f[k] = LabF_avx2(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(labM[k][0]), rgb[0]),
+                _mm256_mul_ps(_mm256_set1_ps(labM[k][1]), rgb[1])), _mm256_mul_ps(_mm256_set1_ps(labM[k][2]), rgb[2])));
+        __m256 v[3] = {
+            _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(116.0f), f[1]), _mm256_set1_ps(16.0f)), _mm256_set1_ps(2.55f)),
+            _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(500.0f), _mm256_sub_ps(f[0], f[1])), _mm256_set1_ps(128.0f)),
+            _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(200.0f), _mm256_sub_ps(f[1], f[2])), _mm256_set1_ps(128.0f))
+        };
+        for (int k = 0; k < 3; k++)
+            _mm256_store_si256((__m256i*)c[k], _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_add_ps(v[k], half), zero), max)));
+        for (int j = 0; j < 8; j++) row[x + j] = {(uchar)c[0][j], (uchar)c[1][j], (uchar)c[2][j]};
+    }
+    return x;
+}
+#endif
+
+// Converts one row of BGR pixels to Lab in place.
+static void LabRow(uchar3 * row, unsigned width) {
+    unsigned x = 0;
+#ifdef PIXEL_SIMD
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) x = LabRow_avx2(row, width);
+#endif
+    const float * lin = LinearTable();
+    for (; x < width; x++) {
+        const float r = lin[row[x].z], g = lin[row[x].y], b = lin[row[x].x];
+        float f[3];
+        for (int k = 0; k < 3; k++) f[k] = LabF(labM[k][0] * r + labM[k][1] * g + labM[k][2] * b);
+        row[x] = {LabByte((116.0f * f[1] - 16.0f) * 2.55f), LabByte(500.0f * (f[0] - f[1]) + 128.0f), LabByte(200.0f * (f[1] - f[2]) + 128.0f)};
+    }
+}
+
+// Copies packed pixels into img, which must be the same size, splitting the
+// rows across threads. With lab set, each row is converted to Lab while it's
+// still in cache.
+inline void ReadRows(const uint8_t * data, size_t stride, PixelFormat format, Mat& img, bool lab) {
+    ParallelRows(img.width, img.height, [data, stride, format, &img, lab](unsigned start, unsigned end) {
+        for (unsigned y = start; y < end; y++) {
+            ReadRow(data + y * stride, &img[y][0], img.width, format);
+            if (lab) LabRow(&img[y][0], img.width);
+        }
+    });
+}
+
+// Converts an RGB image to Lab in out, which must be the same size.
+inline void LabRows(Mat& img, Mat& out) {
+    ParallelRows(img.width, img.height, [&img, &out](unsigned start, unsigned end) {
+        for (unsigned y = start; y < end; y++) {
+            Mat::row src = img[y];
+            Mat::row dst = out[y];
+            for (unsigned x = 0; x < img.width; x++) dst[x] = src[x];
+            LabRow(&dst[0], img.width);
+        }
+    });
+}
+
+// Converts a Lab palette made from LabRow output back to BGR.
+inline std::vector<Vec3b> LabToRGBPalette(const std::vector<Vec3b>& palette) {
+    std::vector<Vec3b> retval(palette.size());
+    for (size_t i = 0; i < palette.size(); i++) {
+        const double fy = (palette[i][0] / 2.55 + 16.0) / 116.0;
+        const double f[3] = {fy + (palette[i][1] - 128.0) / 500.0, fy, fy - (palette[i][2] - 128.0) / 200.0};
+        double xyz[3];
+        for (int k = 0; k < 3; k++) xyz[k] = f[k] * f[k] * f[k] > 0.008856 ? f[k] * f[k] * f[k] : (f[k] - 16.0 / 116.0) / 7.787;
+        xyz[0] *= 0.95047;
+        xyz[2] *= 1.08883;
+        const double rgb[3] = {
+            3.2404542 * xyz[0] - 1.5371385 * xyz[1] - 0.4985314 * xyz[2],
+            -0.9692660 * xyz[0] + 1.8760108 * xyz[1] + 0.0415560 * xyz[2],
+            0.0556434 * xyz[0] - 0.2040259 * xyz[1] + 1.0572252 * xyz[2]
+        };
+        for (int k = 0; k < 3; k++) {
+            double c = std::min(std::max(rgb[k], 0.0), 1.0);
+            c = c <= 0.0031308 ? c * 12.92 : 1.055 * pow(c, 1 / 2.4) - 0.055;
+            retval[i][2 - k] = (uchar)std::round(c * 255.0);
+        }
+    }
+    return retval;
+}
+
+#endif
@@ -0,0 +1,82 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const sanjuuni = require("..");
+
+const width = 48, height = 36;
+
+function makePixels(seed) {
+    const data = Buffer.alloc(width * height * 4);
+    for (let i = 0; i < data.length; i++) data[i] = (i * seed) & 0xFF;
+    return data;
+}
+
+function uncached(fn) {
+    const limit = sanjuuni.getCacheStats().limit;
+    sanjuuni.setCacheLimit(0);
+    try {
+        return fn();
+    } finally {
+        sanjuuni.setCacheLimit(limit);
+    }
+}
+
+test.beforeEach(() => {
+    sanjuuni.setCacheLimit(4 * 1024 * 1024);
+    sanjuuni.clearCache();
+});
+test.after(() => sanjuuni.setCacheLimit(0));
+
+test("repeated conversions hit the cache", () => {
+    const pixels = makePixels(3);
+    const first = sanjuuni.convert(pixels, width, height, "rgba");
+    const stats = sanjuuni.getCacheStats();
+    assert.ok(stats.entries > 0 && stats.bytes > 0);
+    assert.strictEqual(sanjuuni.convert(pixels, width, height, "rgba"), first);
+    assert.ok(sanjuuni.getCacheStats().hits > stats.hits);
+});
+
+test("changed pixels miss the cache", () => {
+    const pixels = makePixels(5);
+    sanjuuni.convert(pixels, width, height, "rgba");
+    pixels.fill(0x80, 0, width * 4 * 3);
+    const stats = sanjuuni.getCacheStats();
+    const output = sanjuuni.convert(pixels, width, height, "rgba");
+    const after = sanjuuni.getCacheStats();
+    assert.strictEqual(after.hits, stats.hits);
+    assert.ok(after.misses > stats.misses);
+    assert.strictEqual(output, uncached(() => sanjuuni.convert(pixels, width, height, "rgba")));
+});
+
+test("changed options miss the cache", () => {
+    const pixels = makePixels(7);
+    sanjuuni.convert(pixels, width, height, "rgba");
+    for (const options of [{ditherer: "ordered"}, {numColors: 8}, {output: "nfp"}, {quantizer: "octree"}]) {
+        const misses = sanjuuni.getCacheStats().misses;
+        const output = sanjuuni.convert(pixels, width, height, "rgba", options);
+        assert.ok(sanjuuni.getCacheStats().misses > misses, JSON.stringify(options));
+        assert.strictEqual(output, uncached(() => sanjuuni.convert(pixels, width, height, "rgba", options)), JSON.stringify(options));
+    }
+});
+
+test("palettes are cached by image contents", () => {
+    const pixels = makePixels(11);
+    const image = sanjuuni.makeRGBImage(pixels, width, height, "rgba");
+    const palette = sanjuuni.reducePalette_medianCut(image, 16);
+    const hits = sanjuuni.getCacheStats().hits;
+    assert.deepStrictEqual(sanjuuni.reducePalette_medianCut(sanjuuni.makeRGBImage(pixels, width, height, "rgba"), 16), palette);
+    assert.strictEqual(sanjuuni.getCacheStats().hits, hits + 1);
+    pixels.fill(0);
+    const changed = sanjuuni.makeRGBImage(pixels, width, height, "rgba");
+    assert.deepStrictEqual(sanjuuni.reducePalette_medianCut(changed, 16), uncached(() => sanjuuni.reducePalette_medianCut(changed, 16)));
+    assert.strictEqual(sanjuuni.getCacheStats().hits, hits + 1);
+});
+
+test("a zero limit disables the cache", () => {
+    sanjuuni.setCacheLimit(0);
+    const pixels = makePixels(13);
+    sanjuuni.convert(pixels, width, height, "rgba");
+    sanjuuni.convert(pixels, width, height, "rgba");
+    const stats = sanjuuni.getCacheStats();
+    assert.strictEqual(stats.entries, 0);
+    assert.strictEqual(stats.bytes, 0);
+});
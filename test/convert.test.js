@@ -0,0 +1,51 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const sanjuuni = require("..");
+
+const width = 64, height = 48;
+
+function makePixels(seed) {
+    const data = Buffer.alloc(width * height * 4);
+    let state = seed;
+    for (let i = 0; i < data.length; i += 4) {
+        state = (state * 1103515245 + 12345) >>> 0;
+        const x = (i / 4) % width, y = Math.floor(i / 4 / width);
+        data[i] = (x * 4 + (state >>> 28)) & 0xFF;
+        data[i+1] = (y * 5 + (state >>> 26)) & 0xFF;
+        data[i+2] = ((x + y) * 2) & 0xFF;
+        data[i+3] = 255;
+    }
+    return data;
+}
+
+const ditherers = {threshold: "thresholdImage", ordered: "ditherImage_ordered", floydSteinberg: "ditherImage_floydSteinberg"};
+const encoders = {lua: "makeLuaFile", nfp: "makeNFP", raw: "makeRawImage", "32vid_ans": "make32vid_ans"};
+
+function stepByStep(pixels, quantizer, ditherer, output) {
+    const image = sanjuuni.makeRGBImage(pixels, width, height, "rgba");
+    const palette = sanjuuni["reducePalette_" + quantizer](image, 16);
+    const indexed = sanjuuni[ditherers[ditherer]](image, palette);
+    return sanjuuni[encoders[output]](indexed, palette);
+}
+
+test("convert gives the same output as the step-by-step pipeline", async () => {
+    const pixels = makePixels(1);
+    for (const quantizer of ["medianCut", "octree"]) {
+        for (const ditherer of Object.keys(ditherers)) {
+            for (const output of Object.keys(encoders)) {
+                const expected = stepByStep(pixels, quantizer, ditherer, output);
+                const options = {quantizer, ditherer, output, numColors: 16};
+                const name = `${quantizer}/${ditherer}/${output}`;
+                assert.deepStrictEqual(sanjuuni.convert(pixels, width, height, "rgba", options), expected, name);
+                assert.deepStrictEqual(await sanjuuni.convertAsync(pixels, width, height, "rgba", options), expected, name + " (async)");
+            }
+        }
+    }
+});
+
+test("convert reads padded rows", () => {
+    const pixels = makePixels(2), stride = width * 4 + 12;
+    const padded = Buffer.alloc(stride * height, 0xAB);
+    for (let y = 0; y < height; y++) pixels.copy(padded, y * stride, y * width * 4, (y + 1) * width * 4);
+    assert.strictEqual(sanjuuni.convert(padded, width, height, "rgba", {stride}), sanjuuni.convert(pixels, width, height, "rgba"));
+});
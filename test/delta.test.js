@@ -0,0 +1,23 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const sanjuuni = require("..");
+
+const palette = [{r: 0, g: 0, b: 0}, {r: 255, g: 255, b: 255}];
+
+test("DeltaEncoder validates its options", () => {
+    for (const name of ["threshold", "mergeGap", "keyframeInterval"])
+        assert.throws(() => new sanjuuni.DeltaEncoder({[name]: "1"}), TypeError, name);
+    for (const options of [{threshold: -0.1}, {threshold: 1.5}, {threshold: NaN}, {mergeGap: -1}, {keyframeInterval: -1}])
+        assert.throws(() => new sanjuuni.DeltaEncoder(options), RangeError);
+    assert.throws(() => new sanjuuni.DeltaEncoder({keyframeFormat: "nope"}), TypeError);
+    assert.throws(() => new sanjuuni.DeltaEncoder({threads: -1}), TypeError);
+});
+
+test("DeltaEncoder sends unchanged frames as empty deltas", () => {
+    const image = sanjuuni.thresholdImage(sanjuuni.makeRGBImage(Buffer.alloc(8 * 9 * 4), 8, 9, "rgba"), palette);
+    const encoder = new sanjuuni.DeltaEncoder({keyframeInterval: 0});
+    assert.strictEqual(encoder.push(image, palette).keyframe, true);
+    const delta = encoder.push(image, palette);
+    assert.strictEqual(delta.keyframe, false);
+    assert.strictEqual(delta.cells, 0);
+});
@@ -0,0 +1,45 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const sanjuuni = require("..");
+
+const width = 40, height = 30;
+const pixels = Buffer.alloc(width * height * 3);
+for (let i = 0; i < pixels.length; i++) pixels[i] = (i * 13) & 0xFF;
+const palette = [{r: 0, g: 0, b: 0}, {r: 128, g: 128, b: 128}, {r: 255, g: 255, b: 255}];
+
+function makeImage() {
+    return sanjuuni.makeRGBImage(pixels, width, height, "rgb");
+}
+
+test("disposed images throw when used", () => {
+    const image = makeImage();
+    assert.strictEqual(image.disposed, false);
+    image.dispose();
+    assert.strictEqual(image.disposed, true);
+    image.dispose();
+    assert.throws(() => image.at(0, 0), /disposed/);
+    assert.throws(() => sanjuuni.thresholdImage(image, palette), /disposed/);
+    if (typeof Symbol.dispose === "symbol") assert.strictEqual(image[Symbol.dispose], image.dispose);
+});
+
+test("data buffers keep their pixels after dispose", () => {
+    const image = makeImage();
+    const expected = Buffer.from(image.data);
+    const data = image.data;
+    image.dispose();
+    // churn through images of the same size, which would reuse a freed buffer
+    for (let i = 0; i < 4; i++) sanjuuni.makeRGBImage(Buffer.alloc(pixels.length, 0x55), width, height, "rgb");
+    assert.deepStrictEqual(data, expected);
+});
+
+test("async work keeps its images alive through dispose", async () => {
+    const expected = sanjuuni.thresholdImage(makeImage(), palette).toBuffer();
+    const image = makeImage();
+    const pending = sanjuuni.thresholdImageAsync(image, palette);
+    image.dispose();
+    const indexed = await pending;
+    assert.deepStrictEqual(indexed.toBuffer(), expected);
+    const output = sanjuuni.makeLuaFileAsync(indexed, palette);
+    indexed.dispose();
+    assert.strictEqual(typeof await output, "string");
+});
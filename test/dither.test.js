@@ -0,0 +1,71 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const sanjuuni = require("..");
+
+// Gradients with noise, so errors spread across the whole image.
+function makeImage(width, height) {
+    const data = Buffer.alloc(width * height * 3);
+    let state = 12345;
+    for (let y = 0, i = 0; y < height; y++) {
+        for (let x = 0; x < width; x++, i += 3) {
+            state = (state * 1103515245 + 12345) >>> 0;
+            const noise = (state >>> 24) % 24 - 12;
+            data[i] = Math.max(0, Math.min(255, Math.floor(x * 255 / width) + noise));
+            data[i+1] = Math.max(0, Math.min(255, Math.floor(y * 255 / height) + noise));
+            data[i+2] = Math.max(0, Math.min(255, Math.floor((x + y) * 127 / (width + height)) + noise));
+        }
+    }
+    return sanjuuni.makeRGBImage(data, width, height, "rgb");
+}
+
+function compareThreadCounts(image, palette, options) {
+    const threads = sanjuuni.getThreadCount();
+    try {
+        sanjuuni.setThreadCount(1);
+        const serial = Buffer.from(sanjuuni.ditherImage_floydSteinberg(image, palette, options).toBuffer());
+        for (const count of [2, 3, 8]) {
+            sanjuuni.setThreadCount(count);
+            const parallel = sanjuuni.ditherImage_floydSteinberg(image, palette, options).toBuffer();
+            assert.ok(serial.equals(parallel), `output differs with ${count} threads`);
+        }
+    } finally {
+        sanjuuni.setThreadCount(threads);
+    }
+}
+
+test("wavefront Floyd-Steinberg gives the same bytes on any number of threads", () => {
+    const image = makeImage(640, 300);
+    compareThreadCounts(image, sanjuuni.reducePalette_medianCut(image, 16), {wavefront: true});
+});
+
+test("default Floyd-Steinberg gives the same bytes on any number of threads", () => {
+    const image = makeImage(640, 300);
+    compareThreadCounts(image, sanjuuni.reducePalette_medianCut(image, 16));
+});
+
+test("wavefront is opt-in", () => {
+    const image = makeImage(640, 300);
+    const palette = sanjuuni.reducePalette_medianCut(image, 16);
+    const plain = sanjuuni.ditherImage_floydSteinberg(image, palette).toBuffer();
+    const explicit = sanjuuni.ditherImage_floydSteinberg(image, palette, {wavefront: false}).toBuffer();
+    assert.ok(Buffer.from(plain).equals(explicit));
+});
+
+test("Floyd-Steinberg is deterministic across calls", async () => {
+    const image = makeImage(640, 300);
+    const palette = sanjuuni.reducePalette_medianCut(image, 16);
+    const sync = Buffer.from(sanjuuni.ditherImage_floydSteinberg(image, palette).toBuffer());
+    const async = (await sanjuuni.ditherImage_floydSteinbergAsync(image, palette)).toBuffer();
+    assert.ok(sync.equals(async));
+});
+
+test("ditherers take a per-call thread limit", async () => {
+    const image = makeImage(640, 300);
+    const palette = sanjuuni.reducePalette_medianCut(image, 16);
+    for (const name of ["thresholdImage", "ditherImage_ordered", "ditherImage_floydSteinberg"]) {
+        const all = Buffer.from(sanjuuni[name](image, palette).toBuffer());
+        assert.ok(all.equals(sanjuuni[name](image, palette, {threads: 1}).toBuffer()), name);
+        assert.ok(all.equals((await sanjuuni[name + "Async"](image, palette, {threads: 2})).toBuffer()), name + "Async");
+        assert.throws(() => sanjuuni[name](image, palette, {threads: "2"}), TypeError);
+    }
+});
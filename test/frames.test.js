@@ -0,0 +1,32 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const sanjuuni = require("..");
+
+const width = 48, height = 36;
+
+function makeFrame(seed) {
+    const data = Buffer.alloc(width * height * 3);
+    let state = seed;
+    for (let i = 0; i < data.length; i++) {
+        state = (state * 1103515245 + 12345) >>> 0;
+        data[i] = ((i % 97) * 2 + (state >>> 27)) & 0xFF;
+    }
+    return data;
+}
+
+const frames = [1, 2, 3, 4, 5, 6, 7].map(makeFrame);
+
+test("convertFrames gives the same outputs as converting each frame", async () => {
+    for (const output of ["lua", "32vid_ans"]) {
+        const options = {output, ditherer: "floydSteinberg"};
+        const expected = frames.map(frame => sanjuuni.convert(frame, width, height, "rgb", options));
+        for (const window of [undefined, 1, 3, 16])
+            assert.deepStrictEqual(sanjuuni.convertFrames(frames, width, height, "rgb", {...options, window}), expected, `window ${window}`);
+        assert.deepStrictEqual(await sanjuuni.convertFramesAsync(frames, width, height, "rgb", {...options, window: 2}), expected);
+    }
+});
+
+test("convertFrames rejects short frames and empty windows", () => {
+    assert.throws(() => sanjuuni.convertFrames([frames[0], Buffer.alloc(10)], width, height, "rgb"), RangeError);
+    assert.throws(() => sanjuuni.convertFrames(frames, width, height, "rgb", {window: 0}), TypeError);
+});
@@ -0,0 +1,52 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const sanjuuni = require("..");
+
+// Left half black, right half white, optionally with a red stripe on the first
+// row.
+function makeImage(width, height, stripe = false) {
+    const data = Buffer.alloc(width * height * 3);
+    for (let y = 0, i = 0; y < height; y++)
+        for (let x = 0; x < width; x++, i += 3)
+            data.set(stripe && y === 0 ? [255, 0, 0] : x < width / 2 ? [0, 0, 0] : [255, 255, 255], i);
+    return sanjuuni.makeRGBImage(data, width, height, "rgb");
+}
+
+function colorSet(palette) {
+    return palette.map(c => `${c.r},${c.g},${c.b}`).sort();
+}
+
+test("makeColorHistogram counts pixels and bins", () => {
+    const image = makeImage(20, 10, true);
+    const hist = sanjuuni.makeColorHistogram(image);
+    assert.strictEqual(hist.bits, 5);
+    assert.strictEqual(hist.total, 200);
+    assert.strictEqual(hist.colors, 3);
+    const sampled = sanjuuni.makeColorHistogram(image, {histogramBits: 2, sampleStride: 2});
+    assert.strictEqual(sampled.bits, 2);
+    assert.strictEqual(sampled.total, 50);
+});
+
+test("histogram palettes match palettes reduced from the image", async () => {
+    // a square number of pixels, so the histogram's sample image needs no padding
+    const image = makeImage(64, 64);
+    const direct = colorSet(sanjuuni.reducePalette_medianCut(image, 2));
+    const hist = sanjuuni.makeColorHistogram(image);
+    assert.deepStrictEqual(colorSet(sanjuuni.reducePalette_medianCut(hist, 2)), direct);
+    assert.deepStrictEqual(colorSet(sanjuuni.reducePalette_medianCut(image, 2, {histogramBits: 5})), direct);
+    assert.deepStrictEqual(colorSet(await sanjuuni.reducePalette_medianCutAsync(hist, 2)), direct);
+});
+
+test("sampled palettes still have the requested number of colors", () => {
+    const image = makeImage(128, 96);
+    for (const options of [{sampleStride: 3}, {maxSamples: 500}, {histogramBits: 4, maxSamples: 100}])
+        assert.strictEqual(sanjuuni.reducePalette_octree(image, 2, options).length, 2, JSON.stringify(options));
+});
+
+test("histogram samples come from the image pool", () => {
+    const image = makeImage(64, 33);
+    sanjuuni.reducePalette_medianCut(image, 2, {histogramBits: 5});
+    const hits = sanjuuni.getImagePoolStats().hits;
+    sanjuuni.reducePalette_medianCut(image, 2, {histogramBits: 5});
+    assert.ok(sanjuuni.getImagePoolStats().hits > hits);
+});
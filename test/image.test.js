@@ -0,0 +1,42 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const sanjuuni = require("..");
+
+const width = 37, height = 5;
+const pixels = [];
+for (let y = 0; y < height; y++) {
+    const row = [];
+    for (let x = 0; x < width; x++) row.push([(x * 7) & 0xFF, (y * 50 + x) & 0xFF, (x * y * 3) & 0xFF]);
+    pixels.push(row);
+}
+
+function pack(format) {
+    const size = format.length;
+    const data = Buffer.alloc(width * height * size);
+    for (let y = 0, i = 0; y < height; y++) {
+        for (let x = 0; x < width; x++, i += size) {
+            const [r, g, b] = pixels[y][x];
+            for (let c = 0; c < size; c++) data[i + c] = {r, g, b, a: 255}[format[c]];
+        }
+    }
+    return data;
+}
+
+test("every pixel format reads the same pixels as a color array", () => {
+    const expected = sanjuuni.makeRGBImage(pixels).getRegion(0, 0, width, height, "rgb");
+    for (const format of ["rgb", "bgr", "rgba", "bgra", "argb", "abgr"]) {
+        const image = sanjuuni.makeRGBImage(pack(format), width, height, format);
+        assert.deepStrictEqual(image.getRegion(0, 0, width, height, "rgb"), expected, format);
+    }
+});
+
+test("invalid pixel arrays throw without leaking the image", () => {
+    sanjuuni.trimImagePool();
+    assert.throws(() => sanjuuni.makeRGBImage([[[0, 0, 0], [0, 0]]]), TypeError);
+    assert.throws(() => sanjuuni.makeRGBImage([[{r: 0, g: 0, b: 0}, {r: 0, g: 0}]]), TypeError);
+    assert.throws(() => sanjuuni.makeRGBImage([[[0, 0, 0], "x"]]), TypeError);
+    assert.throws(() => sanjuuni.makeRGBImage([[[0, 0, 0]], [[0, 0, 0], [0, 0, 0]]]), TypeError);
+    assert.throws(() => sanjuuni.makeRGBImage([]), RangeError);
+    // the partly filled images went back to the pool
+    assert.ok(sanjuuni.getImagePoolStats().images >= 1);
+});
@@ -0,0 +1,25 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const sanjuuni = require("..");
+
+const palette = [{r: 0, g: 0, b: 0}, {r: 255, g: 255, b: 255}];
+
+test("IncrementalConverter rejects frames smaller than a character", () => {
+    const converter = new sanjuuni.IncrementalConverter(palette);
+    assert.throws(() => converter.push(Buffer.alloc(4), 1, 1, "rgba"), /smaller than one character/);
+    // the converter is still usable afterwards
+    const frame = converter.push(Buffer.alloc(4 * 6), 2, 3, "rgba");
+    assert.strictEqual(frame.full, true);
+    assert.strictEqual(frame.cells, 1);
+});
+
+test("IncrementalConverter rejects frames that don't fit their buffer", () => {
+    const converter = new sanjuuni.IncrementalConverter(palette);
+    converter.push(Buffer.alloc(4 * 4 * 6), 4, 6, "rgba");
+    assert.throws(() => converter.push(Buffer.alloc(4 * 4 * 6), 8, 6, "rgba"));
+});
+
+test("IncrementalConverter.pushAsync rejects frames smaller than a character", async () => {
+    const converter = new sanjuuni.IncrementalConverter(palette);
+    await assert.rejects(converter.pushAsync(Buffer.alloc(4), 1, 1, "rgba"), /smaller than one character/);
+});
@@ -0,0 +1,39 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const sanjuuni = require("..");
+
+const width = 40, height = 30;
+const data = Buffer.alloc(width * height * 3);
+for (let i = 0; i < data.length; i++) data[i] = (i * 71) & 0xFF;
+const rgb = sanjuuni.makeRGBImage(data, width, height, "rgb");
+const palette = sanjuuni.reducePalette_medianCut(rgb, 16);
+const image = sanjuuni.thresholdImage(rgb, palette);
+
+const outputs = {
+    nfp: () => Buffer.from(sanjuuni.makeNFP(image, palette)),
+    "32vid": () => sanjuuni.make32vid(image, palette),
+    "32vid_cmp": () => sanjuuni.make32vid_cmp(image, palette),
+    "32vid_ans": () => sanjuuni.make32vid_ans(image, palette)
+};
+
+test("makeOutputInto writes the same bytes as the encoder", async () => {
+    for (const [format, encode] of Object.entries(outputs)) {
+        const expected = encode();
+        const target = Buffer.alloc(expected.length + 20, 0xEE);
+        assert.strictEqual(sanjuuni.makeOutputInto(image, palette, format, target, 7), expected.length, format);
+        assert.deepStrictEqual(target.subarray(7, 7 + expected.length), expected, format);
+        assert.ok(target.subarray(0, 7).every(b => b === 0xEE) && target.subarray(7 + expected.length).every(b => b === 0xEE), format);
+        const array = new ArrayBuffer(expected.length);
+        assert.strictEqual(await sanjuuni.makeOutputIntoAsync(image, palette, format, array), expected.length, format);
+        assert.deepStrictEqual(Buffer.from(array), expected, format);
+    }
+});
+
+test("makeOutputInto throws when the output doesn't fit", async () => {
+    const expected = outputs["32vid"]();
+    const target = Buffer.alloc(expected.length, 0xEE);
+    assert.throws(() => sanjuuni.makeOutputInto(image, palette, "32vid", target, 1), RangeError);
+    assert.ok(target.every(b => b === 0xEE), "nothing is written");
+    assert.throws(() => sanjuuni.makeOutputInto(image, palette, "32vid", target, target.length + 1), RangeError);
+    await assert.rejects(sanjuuni.makeOutputIntoAsync(image, palette, "32vid", Buffer.alloc(4)));
+});
@@ -0,0 +1,60 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const sanjuuni = require("..");
+
+function makeIndexed(width, height, seed) {
+    const data = Buffer.alloc(width * height * 3);
+    let state = seed;
+    for (let i = 0; i < data.length; i++) {
+        state = (state * 1103515245 + 12345) >>> 0;
+        data[i] = state >>> 24;
+    }
+    const image = sanjuuni.makeRGBImage(data, width, height, "rgb");
+    const palette = sanjuuni.reducePalette_medianCut(image, 16);
+    return {image: sanjuuni.thresholdImage(image, palette), palette};
+}
+
+const formats = ["table", "bimg", "nfp", "lua", "raw", "32vid", "32vid_cmp", "32vid_ans"];
+
+function individually(image, palette, compact) {
+    return [
+        sanjuuni.makeTable(image, palette, compact, false, false),
+        sanjuuni.makeTable(image, palette, compact, true, false),
+        sanjuuni.makeNFP(image, palette),
+        sanjuuni.makeLuaFile(image, palette),
+        sanjuuni.makeRawImage(image, palette),
+        sanjuuni.make32vid(image, palette),
+        sanjuuni.make32vid_cmp(image, palette),
+        sanjuuni.make32vid_ans(image, palette)
+    ];
+}
+
+test("makeOutputs matches the individual encoders", async () => {
+    const {image, palette} = makeIndexed(40, 30, 7);
+    for (const compact of [false, true]) {
+        const expected = individually(image, palette, compact);
+        assert.deepStrictEqual(sanjuuni.makeOutputs(image, palette, formats, {compact}), expected);
+        assert.deepStrictEqual(sanjuuni.makeOutputs(image, palette, formats, {compact, parallel: true}), expected);
+        assert.deepStrictEqual(await sanjuuni.makeOutputsAsync(image, palette, formats, {compact, parallel: true}), expected);
+    }
+});
+
+test("cached CC planes aren't reused with a different palette", () => {
+    const {image, palette} = makeIndexed(40, 30, 8);
+    const other = palette.map(color => ({r: 255 - color.r, g: color.g, b: color.b}));
+    const first = sanjuuni.makeOutputs(image, palette, ["lua"])[0];
+    const second = sanjuuni.makeOutputs(image, other, ["lua"])[0];
+    const fresh = makeIndexed(40, 30, 8);
+    assert.strictEqual(first, sanjuuni.makeLuaFile(fresh.image, palette));
+    assert.strictEqual(second, sanjuuni.makeLuaFile(fresh.image, other));
+});
+
+test("outputs follow writes through an image's data buffer", () => {
+    const {image, palette} = makeIndexed(40, 30, 9);
+    sanjuuni.makeLuaFile(image, palette);
+    const data = image.data;
+    data.fill(0);
+    const blank = sanjuuni.makeRGBImage(Buffer.alloc(40 * 30 * 3), 40, 30, "rgb");
+    const expected = sanjuuni.makeLuaFile(sanjuuni.thresholdImage(blank, [palette[0]]), palette);
+    assert.strictEqual(sanjuuni.makeLuaFile(image, palette), expected);
+});
@@ -0,0 +1,31 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const sanjuuni = require("..");
+
+const image = sanjuuni.makeRGBImage(Buffer.alloc(4 * 6 * 4), 4, 6, "rgba");
+
+test("Empty palettes are rejected", () => {
+    assert.throws(() => sanjuuni.ditherImage_floydSteinberg(image, []), RangeError);
+    assert.throws(() => sanjuuni.ditherImage_floydSteinberg(image, new Uint8Array(0)), RangeError);
+    assert.throws(() => sanjuuni.thresholdImage(image, new Uint8Array(0)), RangeError);
+});
+
+test("Array palettes hold at most 256 colors", () => {
+    const color = {r: 0, g: 0, b: 0};
+    assert.throws(() => sanjuuni.thresholdImage(image, new Array(257).fill(color)), RangeError);
+    sanjuuni.thresholdImage(image, new Array(256).fill(color));
+});
+
+test("Packed palettes must hold whole colors", () => {
+    assert.throws(() => sanjuuni.thresholdImage(image, new Uint8Array(4)), RangeError);
+    assert.throws(() => sanjuuni.thresholdImage(image, new Uint8Array(257 * 3)), RangeError);
+    sanjuuni.thresholdImage(image, new Uint8Array(3));
+});
+
+test("PaletteGenerator rejects out-of-range options", () => {
+    for (const options of [{numColors: 0}, {numColors: 257}, {histogramBits: 0}, {histogramBits: 7},
+                           {reuseThreshold: -1}, {sceneThreshold: NaN}, {maxIterations: -1}, {tolerance: Infinity}])
+        assert.throws(() => new sanjuuni.PaletteGenerator(options), RangeError, JSON.stringify(options));
+    assert.throws(() => new sanjuuni.PaletteGenerator({numColors: "16"}), TypeError);
+    new sanjuuni.PaletteGenerator({numColors: 256, histogramBits: 6, maxIterations: 0});
+});
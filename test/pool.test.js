@@ -0,0 +1,53 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const sanjuuni = require("..");
+
+const width = 64, height = 48;
+const pixels = Buffer.alloc(width * height * 4);
+for (let i = 0; i < pixels.length; i++) pixels[i] = (i * 29) & 0xFF;
+
+const defaultLimit = sanjuuni.getImagePoolStats().limit;
+
+test("converting frames of the same size reuses pooled images", () => {
+    sanjuuni.setImagePoolLimit(defaultLimit);
+    sanjuuni.convert(pixels, width, height, "rgba");
+    const first = sanjuuni.getImagePoolStats();
+    assert.ok(first.images > 0);
+    assert.ok(first.bytes > 0 && first.bytes <= first.limit);
+    sanjuuni.convert(pixels, width, height, "rgba");
+    const second = sanjuuni.getImagePoolStats();
+    assert.ok(second.hits > first.hits);
+    assert.strictEqual(second.misses, first.misses);
+});
+
+test("trimImagePool frees pooled images", () => {
+    sanjuuni.convert(pixels, width, height, "rgba");
+    sanjuuni.trimImagePool();
+    let stats = sanjuuni.getImagePoolStats();
+    assert.strictEqual(stats.images, 0);
+    assert.strictEqual(stats.bytes, 0);
+    sanjuuni.convert(pixels, width, height, "rgba");
+    sanjuuni.trimImagePool(width * height);
+    stats = sanjuuni.getImagePoolStats();
+    assert.ok(stats.bytes <= width * height);
+});
+
+test("a zero limit disables pooling", () => {
+    try {
+        sanjuuni.setImagePoolLimit(0);
+        sanjuuni.convert(pixels, width, height, "rgba");
+        const stats = sanjuuni.getImagePoolStats();
+        assert.strictEqual(stats.images, 0);
+        assert.strictEqual(stats.limit, 0);
+    } finally {
+        sanjuuni.setImagePoolLimit(defaultLimit);
+    }
+});
+
+test("pooled images don't leak pixels into new images", () => {
+    sanjuuni.setImagePoolLimit(defaultLimit);
+    const first = sanjuuni.makeRGBImage(pixels, width, height, "rgba");
+    first.dispose();
+    const blank = sanjuuni.makeRGBImage(Buffer.alloc(pixels.length), width, height, "rgba");
+    assert.ok(blank.data.every(byte => byte === 0));
+});
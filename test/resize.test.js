@@ -0,0 +1,57 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const sanjuuni = require("..");
+
+function makePixels(width, height) {
+    const data = Buffer.alloc(width * height * 3);
+    for (let y = 0, i = 0; y < height; y++)
+        for (let x = 0; x < width; x++, i += 3) data.set([x & 0xFF, y & 0xFF, (x ^ y) & 0xFF], i);
+    return data;
+}
+
+test("resizeImage makes an image of the requested size", async () => {
+    const image = sanjuuni.makeRGBImage(makePixels(64, 40), 64, 40, "rgb");
+    for (const filter of ["box", "bilinear"]) {
+        for (const [width, height] of [[32, 20], [100, 7], [1, 1]]) {
+            const resized = sanjuuni.resizeImage(image, width, height, filter);
+            assert.deepStrictEqual([resized.width, resized.height], [width, height]);
+            const async = await sanjuuni.resizeImageAsync(image, width, height, filter);
+            assert.deepStrictEqual(async.data, resized.data);
+        }
+    }
+});
+
+test("resizing keeps a solid color", () => {
+    const data = Buffer.alloc(30 * 30 * 3);
+    for (let i = 0; i < data.length; i += 3) data.set([200, 100, 50], i);
+    const image = sanjuuni.makeRGBImage(data, 30, 30, "rgb");
+    for (const filter of ["box", "bilinear"])
+        for (const [width, height] of [[7, 11], [61, 45]])
+            assert.deepStrictEqual(sanjuuni.resizeImage(image, width, height, filter).at(width - 1, height - 1), {r: 200, g: 100, b: 50});
+});
+
+test("fitTerminal keeps the aspect ratio in whole characters", () => {
+    const cases = [
+        // source size, terminal size, expected size
+        [[640, 480], [51, 19], [76, 57]],
+        [[100, 100], [80, 24], [72, 72]],
+        [[1000, 10], [20, 20], [40, 3]]
+    ];
+    for (const [[sw, sh], [cols, rows], expected] of cases) {
+        const image = sanjuuni.makeRGBImage(makePixels(sw, sh), sw, sh, "rgb");
+        const fitted = sanjuuni.fitTerminal(image, cols, rows);
+        assert.deepStrictEqual([fitted.width, fitted.height], expected, `${sw}x${sh} in ${cols}x${rows}`);
+        assert.ok(fitted.width <= cols * 2 && fitted.height <= rows * 3);
+    }
+});
+
+test("resizing while reading matches resizing afterwards", () => {
+    const pixels = makePixels(90, 60);
+    const full = sanjuuni.makeRGBImage(pixels, 90, 60, "rgb");
+    for (const filter of ["box", "bilinear"]) {
+        const read = sanjuuni.makeRGBImage(pixels, 90, 60, "rgb", {resize: {width: 40, height: 25, filter}});
+        assert.deepStrictEqual(read.data, sanjuuni.resizeImage(full, 40, 25, filter).data, filter);
+        const fitted = sanjuuni.makeRGBImage(pixels, 90, 60, "rgb", {resize: {cols: 20, rows: 10}});
+        assert.deepStrictEqual(fitted.data, sanjuuni.fitTerminal(full, 20, 10).data);
+    }
+});
@@ -0,0 +1,65 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const path = require("path");
+const {Worker} = require("worker_threads");
+const sanjuuni = require("..");
+
+const width = 20, height = 12;
+const pixels = Buffer.alloc(width * height * 3);
+for (let i = 0; i < pixels.length; i++) pixels[i] = (i * 17) & 0xFF;
+
+function runWorker(source, workerData) {
+    return new Promise((resolve, reject) => {
+        const worker = new Worker(`
+            const {parentPort, workerData} = require("worker_threads");
+            const sanjuuni = require(workerData.module);
+            ${source}
+        `, {eval: true, workerData: {module: path.join(__dirname, ".."), ...workerData}});
+        worker.once("message", resolve);
+        worker.once("error", reject);
+    });
+}
+
+test("shared images can be opened on another thread", async () => {
+    const image = sanjuuni.makeRGBImage(pixels, width, height, "rgb");
+    const expected = Buffer.from(image.data);
+    const data = await runWorker(`
+        const image = sanjuuni.openSharedImage(workerData.handle);
+        parentPort.postMessage({width: image.width, height: image.height, data: Buffer.from(image.data)});
+    `, {handle: image.share()});
+    assert.strictEqual(data.width, width);
+    assert.strictEqual(data.height, height);
+    assert.deepStrictEqual(Buffer.from(data.data), expected);
+});
+
+test("shared indexed images share memory", async () => {
+    const palette = sanjuuni.packPalette([{r: 0, g: 0, b: 0}, {r: 255, g: 255, b: 255}], true);
+    assert.ok(palette.buffer instanceof SharedArrayBuffer);
+    const image = sanjuuni.thresholdImage(sanjuuni.makeRGBImage(pixels, width, height, "rgb"), palette);
+    await runWorker(`
+        const image = sanjuuni.openSharedImage(workerData.handle);
+        image.data.fill(1);
+        parentPort.postMessage(sanjuuni.makeLuaFile(image, workerData.palette));
+    `, {handle: image.share(), palette});
+    assert.ok(image.data.every(index => index === 1));
+});
+
+test("handles can only be used once", () => {
+    const image = sanjuuni.makeRGBImage(pixels, width, height, "rgb");
+    const handle = image.share();
+    const opened = sanjuuni.openSharedImage(handle);
+    assert.deepStrictEqual(opened.data, image.data);
+    assert.throws(() => sanjuuni.openSharedImage(handle), /already been used/);
+    assert.throws(() => sanjuuni.releaseSharedImage(handle), /already been used/);
+    const unused = image.share();
+    sanjuuni.releaseSharedImage(unused);
+    assert.throws(() => sanjuuni.openSharedImage(unused), /already been used/);
+});
+
+test("shared images outlive dispose", () => {
+    const image = sanjuuni.makeRGBImage(pixels, width, height, "rgb");
+    const expected = Buffer.from(image.data);
+    const handle = image.share();
+    image.dispose();
+    assert.deepStrictEqual(Buffer.from(sanjuuni.openSharedImage(handle).data), expected);
+});
@@ -0,0 +1,46 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const sanjuuni = require("..");
+
+const width = 60, height = 30;
+const pixels = Buffer.alloc(width * height * 4);
+for (let i = 0; i < pixels.length; i++) pixels[i] = (i * 37) & 0xFF;
+
+test("stages are counted once per conversion while enabled", () => {
+    try {
+        sanjuuni.setStatsEnabled(true);
+        sanjuuni.resetStats();
+        sanjuuni.convert(pixels, width, height, "rgba", {ditherer: "threshold"});
+        sanjuuni.convert(pixels, width, height, "rgba", {ditherer: "threshold"});
+        const stats = sanjuuni.getStats();
+        assert.strictEqual(stats.enabled, true);
+        for (const stage of ["ingest", "quantize", "dither", "ccImage", "encode"]) {
+            assert.strictEqual(stats.stages[stage].calls, 2, stage);
+            assert.strictEqual(stats.stages[stage].pixels, 2 * width * height, stage);
+            assert.ok(stats.stages[stage].totalTime >= stats.stages[stage].lastTime, stage);
+        }
+        for (const stage of ["resize", "lab", "index"]) assert.strictEqual(stats.stages[stage].calls, 0, stage);
+    } finally {
+        sanjuuni.setStatsEnabled(false);
+    }
+});
+
+test("nothing is timed while disabled", () => {
+    sanjuuni.setStatsEnabled(false);
+    sanjuuni.resetStats();
+    sanjuuni.convert(pixels, width, height, "rgba");
+    const stats = sanjuuni.getStats();
+    assert.strictEqual(stats.enabled, false);
+    for (const stage in stats.stages) assert.strictEqual(stats.stages[stage].calls, 0, stage);
+});
+
+test("image memory follows live images", () => {
+    sanjuuni.resetStats();
+    const before = sanjuuni.getStats().imageMemory;
+    const image = sanjuuni.makeRGBImage(pixels, width, height, "rgba");
+    const during = sanjuuni.getStats().imageMemory;
+    assert.ok(during.allocated > before.allocated);
+    assert.ok(during.peak >= during.live);
+    image.dispose();
+    assert.ok(sanjuuni.getStats().imageMemory.live < during.live);
+});
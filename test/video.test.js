@@ -0,0 +1,55 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const sanjuuni = require("..");
+
+const palette = [{r: 0, g: 0, b: 0}, {r: 255, g: 255, b: 255}];
+
+function frame(width, height) {
+    return sanjuuni.thresholdImage(sanjuuni.makeRGBImage(Buffer.alloc(width * height * 4), width, height, "rgba"), palette);
+}
+
+test("VideoEncoder only counts frames that were encoded", () => {
+    const encoder = new sanjuuni.VideoEncoder();
+    encoder.push(frame(4, 6), palette);
+    assert.throws(() => encoder.push(frame(8, 6), palette), /does not match/);
+    assert.strictEqual(encoder.frames, 1);
+    // the chunk's frame count follows the file header and chunk size
+    assert.strictEqual(encoder.end().readUInt32LE(16), 1);
+});
+
+test("VideoStream with buffered starts its output with the final header", async () => {
+    const stream = sanjuuni.createVideoStream({buffered: true});
+    const chunks = [];
+    let header;
+    stream.on("data", chunk => chunks.push(chunk));
+    stream.on("header", h => header = h);
+    for (let i = 0; i < 3; i++) stream.write({image: frame(4, 6), palette});
+    stream.end();
+    await new Promise(resolve => stream.on("end", resolve));
+    const output = Buffer.concat(chunks);
+    assert.deepStrictEqual(output.subarray(0, header.length), header);
+    assert.strictEqual(header.readUInt32LE(16), 3);
+    assert.strictEqual(header.readUInt32LE(12), output.length - header.length);
+});
+
+test("VideoEncoder takes its size from the first frame that encodes", async () => {
+    const encoder = new sanjuuni.VideoEncoder();
+    // either frame may finish first; the other one must then be rejected
+    const results = await Promise.allSettled([encoder.pushAsync(frame(4, 6), palette), encoder.pushAsync(frame(8, 6), palette)]);
+    const encoded = results.findIndex(result => result.status === "fulfilled");
+    assert.notStrictEqual(encoded, -1);
+    assert.ok(results[1 - encoded].reason instanceof RangeError);
+    assert.strictEqual(encoder.frames, 1);
+    const header = encoder.end();
+    assert.strictEqual(header.readUInt16LE(4), encoded === 0 ? 2 : 4);
+    assert.strictEqual(header.readUInt16LE(6), 2);
+});
+
+test("VideoEncoder with custom compression writes make32vid_cmp frames", () => {
+    const encoder = new sanjuuni.VideoEncoder({compression: "custom"});
+    const image = frame(4, 6);
+    assert.deepStrictEqual(encoder.push(image, palette), sanjuuni.make32vid_cmp(image, palette));
+    const flags = encoder.end().readUInt16LE(10);
+    assert.strictEqual(flags & 3, 3);
+    assert.strictEqual(flags & 0x10, 0x10);
+});
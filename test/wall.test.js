@@ -0,0 +1,46 @@
+const test = require("node:test");
+const assert = require("node:assert");
+const sanjuuni = require("..");
+
+// 3x2 monitors of 10x5 characters, so the image fills the wall exactly
+const tileCols = 3, tileRows = 2, tileWidth = 20, tileHeight = 15;
+const width = tileCols * tileWidth, height = tileRows * tileHeight;
+const data = Buffer.alloc(width * height * 3);
+for (let y = 0, i = 0; y < height; y++)
+    for (let x = 0; x < width; x++, i += 3) data.set([x * 4, y * 8, ((x * y) & 0x3F) * 4], i);
+const image = sanjuuni.makeRGBImage(data, width, height, "rgb");
+
+function tilePixels(i) {
+    const x = (i % tileCols) * tileWidth, y = Math.floor(i / tileCols) * tileHeight;
+    return image.getRegion(x, y, tileWidth, tileHeight, "rgb");
+}
+
+test("shared palette tiles match cropping a full-frame conversion", async () => {
+    const palette = sanjuuni.reducePalette_medianCut(image, 16);
+    const options = {tileCols, tileRows, ditherer: "threshold", output: "lua"};
+    const tiles = sanjuuni.convertWall(image, options);
+    assert.strictEqual(tiles.length, tileCols * tileRows);
+    for (let i = 0; i < tiles.length; i++) {
+        const tile = sanjuuni.makeRGBImage(tilePixels(i), tileWidth, tileHeight, "rgb");
+        assert.strictEqual(tiles[i], sanjuuni.makeLuaFile(sanjuuni.thresholdImage(tile, palette), palette), `tile ${i}`);
+    }
+    assert.deepStrictEqual(await sanjuuni.convertWallAsync(image, options), tiles);
+});
+
+test("per-tile palettes match converting each tile on its own", () => {
+    const tiles = sanjuuni.convertWall(image, {tileCols, tileRows, palette: "tile", output: "32vid_ans"});
+    for (let i = 0; i < tiles.length; i++)
+        assert.deepStrictEqual(tiles[i], sanjuuni.convert(tilePixels(i), tileWidth, tileHeight, "rgb", {output: "32vid_ans"}), `tile ${i}`);
+});
+
+test("images are scaled to fill the wall", () => {
+    // 2x2 monitors of 4x3 characters make a 16x18 pixel wall
+    const tiles = sanjuuni.convertWall(image, {tileCols: 2, tileRows: 2, cellsPerTile: {cols: 4, rows: 3}, ditherer: "threshold"});
+    const scaled = sanjuuni.resizeImage(image, 16, 18);
+    const palette = sanjuuni.reducePalette_medianCut(scaled, 16);
+    for (let i = 0; i < 4; i++) {
+        const tile = sanjuuni.makeRGBImage(scaled.getRegion((i % 2) * 8, Math.floor(i / 2) * 9, 8, 9, "rgb"), 8, 9, "rgb");
+        assert.strictEqual(tiles[i], sanjuuni.makeLuaFile(sanjuuni.thresholdImage(tile, palette), palette), `tile ${i}`);
+    }
+    assert.throws(() => sanjuuni.convertWall(image, {tileCols: 100, tileRows: 1}), /too small/);
+});